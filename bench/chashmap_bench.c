@@ -0,0 +1,234 @@
+/*
+ * Read throughput of the dcache map under concurrent lookups.
+ *
+ * Preloads a set of keys, then runs N reader threads doing random gets
+ * while one writer keeps inserting and removing a separate set of keys,
+ * which also forces periodic rehashes. Every get is checked against the
+ * value stored for its key. The same run is repeated for hashmap.c behind
+ * a pthread_rwlock, the scheme the dcache used before, and gets/sec is
+ * printed for each thread count.
+ *
+ * usage: chashmap_bench [keys] [milliseconds per run] [max threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "hashmap.h"
+#include "chashmap.h"
+#include "epoch.h"
+
+#define CHURN_KEYS 1024
+
+typedef struct bench_ops
+{
+    const char *name;
+    void *(*create)();
+    int (*get)(void *map, const char *key, any_t *value);
+    void (*put)(void *map, char *key, any_t value);
+    void (*remove)(void *map, const char *key);
+} BenchOps;
+
+static int num_keys = 100000;
+static char **keys;
+static char **churn_keys;
+static int running;
+static int failed;
+
+/* Lock-free map: readers bracket the get with an epoch section. */
+static void *cmap_create() {
+    return chashmap_new();
+}
+
+static int cmap_get(void *map, const char *key, any_t *value) {
+    int rc;
+    epoch_enter();
+    rc = chashmap_get(map, key, value);
+    epoch_exit();
+    return rc;
+}
+
+static void cmap_put(void *map, char *key, any_t value) {
+    chashmap_put(map, key, value, NULL);
+}
+
+static void cmap_remove(void *map, const char *key) {
+    chashmap_remove(map, key, NULL);
+}
+
+/* hashmap.c under one reader/writer lock. */
+typedef struct locked_map
+{
+    map_t map;
+    pthread_rwlock_t lock;
+} LockedMap;
+
+static void *lmap_create() {
+    LockedMap *m = malloc(sizeof(LockedMap));
+    m->map = hashmap_new();
+    pthread_rwlock_init(&m->lock, NULL);
+    return m;
+}
+
+static int lmap_get(void *map, const char *key, any_t *value) {
+    LockedMap *m = map;
+    int rc;
+    pthread_rwlock_rdlock(&m->lock);
+    rc = hashmap_get(m->map, (char *) key, value);
+    pthread_rwlock_unlock(&m->lock);
+    return rc;
+}
+
+static void lmap_put(void *map, char *key, any_t value) {
+    LockedMap *m = map;
+    pthread_rwlock_wrlock(&m->lock);
+    hashmap_put(m->map, key, value);
+    pthread_rwlock_unlock(&m->lock);
+}
+
+static void lmap_remove(void *map, const char *key) {
+    LockedMap *m = map;
+    pthread_rwlock_wrlock(&m->lock);
+    hashmap_remove(m->map, (char *) key);
+    pthread_rwlock_unlock(&m->lock);
+}
+
+static const BenchOps all_ops[] = {
+    {"chashmap", cmap_create, cmap_get, cmap_put, cmap_remove},
+    {"hashmap+rwlock", lmap_create, lmap_get, lmap_put, lmap_remove},
+};
+
+typedef struct worker
+{
+    pthread_t thread;
+    const BenchOps *ops;
+    void *map;
+    unsigned int seed;
+    unsigned long count;
+} Worker;
+
+static void *reader(void *arg) {
+    Worker *w = arg;
+    unsigned long count = 0;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        int i = rand_r(&w->seed) % num_keys;
+        any_t value;
+        if (w->ops->get(w->map, keys[i], &value) != MAP_OK || value != (any_t) (uintptr_t) (i + 1)) {
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        }
+        count++;
+    }
+    w->count = count;
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    Worker *w = arg;
+    unsigned long count = 0;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        int i = count % CHURN_KEYS;
+        w->ops->put(w->map, churn_keys[i], (any_t) (uintptr_t) (i + 1));
+        w->ops->remove(w->map, churn_keys[(i + CHURN_KEYS / 2) % CHURN_KEYS]);
+        count++;
+    }
+    w->count = count;
+    return NULL;
+}
+
+static double run(const BenchOps *ops, int threads, int millis) {
+    Worker *workers = calloc(threads + 1, sizeof(Worker));
+    struct timespec start, end;
+    unsigned long total = 0;
+    void *map = ops->create();
+    int i;
+
+    for (i = 0; i < num_keys; i++) {
+        ops->put(map, keys[i], (any_t) (uintptr_t) (i + 1));
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i <= threads; i++) {
+        workers[i].ops = ops;
+        workers[i].map = map;
+        workers[i].seed = i + 1;
+        pthread_create(&workers[i].thread, NULL, i == threads ? writer : reader, &workers[i]);
+    }
+    usleep(millis * 1000);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    for (i = 0; i <= threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < threads; i++) {
+        total += workers[i].count;
+    }
+    free(workers);
+    /* The maps are leaked: the bench only runs a handful of them. */
+    return total / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static char *make_key(const char *prefix, int i) {
+    char *key = malloc(64);
+    snprintf(key, 64, "/%s/dir%d/file%d", prefix, i % 97, i);
+    return key;
+}
+
+int main(int argc, char *argv[]) {
+    int millis = 500;
+    int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int i, threads;
+    size_t o;
+
+    if (argc > 1) {
+        num_keys = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        millis = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        max_threads = atoi(argv[3]);
+    }
+    if (num_keys <= 0 || millis <= 0 || max_threads <= 0) {
+        fprintf(stderr, "usage: %s [keys] [milliseconds per run] [max threads]\n", argv[0]);
+        return 1;
+    }
+
+    keys = malloc(num_keys * sizeof(char *));
+    for (i = 0; i < num_keys; i++) {
+        keys[i] = make_key("k", i);
+    }
+    churn_keys = malloc(CHURN_KEYS * sizeof(char *));
+    for (i = 0; i < CHURN_KEYS; i++) {
+        churn_keys[i] = make_key("churn", i);
+    }
+
+    printf("%d keys, %d ms per run, one churning writer\n", num_keys, millis);
+    printf("%-8s", "threads");
+    for (o = 0; o < sizeof(all_ops) / sizeof(all_ops[0]); o++) {
+        printf(" %18s", all_ops[o].name);
+    }
+    printf("   (gets/sec)\n");
+
+    for (threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        printf("%-8d", threads);
+        for (o = 0; o < sizeof(all_ops) / sizeof(all_ops[0]); o++) {
+            printf(" %18.0f", run(&all_ops[o], threads, millis));
+            fflush(stdout);
+        }
+        printf("\n");
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    if (failed) {
+        fprintf(stderr, "a get returned a wrong value\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Memory saved by compressing cold files, and what reading them costs.
+ *
+ * Fills a set of files with text-like data (words drawn from a small
+ * vocabulary, as in logs and source trees), measures 4 KB read latency
+ * while they are hot, compresses them the way the --cold-after scanner
+ * does, and measures again: once touching a different chunk on every
+ * read so each one decompresses (a cold miss), and once reading through
+ * chunks in order so all but the first read of each hit the cache.
+ *
+ * usage: cold_bench [files] [file MB] [reads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include "content.h"
+#include "cold.h"
+
+#define READ_SIZE 4096
+
+static int files, file_mb, reads;
+
+static long resident_bytes() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long next_random(unsigned long *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/* Words and numbers separated by spaces and newlines. */
+static void fill(char *buf, size_t size, unsigned long seed) {
+    static const char *words[] = {
+            "the", "node", "chunk", "lock", "read", "write", "error", "return", "size", "offset",
+            "INFO", "WARN", "request", "handler", "static", "int", "if", "else", "for", "while",
+            "struct", "content", "journal", "snapshot", "directory", "file", "open", "close",
+    };
+    const int count = sizeof(words) / sizeof(words[0]);
+    unsigned long x = 0x9e3779b97f4a7c15UL * (seed + 1);
+    size_t i = 0;
+    while (i < size) {
+        unsigned long r = next_random(&x);
+        char word[32];
+        int n = r % 4 == 0 ? snprintf(word, sizeof(word), "%lu", (r >> 8) % 100000)
+                           : snprintf(word, sizeof(word), "%s", words[(r >> 8) % count]);
+        word[n++] = (r >> 20) % 12 == 0 ? '\n' : ' ';
+        if ((size_t) n > size - i) {
+            n = size - i;
+        }
+        memcpy(buf + i, word, n);
+        i += n;
+    }
+}
+
+/* Mean latency in ns of 4 KB reads; sequential walks each chunk in order. */
+static double read_latency(Content *contents, size_t size, int sequential) {
+    char buf[READ_SIZE];
+    unsigned long x = 12345;
+    size_t per_chunk = CHUNK_SIZE / READ_SIZE;
+    int i;
+    double start = now();
+    for (i = 0; i < reads; i++) {
+        size_t offset;
+        int file;
+        if (sequential) {
+            unsigned long chunk = i / per_chunk;
+            file = chunk % files;
+            offset = (chunk / files * CHUNK_SIZE + i % per_chunk * READ_SIZE) % size;
+        } else {
+            file = next_random(&x) % files;
+            offset = next_random(&x) % (size / READ_SIZE) * READ_SIZE;
+        }
+        content_read(&contents[file], buf, READ_SIZE, offset);
+    }
+    return (now() - start) * 1e9 / reads;
+}
+
+int main(int argc, char *argv[]) {
+    files = argc > 1 ? atoi(argv[1]) : 64;
+    file_mb = argc > 2 ? atoi(argv[2]) : 8;
+    reads = argc > 3 ? atoi(argv[3]) : 200000;
+    if (files <= 0 || file_mb <= 0 || reads <= 0) {
+        fprintf(stderr, "usage: %s [files] [file MB] [reads]\n", argv[0]);
+        return 1;
+    }
+
+    size_t size = (size_t) file_mb << 20;
+    Content *contents = calloc(files, sizeof(Content));
+    char *data = malloc(size);
+    int i;
+
+    long before = resident_bytes();
+    for (i = 0; i < files; i++) {
+        fill(data, size, i);
+        content_init(&contents[i]);
+        if (content_write(&contents[i], data, size, 0) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    free(data);
+    malloc_trim(0);
+    long hot = resident_bytes() - before;
+    double hot_ns = read_latency(contents, size, 0);
+
+    double start = now();
+    for (i = 0; i < files; i++) {
+        content_compress(&contents[i]);
+    }
+    double seconds = now() - start;
+    malloc_trim(0);
+    long cold = resident_bytes() - before;
+
+    double miss_ns = read_latency(contents, size, 0);
+    double seq_ns = read_latency(contents, size, 1);
+
+    ColdStats stats;
+    cold_get_stats(&stats);
+    printf("data        %10.1f MB in %d files\n", (double) files * size / 1048576.0, files);
+    printf("RSS hot     %10.1f MB\n", hot / 1048576.0);
+    printf("RSS cold    %10.1f MB (stored %.1f MB, ratio %.2f)\n", cold / 1048576.0,
+           stats.compressed_bytes / 1048576.0,
+           stats.compressed_bytes > 0 ? (double) stats.uncompressed_bytes / stats.compressed_bytes : 1.0);
+    printf("compress    %10.0f MB/sec\n", stats.uncompressed_bytes / 1048576.0 / seconds);
+    printf("read hot    %10.0f ns per 4 KB\n", hot_ns);
+    printf("read miss   %10.0f ns per 4 KB\n", miss_ns);
+    printf("read seq    %10.0f ns per 4 KB (%lu hits, %lu misses, %.1f us per miss)\n", seq_ns,
+           stats.hits, stats.misses, stats.misses > 0 ? stats.miss_ns / 1e3 / stats.misses : 0.0);
+
+    for (i = 0; i < files; i++) {
+        content_free(&contents[i]);
+    }
+    free(contents);
+    return 0;
+}
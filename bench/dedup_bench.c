@@ -0,0 +1,128 @@
+/*
+ * Memory use of a duplicate-heavy corpus with and without dedup.
+ *
+ * Builds a corpus the way CI workers fill xyfs: a set of distinct
+ * artifacts (a few MB each) and vendored source files (a few KB each),
+ * each written as several identical copies. Every file is written in
+ * 128 KB pieces like FUSE writes arrive, then closed, which is when
+ * --dedup moves its chunks into the block store. Each mode runs in a
+ * child process and reports the growth of its resident set.
+ *
+ * usage: dedup_bench [copies] [artifacts] [sources]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "content.h"
+#include "dedup.h"
+
+#define WRITE_SIZE (128 * 1024)
+
+static int copies, artifacts, sources;
+
+static long resident_bytes() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Deterministic, incompressible bytes for corpus file i. */
+static void fill(char *buf, size_t size, unsigned long i) {
+    unsigned long x = 0x9e3779b97f4a7c15UL * (i + 1);
+    size_t j;
+    for (j = 0; j < size; j++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[j] = (char) x;
+    }
+}
+
+static void write_file(Content *content, const char *data, size_t size, int dedup) {
+    size_t done;
+    content_init(content);
+    for (done = 0; done < size; done += WRITE_SIZE) {
+        size_t n = size - done < WRITE_SIZE ? size - done : WRITE_SIZE;
+        if (content_write(content, data + done, n, done) != 0) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    if (dedup) {
+        content_dedup(content);
+    }
+}
+
+static void run(int dedup) {
+    int count = (artifacts + sources) * copies;
+    Content *files = calloc(count, sizeof(Content));
+    size_t *sizes = calloc(artifacts + sources, sizeof(size_t));
+    char **corpus = calloc(artifacts + sources, sizeof(char *));
+    size_t logical = 0;
+    int i, c, n = 0;
+
+    for (i = 0; i < artifacts + sources; i++) {
+        /* Artifacts of 1-8 MB, sources of 1-32 KB. */
+        sizes[i] = i < artifacts ? (size_t) (1 + i % 8) << 20 : (size_t) (1 + i % 32) << 10;
+        corpus[i] = malloc(sizes[i]);
+        fill(corpus[i], sizes[i], i);
+    }
+
+    long before = resident_bytes();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (c = 0; c < copies; c++) {
+        for (i = 0; i < artifacts + sources; i++) {
+            write_file(&files[n++], corpus[i], sizes[i], dedup);
+            logical += sizes[i];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long grown = resident_bytes() - before;
+
+    DedupStats stats;
+    dedup_get_stats(&stats);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-8s %8d %10.1f %10.1f %8.2f %10.0f\n", dedup ? "dedup" : "private", count,
+           logical / 1048576.0, grown / 1048576.0,
+           stats.stored_bytes > 0 ? (double) stats.logical_bytes / stats.stored_bytes : 1.0,
+           logical / 1048576.0 / seconds);
+
+    for (i = 0; i < count; i++) {
+        content_free(&files[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int dedup;
+
+    copies = argc > 1 ? atoi(argv[1]) : 8;
+    artifacts = argc > 2 ? atoi(argv[2]) : 16;
+    sources = argc > 3 ? atoi(argv[3]) : 2000;
+    if (copies <= 0 || artifacts < 0 || sources < 0 || artifacts + sources == 0) {
+        fprintf(stderr, "usage: %s [copies] [artifacts] [sources]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-8s %8s %10s %10s %8s %10s\n", "mode", "files", "data MB", "RSS MB", "ratio", "MB/sec");
+    fflush(stdout);
+    for (dedup = 0; dedup <= 1; dedup++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(dedup);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
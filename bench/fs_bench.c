@@ -0,0 +1,623 @@
+/*
+ * Filesystem operations driven straight through the path engine's
+ * callbacks, with no FUSE mount in between.
+ *
+ * Builds a tree with init_root and runs synthetic workloads against the
+ * ramdisk_* functions the kernel's requests would reach: getattr on
+ * random paths at the bottom of a deep tree, creating and unlinking a
+ * huge directory's worth of files, small-file churn (create, write,
+ * close, open, read, close, unlink), and sequential and random reads and
+ * writes of one large file at several request sizes. Each operation is
+ * timed on its own; ops/sec and latency percentiles are printed for each
+ * workload, so hot-path regressions show up without kernel noise. The
+ * large file is then truncated, checking that its memory comes back, and
+ * a file with holes punched in it is checked with SEEK_DATA/SEEK_HOLE.
+ * Renames are timed moving a populated directory back and forth, after
+ * their outcomes (errors, flags, the tree left behind) are checked.
+ * Before any of it, forked children check that a journal replays onto
+ * the tree it was written from.
+ *
+ * usage: fs_bench [directory files] [file MB] [ops per workload]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <linux/falloc.h>
+#include "xyfs.h"
+#include "ramdisk.h"
+#include "snapshot.h"
+
+#define TREE_DEPTH 12
+#define TREE_FANOUT 4
+#define CHURN_DIRS 16
+
+static int dir_files, file_mb, ops;
+static uint64_t *samples;
+static int sample_count;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned long next_random(unsigned long *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+    int i = (int) (p * (sample_count - 1));
+    return samples[i] / 1e3;
+}
+
+/* Print the workload timed since the last report and start a new one. */
+static void report(const char *name, uint64_t start) {
+    double seconds = (now_ns() - start) / 1e9;
+    qsort(samples, sample_count, sizeof(uint64_t), compare_samples);
+    printf("%-22s %10.0f ops/sec  p50 %7.2f  p90 %7.2f  p99 %8.2f  p99.9 %8.2f  max %9.2f us\n",
+           name, sample_count / seconds, percentile(0.5), percentile(0.9), percentile(0.99),
+           percentile(0.999), samples[sample_count - 1] / 1e3);
+    sample_count = 0;
+}
+
+static void record(uint64_t start) {
+    samples[sample_count++] = now_ns() - start;
+}
+
+static void check(int result, const char *what, const char *path) {
+    if (result < 0) {
+        fprintf(stderr, "%s %s: %s\n", what, path, strerror(-result));
+        exit(1);
+    }
+}
+
+static void expect(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "%s\n", what);
+        exit(1);
+    }
+}
+
+static int exists(const char *path) {
+    struct stat st;
+    return ramdisk_getattr(path, &st) == 0;
+}
+
+static void make_file(const char *path, const char *data) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    check(ramdisk_create(path, 0644, &fi), "create", path);
+    check(ramdisk_write(path, data, strlen(data), 0, &fi), "write", path);
+    ramdisk_release(path, &fi);
+}
+
+/* Whether the file at path exists and holds exactly data. */
+static int holds(const char *path, const char *data) {
+    char buf[256];
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    if (ramdisk_open(path, &fi) != 0) {
+        return 0;
+    }
+    int n = ramdisk_read(path, buf, sizeof(buf), 0, &fi);
+    ramdisk_release(path, &fi);
+    return n == (int) strlen(data) && memcmp(buf, data, n) == 0;
+}
+
+static long link_count(const char *path) {
+    struct stat st;
+    check(ramdisk_getattr(path, &st), "getattr", path);
+    return st.st_nlink;
+}
+
+static int entry_count(const char *path) {
+    Node *dir = get_node_by_path(path);
+    expect(dir != NULL, "directory vanished");
+    pthread_rwlock_rdlock(&dir->lock);
+    int count = children_count(get_children(dir));
+    pthread_rwlock_unlock(&dir->lock);
+    put_node(dir);
+    return count;
+}
+
+/*
+ * Directories TREE_FANOUT wide and TREE_DEPTH deep down one spine, with a
+ * file in every leaf; getattr walks to a random leaf file.
+ */
+static void stat_storm() {
+    char path[256];
+    int depth, i;
+    strcpy(path, "");
+    for (depth = 0; depth < TREE_DEPTH; depth++) {
+        size_t len = strlen(path);
+        for (i = 0; i < TREE_FANOUT; i++) {
+            char file[sizeof(path) + 2];
+            struct fuse_file_info fi;
+            sprintf(path + len, "/d%d", i);
+            check(ramdisk_mkdir(path, 0755), "mkdir", path);
+            memset(&fi, 0, sizeof(fi));
+            sprintf(file, "%s/f", path);
+            check(ramdisk_create(file, 0644, &fi), "create", file);
+            ramdisk_release(file, &fi);
+        }
+        sprintf(path + len, "/d%d", 0);
+    }
+
+    unsigned long x = 1;
+    uint64_t start = now_ns();
+    for (i = 0; i < ops; i++) {
+        struct stat st;
+        int leaf = 1 + next_random(&x) % TREE_DEPTH;
+        size_t len = 0;
+        for (depth = 0; depth < leaf - 1; depth++) {
+            len += sprintf(path + len, "/d0");
+        }
+        sprintf(path + len, "/d%lu/f", next_random(&x) % TREE_FANOUT);
+        uint64_t op = now_ns();
+        check(ramdisk_getattr(path, &st), "getattr", path);
+        record(op);
+    }
+    report("stat deep tree", start);
+}
+
+static void huge_directory() {
+    char path[64];
+    int i;
+    check(ramdisk_mkdir("/huge", 0755), "mkdir", "/huge");
+
+    uint64_t start = now_ns();
+    for (i = 0; i < dir_files; i++) {
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        sprintf(path, "/huge/file%d", i);
+        uint64_t op = now_ns();
+        check(ramdisk_create(path, 0644, &fi), "create", path);
+        ramdisk_release(path, &fi);
+        record(op);
+    }
+    report("huge dir create", start);
+
+    start = now_ns();
+    for (i = 0; i < dir_files; i++) {
+        sprintf(path, "/huge/file%d", i);
+        uint64_t op = now_ns();
+        check(ramdisk_unlink(path), "unlink", path);
+        record(op);
+    }
+    report("huge dir unlink", start);
+}
+
+static void small_file_churn() {
+    char path[64], buf[4096];
+    int i;
+    memset(buf, 'x', sizeof(buf));
+    for (i = 0; i < CHURN_DIRS; i++) {
+        sprintf(path, "/churn%d", i);
+        check(ramdisk_mkdir(path, 0755), "mkdir", path);
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < ops; i++) {
+        struct fuse_file_info fi;
+        size_t size = 1 + i % sizeof(buf);
+        sprintf(path, "/churn%d/f%d", i % CHURN_DIRS, i);
+        uint64_t op = now_ns();
+        memset(&fi, 0, sizeof(fi));
+        check(ramdisk_create(path, 0644, &fi), "create", path);
+        check(ramdisk_write(path, buf, size, 0, &fi), "write", path);
+        ramdisk_release(path, &fi);
+        memset(&fi, 0, sizeof(fi));
+        check(ramdisk_open(path, &fi), "open", path);
+        check(ramdisk_read(path, buf, sizeof(buf), 0, &fi), "read", path);
+        ramdisk_release(path, &fi);
+        check(ramdisk_unlink(path), "unlink", path);
+        record(op);
+    }
+    report("small file churn", start);
+}
+
+/*
+ * One pass of request-sized reads or writes over the file, in order or
+ * at random aligned offsets.
+ */
+static void file_io(struct fuse_file_info *fi, char *buf, size_t request, int writing, int random) {
+    const char *path = "/large";
+    size_t size = (size_t) file_mb << 20;
+    size_t requests = size / request;
+    unsigned long x = 7;
+    size_t i;
+    char name[64];
+    uint64_t start = now_ns();
+    for (i = 0; i < requests; i++) {
+        off_t offset = (random ? next_random(&x) % requests : i) * request;
+        uint64_t op = now_ns();
+        if (writing) {
+            check(ramdisk_write(path, buf, request, offset, fi), "write", path);
+        } else {
+            check(ramdisk_read(path, buf, request, offset, fi), "read", path);
+        }
+        record(op);
+    }
+    sprintf(name, "%s %s %zuK", random ? "rand" : "seq", writing ? "write" : "read", request >> 10);
+    report(name, start);
+}
+
+static void large_file() {
+    static const size_t requests[] = {4096, 65536, 1048576};
+    size_t size = (size_t) file_mb << 20;
+    struct fuse_file_info fi;
+    char *buf = malloc(requests[2]);
+    unsigned int i;
+    memset(buf, 'y', requests[2]);
+    memset(&fi, 0, sizeof(fi));
+    check(ramdisk_create("/large", 0644, &fi), "create", "/large");
+
+    for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        if (requests[i] > size) {
+            continue;
+        }
+        check(ramdisk_truncate("/large", 0), "truncate", "/large");
+        file_io(&fi, buf, requests[i], 1, 0);
+        file_io(&fi, buf, requests[i], 0, 0);
+        file_io(&fi, buf, requests[i], 1, 1);
+        file_io(&fi, buf, requests[i], 0, 1);
+    }
+    ramdisk_release("/large", &fi);
+    free(buf);
+}
+
+/* Heap the file's content holds. */
+static size_t held(Node *node) {
+    pthread_rwlock_rdlock(&node->lock);
+    size_t bytes = content_memory(&node->content);
+    pthread_rwlock_unlock(&node->lock);
+    return bytes;
+}
+
+/*
+ * Cut the large file to a few bytes and then to nothing. Each cut has to
+ * give back the chunks, the interior nodes and the room in the head chunk
+ * that the new size does not need.
+ */
+static void shrink_large_file() {
+    Node *node = get_node_by_path("/large");
+    if (node == NULL) {
+        fprintf(stderr, "lost /large\n");
+        exit(1);
+    }
+    size_t full = held(node);
+    check(ramdisk_truncate("/large", 100), "truncate", "/large");
+    size_t small = held(node);
+    check(ramdisk_truncate("/large", 0), "truncate", "/large");
+    size_t empty = held(node);
+    put_node(node);
+    printf("%-22s %10zu bytes, %zu at 100 bytes, %zu at 0\n", "large file shrink", full, small, empty);
+    if (small > 128 || empty != 0) {
+        fprintf(stderr, "truncate kept memory the file no longer needs\n");
+        exit(1);
+    }
+}
+
+/* Whether size bytes at offset all hold byte. */
+static int reads_as(const char *path, struct fuse_file_info *fi, off_t offset, size_t size, char byte) {
+    static char buf[CHUNK_SIZE];
+    if (ramdisk_read(path, buf, size, offset, fi) != (int) size) {
+        return 0;
+    }
+    size_t i;
+    for (i = 0; i < size && buf[i] == byte; i++) {
+    }
+    return i == size;
+}
+
+/*
+ * Punch a whole chunk and part of the next out of a four chunk file, and
+ * check what reads, seeks, the size and the memory held make of it.
+ */
+static void check_holes() {
+    const char *path = "/holes";
+    static char data[4 * CHUNK_SIZE];
+    struct fuse_file_info fi;
+    struct stat st;
+    memset(data, 'h', sizeof(data));
+    memset(&fi, 0, sizeof(fi));
+    check(ramdisk_create(path, 0644, &fi), "create", path);
+    check(ramdisk_write(path, data, sizeof(data), 0, &fi), "write", path);
+    Node *node = get_node_by_path(path);
+    expect(node != NULL, "lost /holes");
+    size_t before = held(node);
+
+    expect(ramdisk_fallocate(path, FALLOC_FL_PUNCH_HOLE, 0, CHUNK_SIZE, &fi) == -EOPNOTSUPP,
+           "punched without keeping the size");
+    check(ramdisk_fallocate(path, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, CHUNK_SIZE, CHUNK_SIZE + 100, &fi),
+          "punch", path);
+    check(ramdisk_getattr(path, &st), "getattr", path);
+    expect(st.st_size == (off_t) sizeof(data), "punching changed the size");
+    expect(reads_as(path, &fi, 0, CHUNK_SIZE, 'h'), "punching hit the chunk before");
+    expect(reads_as(path, &fi, CHUNK_SIZE, CHUNK_SIZE + 100, 0), "punched range not zero");
+    expect(reads_as(path, &fi, 2 * CHUNK_SIZE + 100, 2 * CHUNK_SIZE - 100, 'h'), "punching hit the data after");
+    expect(held(node) == before - CHUNK_SIZE, "punched chunk not freed");
+
+    expect(seek_node(node, 0, SEEK_DATA) == 0, "SEEK_DATA missed the first chunk");
+    expect(seek_node(node, 0, SEEK_HOLE) == CHUNK_SIZE, "SEEK_HOLE missed the hole");
+    expect(seek_node(node, CHUNK_SIZE + 10, SEEK_DATA) == 2 * CHUNK_SIZE, "SEEK_DATA did not skip the hole");
+    expect(seek_node(node, 2 * CHUNK_SIZE, SEEK_HOLE) == (off_t) sizeof(data), "SEEK_HOLE missed the end");
+    expect(seek_node(node, sizeof(data), SEEK_DATA) == -ENXIO, "SEEK_DATA found data past the end");
+
+    /* Growing past a hole leaves one. */
+    check(ramdisk_write(path, data, 10, 10 * CHUNK_SIZE, &fi), "write", path);
+    expect(seek_node(node, 4 * CHUNK_SIZE, SEEK_HOLE) == 4 * CHUNK_SIZE, "no hole before the new data");
+    expect(seek_node(node, 4 * CHUNK_SIZE, SEEK_DATA) == 10 * CHUNK_SIZE, "SEEK_DATA missed the new data");
+    expect(reads_as(path, &fi, 5 * CHUNK_SIZE, CHUNK_SIZE, 0), "hole past the old end not zero");
+    put_node(node);
+    ramdisk_release(path, &fi);
+    check(ramdisk_unlink(path), "unlink", path);
+}
+
+/*
+ * What rename must and must not do, checked against the tree it leaves.
+ */
+static void check_renames() {
+    char path[64], other[64];
+    int i;
+    check(ramdisk_mkdir("/ra", 0755), "mkdir", "/ra");
+    check(ramdisk_mkdir("/rb", 0755), "mkdir", "/rb");
+
+    /* A file across directories, and onto an existing file. */
+    make_file("/ra/f", "eff");
+    make_file("/rb/g", "gee");
+    check(ramdisk_rename("/ra/f", "/rb/f", 0), "rename", "/ra/f");
+    expect(!exists("/ra/f") && holds("/rb/f", "eff"), "file not moved across directories");
+    check(ramdisk_rename("/rb/f", "/rb/g", 0), "rename", "/rb/f");
+    expect(!exists("/rb/f") && holds("/rb/g", "eff"), "file not moved over another");
+
+    /* The flags. */
+    make_file("/ra/h", "aitch");
+    expect(ramdisk_rename("/ra/h", "/rb/g", RENAME_NOREPLACE) == -EEXIST, "noreplace replaced");
+    expect(holds("/ra/h", "aitch") && holds("/rb/g", "eff"), "failed noreplace changed the tree");
+    check(ramdisk_rename("/ra/h", "/rb/g", RENAME_EXCHANGE), "exchange", "/ra/h");
+    expect(holds("/ra/h", "eff") && holds("/rb/g", "aitch"), "exchange did not swap");
+    expect(ramdisk_rename("/ra/h", "/rb/none", RENAME_EXCHANGE) == -ENOENT, "exchanged with nothing");
+    expect(ramdisk_rename("/ra/h", "/rb/g", RENAME_EXCHANGE | RENAME_NOREPLACE) == -EINVAL,
+           "took both flags");
+
+    /* Directories: the refusals, then a move with its whole subtree. */
+    check(ramdisk_mkdir("/ra/d", 0755), "mkdir", "/ra/d");
+    check(ramdisk_mkdir("/ra/d/e", 0755), "mkdir", "/ra/d/e");
+    check(ramdisk_mkdir("/rb/full", 0755), "mkdir", "/rb/full");
+    make_file("/rb/full/x", "x");
+    for (i = 0; i < CHILDREN_ARRAY_MAX * 2; i++) {
+        sprintf(path, "/ra/d/e/f%d", i);
+        make_file(path, path);
+        expect(exists(path), "lost a file");    /* and caches its path */
+    }
+    expect(ramdisk_rename("/ra/d", "/ra/d/e/in", 0) == -EINVAL, "moved a directory into itself");
+    expect(ramdisk_rename("/ra/d", "/rb/full", 0) == -ENOTEMPTY, "replaced a non-empty directory");
+    expect(ramdisk_rename("/ra/d", "/rb/g", 0) == -ENOTDIR, "replaced a file with a directory");
+    expect(ramdisk_rename("/rb/g", "/ra/d", 0) == -EISDIR, "replaced a directory with a file");
+    long ra_links = link_count("/ra"), rb_links = link_count("/rb");
+    check(ramdisk_rename("/ra/d", "/rb/d", 0), "rename", "/ra/d");
+    expect(link_count("/ra") == ra_links - 1 && link_count("/rb") == rb_links + 1, "parents' links wrong");
+    for (i = 0; i < CHILDREN_ARRAY_MAX * 2; i++) {
+        sprintf(path, "/ra/d/e/f%d", i);
+        sprintf(other, "/rb/d/e/f%d", i);
+        expect(!exists(path), "stale path after a directory move");
+        expect(holds(other, path), "file lost in a directory move");
+    }
+    check(ramdisk_mkdir("/ra/empty", 0755), "mkdir", "/ra/empty");
+    check(ramdisk_rename("/rb/d", "/ra/empty", 0), "rename", "/rb/d");
+    expect(!exists("/rb/d") && holds("/ra/empty/e/f0", "/ra/d/e/f0"), "directory not moved over an empty one");
+
+    /* Within and between a small (array) and a large (map) directory. */
+    check(ramdisk_mkdir("/rm", 0755), "mkdir", "/rm");
+    for (i = 0; i < CHILDREN_ARRAY_MAX * 4; i++) {
+        sprintf(path, "/rm/n%d", i);
+        make_file(path, path);
+    }
+    for (i = 0; i < CHILDREN_ARRAY_MAX * 4; i++) {
+        sprintf(path, "/rm/n%d", i);
+        sprintf(other, "/rm/renamed%d", i);
+        check(ramdisk_rename(path, other, 0), "rename", path);
+    }
+    for (i = 0; i < CHILDREN_ARRAY_MAX * 4; i += 2) {
+        sprintf(path, "/rm/renamed%d", i);
+        sprintf(other, "/rm/renamed%d", i + 1);
+        check(ramdisk_rename(path, other, RENAME_EXCHANGE), "exchange", path);
+    }
+    for (i = 0; i < CHILDREN_ARRAY_MAX * 4; i++) {
+        sprintf(path, "/rm/renamed%d", i);
+        sprintf(other, "/rm/n%d", i ^ 1);
+        expect(holds(path, other), "exchange in a map directory went wrong");
+    }
+    /* /rb holds g and full; it stays an array. */
+    for (i = 0; i < CHILDREN_ARRAY_MAX - 2; i++) {
+        sprintf(path, "/rm/renamed%d", i);
+        sprintf(other, "/rb/from-map%d", i);
+        check(ramdisk_rename(path, other, 0), "rename", path);
+    }
+    expect(entry_count("/rm") == CHILDREN_ARRAY_MAX * 3 + 2, "map directory kept moved entries");
+    expect(entry_count("/rb") == CHILDREN_ARRAY_MAX, "array directory lost entries");
+    sprintf(path, "/rb/from-map%d", 0);
+    check(ramdisk_rename(path, "/rm/back", 0), "rename", path);
+    expect(holds("/rm/back", "/rm/n1"), "move from an array into a map directory went wrong");
+}
+
+/* Build the tree from the configured image and journal, as main does. */
+static void mount_journaled() {
+    check(init_root(), "init_root", "/");
+    check(open_journal(xyfs_config.journal_path), "open journal", xyfs_config.journal_path);
+    start_background();
+}
+
+/*
+ * Logged changes, with an image saved halfway whose records are never
+ * compacted away, as when a crash falls between saving and compacting.
+ * Exits without a checkpoint.
+ */
+static void journal_writer() {
+    struct fuse_file_info fi;
+    mount_journaled();
+    check(ramdisk_mkdir("/j", 0755), "mkdir", "/j");
+    make_file("/j/a", "one");
+    check(ramdisk_mkdir("/j/d", 0755), "mkdir", "/j/d");
+    make_file("/j/d/x", "dx");
+    check(ramdisk_rename("/j/d", "/j/e", 0), "rename", "/j/d");
+    check(ramdisk_mkdir("/j/d", 0755), "mkdir", "/j/d");
+    make_file("/x", "ex");
+    make_file("/y", "why");
+    check(ramdisk_rename("/x", "/y", RENAME_EXCHANGE), "exchange", "/x");
+    check(snapshot_save(xyfs_config.snapshot_path, NULL), "save", xyfs_config.snapshot_path);
+
+    make_file("/j/d/late", "late");
+    check(ramdisk_truncate("/j/a", 2), "truncate", "/j/a");
+    check(ramdisk_rename("/j/a", "/j/d/a", 0), "rename", "/j/a");
+    make_file("/gone", "gone");
+    check(ramdisk_unlink("/gone"), "unlink", "/gone");
+    memset(&fi, 0, sizeof(fi));
+    check(ramdisk_create("/holes", 0644, &fi), "create", "/holes");
+    check(ramdisk_write("/holes", "abcdef", 6, 0, &fi), "write", "/holes");
+    check(ramdisk_fallocate("/holes", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 1, 2, &fi), "punch", "/holes");
+    ramdisk_release("/holes", &fi);
+    _exit(0);
+}
+
+static void check_replayed_tree() {
+    expect(holds("/x", "why") && holds("/y", "ex"), "exchange replayed wrong");
+    expect(holds("/j/e/x", "dx") && !exists("/j/d/x"), "directory rename replayed wrong");
+    expect(holds("/j/d/late", "late") && holds("/j/d/a", "on") && !exists("/j/a"), "changes after the image lost");
+    expect(!exists("/gone"), "unlink not replayed");
+    char buf[8];
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    check(ramdisk_open("/holes", &fi), "open", "/holes");
+    expect(ramdisk_read("/holes", buf, sizeof(buf), 0, &fi) == 6 && memcmp(buf, "a\0\0def", 6) == 0,
+           "punch replayed wrong");
+    ramdisk_release("/holes", &fi);
+}
+
+/* Replay the writer's journal, then check again after a checkpoint. */
+static void journal_reader() {
+    mount_journaled();
+    check_replayed_tree();
+    stop_background();
+    mount_journaled();
+    check_replayed_tree();
+    stop_background();
+    _exit(0);
+}
+
+static int run_child(void (*fn)()) {
+    int status;
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn();
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void check_journal_replay() {
+    char dir[] = "/tmp/fs_bench.XXXXXX";
+    char journal[64], image[64], tmp[72];
+    expect(mkdtemp(dir) != NULL, "cannot make a directory for the journal");
+    sprintf(journal, "%s/journal", dir);
+    sprintf(image, "%s/journal.ckpt", dir);
+    xyfs_config.journal_path = journal;
+    xyfs_config.snapshot_path = image;
+    xyfs_config.journal_checkpoint = 64;
+
+    int writer = run_child(journal_writer);
+    int reader = writer == 0 ? run_child(journal_reader) : -1;
+
+    xyfs_config.journal_path = NULL;
+    xyfs_config.snapshot_path = NULL;
+    unlink(journal);
+    unlink(image);
+    sprintf(tmp, "%s.tmp", journal);
+    unlink(tmp);
+    rmdir(dir);
+    expect(writer == 0 && reader == 0, "journal replay check failed");
+    printf("%-22s ok\n", "journal replay");
+}
+
+/*
+ * Move a directory holding dir_files files back and forth between two
+ * parents; the cost must not depend on what is inside.
+ */
+static void directory_moves() {
+    char path[64];
+    int i;
+    check(ramdisk_mkdir("/move1", 0755), "mkdir", "/move1");
+    check(ramdisk_mkdir("/move2", 0755), "mkdir", "/move2");
+    check(ramdisk_mkdir("/move1/d", 0755), "mkdir", "/move1/d");
+    for (i = 0; i < dir_files; i++) {
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        sprintf(path, "/move1/d/file%d", i);
+        check(ramdisk_create(path, 0644, &fi), "create", path);
+        ramdisk_release(path, &fi);
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < ops; i++) {
+        const char *from = i % 2 == 0 ? "/move1/d" : "/move2/d";
+        const char *to = i % 2 == 0 ? "/move2/d" : "/move1/d";
+        uint64_t op = now_ns();
+        check(ramdisk_rename(from, to, 0), "rename", from);
+        record(op);
+    }
+    report("directory move", start);
+}
+
+int main(int argc, char *argv[]) {
+    dir_files = argc > 1 ? atoi(argv[1]) : 200000;
+    file_mb = argc > 2 ? atoi(argv[2]) : 256;
+    ops = argc > 3 ? atoi(argv[3]) : 200000;
+    if (dir_files <= 0 || file_mb <= 0 || ops <= 0) {
+        fprintf(stderr, "usage: %s [directory files] [file MB] [ops per workload]\n", argv[0]);
+        return 1;
+    }
+    size_t most = dir_files;
+    if ((size_t) ops > most) {
+        most = ops;
+    }
+    if (((size_t) file_mb << 20) / 4096 > most) {
+        most = ((size_t) file_mb << 20) / 4096;
+    }
+    samples = malloc(most * sizeof(uint64_t));
+    if (samples == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    check_journal_replay();
+    if (init_root() != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    stat_storm();
+    huge_directory();
+    small_file_churn();
+    large_file();
+    shrink_large_file();
+    check_holes();
+    check_renames();
+    directory_moves();
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Per-create latency while one directory grows.
+ *
+ * Adds entries to a single directory's Children, the code path a create
+ * takes once the name has been checked, and records how long every
+ * insert took. Prints percentiles at each power of ten, so the cost of
+ * the table rebuilds shows up in the tail. Built twice: grow_bench uses
+ * incremental rebuilds, grow_bench_sync moves the whole table at once.
+ * Then times a get of every entry, as the inserts left the table and, if
+ * that leaves a rebuild stalled, again once children_settle has finished
+ * it the way a lookup in xyfs would: the steady-state cost of a get.
+ *
+ * usage: grow_bench [entries]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "hashmap.h"
+#include "xyfs.h"
+
+static int compare_ns(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static long elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static void report(long *latency, int count) {
+    long *sorted = malloc(count * sizeof(long));
+    memcpy(sorted, latency, count * sizeof(long));
+    qsort(sorted, count, sizeof(long), compare_ns);
+    printf("%9d %8ld %8ld %8ld %10ld\n", count,
+           sorted[count / 2], sorted[(long) count * 99 / 100],
+           sorted[(long) count * 999 / 1000], sorted[count - 1]);
+    free(sorted);
+}
+
+static int time_gets(Children *dir, Node *nodes, int entries, const char *state) {
+    struct timespec start, end;
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < entries; i++) {
+        if (children_get(dir, nodes[i].name) != &nodes[i]) {
+            fprintf(stderr, "lookup of %s failed\n", nodes[i].name);
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%9d %8.1f   (ns per get, %s)\n", entries, (double) elapsed_ns(&start, &end) / entries, state);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int entries = argc > 1 ? atoi(argv[1]) : 1000000;
+    Children dir;
+    Node *nodes;
+    long *latency;
+    int i, next_report = 10;
+
+    if (entries <= 0) {
+        fprintf(stderr, "usage: %s [entries]\n", argv[0]);
+        return 1;
+    }
+
+    nodes = calloc(entries, sizeof(Node));
+    latency = malloc(entries * sizeof(long));
+    for (i = 0; i < entries; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%d", i);
+        nodes[i].name = strdup(name);
+    }
+
+    children_init(&dir);
+    printf("%9s %8s %8s %8s %10s   (ns per insert)\n", "entries", "p50", "p99", "p99.9", "max");
+    for (i = 0; i < entries; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (children_add(&dir, &nodes[i]) != 0) {
+            fprintf(stderr, "insert %d failed\n", i);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency[i] = elapsed_ns(&start, &end);
+
+        if (i + 1 == next_report || i + 1 == entries) {
+            report(latency, i + 1);
+            next_report *= 10;
+        }
+    }
+
+    if (time_gets(&dir, nodes, entries, "as inserted") != 0) {
+        return 1;
+    }
+    if (children_stalled(&dir)) {
+        children_settle(&dir);
+        if (time_gets(&dir, nodes, entries, "settled") != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Compare the string hash backends of hashmap.c.
+ *
+ * Hashes sets of file names and full paths of typical lengths with each
+ * backend and prints nanoseconds per key, then times hashmap_get on a
+ * populated map, which is what a directory lookup costs.
+ *
+ * usage: hash_bench [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hashmap.h"
+
+#define NUM_KEYS 4096
+
+typedef struct backend
+{
+    const char *name;
+    unsigned long (*fn)(const char *);
+} Backend;
+
+static const Backend backends[] = {
+    {"legacy table crc32", hashmap_hash_legacy},
+    {"word-at-a-time", hashmap_hash_word},
+#if defined(__x86_64__)
+    {"sse4.2 crc32c", hashmap_hash_crc32c},
+#endif
+    {"selected", hashmap_hash_string},
+};
+
+static char *keys[NUM_KEYS];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Key shapes: short names, longer names, whole paths as the dcache sees them. */
+static void make_keys(int shape) {
+    int i;
+    for (i = 0; i < NUM_KEYS; i++) {
+        char buf[128];
+        switch (shape) {
+            case 0:
+                snprintf(buf, sizeof(buf), "f%d", i);
+                break;
+            case 1:
+                snprintf(buf, sizeof(buf), "IMG_2024%04d_%06d.jpg", i % 1231, i);
+                break;
+            default:
+                snprintf(buf, sizeof(buf), "/home/user/projects/build/obj/dir%d/module_%d.o", i % 61, i);
+                break;
+        }
+        free(keys[i]);
+        keys[i] = strdup(buf);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const char *shapes[] = {"short names", "long names", "full paths"};
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    unsigned long sink = 0;
+    size_t b;
+    int shape, r, i;
+
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    for (shape = 0; shape < 3; shape++) {
+        make_keys(shape);
+        printf("%s (e.g. \"%s\"):\n", shapes[shape], keys[NUM_KEYS - 1]);
+        for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            double start = now();
+            for (r = 0; r < rounds; r++) {
+                for (i = 0; i < NUM_KEYS; i++) {
+                    sink += backends[b].fn(keys[i]);
+                }
+            }
+            printf("  %-20s %6.2f ns/key\n", backends[b].name,
+                   (now() - start) * 1e9 / ((double) rounds * NUM_KEYS));
+        }
+
+        map_t map = hashmap_new();
+        for (i = 0; i < NUM_KEYS; i++) {
+            hashmap_put(map, keys[i], keys[i]);
+        }
+        double start = now();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < NUM_KEYS; i++) {
+                any_t value;
+                hashmap_get(map, keys[i], &value);
+                sink += (unsigned long) value;
+            }
+        }
+        printf("  %-20s %6.2f ns/key\n", "hashmap_get",
+               (now() - start) * 1e9 / ((double) rounds * NUM_KEYS));
+        hashmap_free(map);
+    }
+
+    /* Keep the hashing from being optimized away. */
+    return sink == 42 ? 2 : 0;
+}
@@ -0,0 +1,337 @@
+/*
+ * Speed, layout and correctness of hashmap.c.
+ *
+ * For each table size and key shape, fills a map and times hashmap_put,
+ * hashmap_get at several hit ratios, hashmap_iterate and hashmap_remove
+ * in ns/op, and prints the probe-length histogram and bytes per entry
+ * after the fill. A fill that stops mid-rebuild leaves gets probing two
+ * tables, so the hits are timed again once hashmap_settle has finished
+ * it. Then runs insert/delete mixes, the case that leaves tombstones
+ * behind, and prints the same layout figures once it has churned. Only
+ * the even mix holds the map at its starting size; the others drift to a
+ * bound and churn there, and the average count each one ran at is printed
+ * with it.
+ *
+ * Last, a differential stress run drives the map and a plain array
+ * indexed by key number with the same random puts, gets, removes,
+ * get_ones and iterations over a small key universe, and stops at the
+ * first disagreement, printing the seed and operation so it can be
+ * replayed. hashmap_bench_sync is the same program with rebuilds done
+ * all at once; run both when changing the table.
+ *
+ * usage: hashmap_bench [max keys] [stress ops] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "hashmap.h"
+
+#define STRESS_KEYS 2048
+
+static unsigned long rng = 1;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/*
+ * Key i of a shape. miss keys share the shape but never equal a stored
+ * key, so gets of them walk full probe sequences.
+ */
+static char *make_key(int shape, int i, int miss) {
+    char buf[128];
+    switch (shape) {
+        case 0:
+            snprintf(buf, sizeof(buf), "%c%d", miss ? 'g' : 'f', i);
+            break;
+        case 1:
+            snprintf(buf, sizeof(buf), "IMG_2024%04d_%06d.%s", i % 1231, i, miss ? "png" : "jpg");
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "/home/user/projects/build/obj/dir%d/module_%d.%c", i % 61, i, miss ? 'd' : 'o');
+            break;
+    }
+    return strdup(buf);
+}
+
+static void print_layout(map_t map) {
+    hashmap_stats stats;
+    int i;
+    hashmap_get_stats(map, &stats);
+    printf("    %d keys in %d slots (load %.2f), %d tombstones, %.1f bytes/entry\n", stats.size, stats.slots,
+           (double) stats.size / stats.slots, stats.tombstones,
+           stats.size > 0 ? (double) stats.bytes / stats.size : 0.0);
+    printf("    probe groups:");
+    for (i = 0; i < HASHMAP_PROBE_BUCKETS; i++) {
+        printf(" %s%d %.3f%%", i == HASHMAP_PROBE_BUCKETS - 1 ? ">=" : "", i + 1,
+               stats.size > 0 ? 100.0 * stats.probes[i] / stats.size : 0.0);
+    }
+    printf("\n");
+}
+
+static int count_entry(any_t item, any_t data) {
+    (*(unsigned long *) item) += (uintptr_t) data;
+    return MAP_OK;
+}
+
+static void bench_operations(int size, int shape) {
+    static const int hit_percents[] = {100, 50, 0};
+    char **keys = malloc(size * sizeof(char *));
+    char **misses = malloc(size * sizeof(char *));
+    int *order = malloc(size * sizeof(int));
+    map_t map = hashmap_new();
+    any_t value;
+    unsigned long sum = 0;
+    unsigned int h;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        keys[i] = make_key(shape, i, 0);
+        misses[i] = make_key(shape, i, 1);
+        order[i] = next_random() % size;
+    }
+    printf("  %d keys like \"%s\"\n", size, keys[size - 1]);
+
+    double start = now();
+    for (i = 0; i < size; i++) {
+        hashmap_put(map, keys[i], (any_t) (uintptr_t) (i + 1));
+    }
+    printf("    put       %7.1f ns/op\n", (now() - start) * 1e9 / size);
+    print_layout(map);
+
+    for (h = 0; h < sizeof(hit_percents) / sizeof(hit_percents[0]); h++) {
+        int found = 0;
+        start = now();
+        for (i = 0; i < size; i++) {
+            int k = order[i];
+            char *key = (unsigned long) k * 100 < (unsigned long) hit_percents[h] * size ? keys[k] : misses[k];
+            found += hashmap_get(map, key, &value) == MAP_OK;
+        }
+        printf("    get %3d%%  %7.1f ns/op (%d found)\n", hit_percents[h], (now() - start) * 1e9 / size, found);
+    }
+    if (hashmap_stalled(map)) {
+        /* The fill stopped mid-rebuild: what gets cost once it is done. */
+        int found = 0;
+        hashmap_settle(map);
+        start = now();
+        for (i = 0; i < size; i++) {
+            found += hashmap_get(map, keys[order[i]], &value) == MAP_OK;
+        }
+        printf("    settled   %7.1f ns/op (%d found)\n", (now() - start) * 1e9 / size, found);
+    }
+
+    start = now();
+    hashmap_iterate(map, count_entry, &sum);
+    printf("    iterate   %7.1f ns/entry\n", (now() - start) * 1e9 / size);
+
+    start = now();
+    for (i = 0; i < size; i++) {
+        hashmap_remove(map, keys[i]);
+    }
+    printf("    remove    %7.1f ns/op\n", (now() - start) * 1e9 / size);
+
+    hashmap_free(map);
+    for (i = 0; i < size; i++) {
+        free(keys[i]);
+        free(misses[i]);
+    }
+    free(keys);
+    free(misses);
+    free(order);
+}
+
+/*
+ * Start with size keys in the map and run ops operations, each a put of
+ * a new key (put_percent of the time) or a remove of a stored one. The
+ * count is kept between half and one and a half times size: a mix that
+ * grows or shrinks the map, 60/40 say, reaches that bound after 2.5 times
+ * size operations and stays near it for the rest of the run.
+ */
+static void bench_churn(int size, int put_percent, int ops) {
+    int universe = size * 2;
+    char **keys = malloc(universe * sizeof(char *));
+    int *slots = malloc(universe * sizeof(int));    /* stored keys first, then the rest */
+    map_t map = hashmap_new();
+    int count = size, i;
+    double counted = 0;
+
+    for (i = 0; i < universe; i++) {
+        keys[i] = make_key(1, i, 0);
+        slots[i] = i;
+    }
+    for (i = 0; i < size; i++) {
+        hashmap_put(map, keys[i], keys[i]);
+    }
+
+    double start = now();
+    for (i = 0; i < ops; i++) {
+        int put = (int) (next_random() % 100) < put_percent;
+        if (count >= size + size / 2) {
+            put = 0;
+        } else if (count <= size / 2) {
+            put = 1;
+        }
+        if (put) {
+            int j = count + next_random() % (universe - count);
+            int k = slots[j];
+            hashmap_put(map, keys[k], keys[k]);
+            slots[j] = slots[count];
+            slots[count++] = k;
+        } else {
+            int j = next_random() % count;
+            int k = slots[j];
+            hashmap_remove(map, keys[k]);
+            slots[j] = slots[--count];
+            slots[count] = k;
+        }
+        counted += count;
+    }
+    printf("  %d keys, %d%% puts: %7.1f ns/op, %.0f keys on average\n", size, put_percent,
+           (now() - start) * 1e9 / ops, counted / ops);
+    print_layout(map);
+
+    hashmap_free(map);
+    for (i = 0; i < universe; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(slots);
+}
+
+static void fail(unsigned long seed, long op, const char *what, int key) {
+    fprintf(stderr, "stress: seed %lu, operation %ld: %s (key %d)\n", seed, op, what, key);
+    exit(1);
+}
+
+/*
+ * Random operations on the map and on a reference array. The universe is
+ * small so keys are removed and put back many times over, and the op mix
+ * drifts between growing and emptying the map so rebuilds of both kinds
+ * run.
+ */
+static void stress(unsigned long seed, long ops) {
+    char *keys[STRESS_KEYS];
+    unsigned long reference[STRESS_KEYS];  /* the key's value, always odd, or 0 when absent */
+    map_t map = hashmap_new();
+    int count = 0, i;
+    long op;
+
+    rng = seed;
+    for (i = 0; i < STRESS_KEYS; i++) {
+        keys[i] = make_key(next_random() % 3, i, 0);
+        reference[i] = 0;
+    }
+
+    for (op = 0; op < ops; op++) {
+        /* 60% of operations change the map, mostly puts then mostly removes. */
+        int puts = (op / 50000) % 2 == 0 ? 42 : 18;
+        int k = next_random() % STRESS_KEYS;
+        int choice = next_random() % 100;
+        any_t value;
+
+        if (choice < puts) {
+            unsigned long v = next_random() | 1;
+            if (hashmap_put(map, keys[k], (any_t) (uintptr_t) v) != MAP_OK) {
+                fail(seed, op, "put failed", k);
+            }
+            count += reference[k] == 0;
+            reference[k] = v;
+        } else if (choice < 60) {
+            int result = hashmap_remove(map, keys[k]);
+            if (result != (reference[k] != 0 ? MAP_OK : MAP_MISSING)) {
+                fail(seed, op, "remove disagrees", k);
+            }
+            count -= reference[k] != 0;
+            reference[k] = 0;
+        } else if (choice < 98) {
+            int result = hashmap_get(map, keys[k], &value);
+            if (reference[k] != 0 ? result != MAP_OK || (uintptr_t) value != reference[k]
+                                  : result != MAP_MISSING || value != NULL) {
+                fail(seed, op, "get disagrees", k);
+            }
+        } else if (choice < 99) {
+            unsigned long sum = 0, expected = 0;
+            for (i = 0; i < STRESS_KEYS; i++) {
+                expected += reference[i];
+            }
+            hashmap_iterate(map, count_entry, &sum);
+            if (sum != expected) {
+                fail(seed, op, "iterate disagrees", -1);
+            }
+            /* As a listing in xyfs does, finish a rebuild it found stalled. */
+            if (hashmap_stalled(map)) {
+                hashmap_settle(map);
+            }
+        } else {
+            int result = hashmap_get_one(map, &value, 1);
+            if (result != (count > 0 ? MAP_OK : MAP_MISSING)) {
+                fail(seed, op, "get_one disagrees", -1);
+            }
+            if (result == MAP_OK) {
+                for (i = 0; i < STRESS_KEYS && reference[i] != (uintptr_t) value; i++) {
+                }
+                if (i == STRESS_KEYS) {
+                    fail(seed, op, "get_one returned an unknown value", -1);
+                }
+                reference[i] = 0;
+                count--;
+            }
+        }
+        if (hashmap_length(map) != count) {
+            fail(seed, op, "length disagrees", k);
+        }
+    }
+
+    hashmap_stats stats;
+    hashmap_get_stats(map, &stats);
+    printf("  %ld operations from seed %lu agree; %d keys, %d tombstones at the end\n", ops, seed, stats.size,
+           stats.tombstones);
+    hashmap_free(map);
+    for (i = 0; i < STRESS_KEYS; i++) {
+        free(keys[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const char *shapes[] = {"short names", "long names", "full paths"};
+    static const int put_percents[] = {50, 60, 40};
+    int max_keys = argc > 1 ? atoi(argv[1]) : 1000000;
+    long stress_ops = argc > 2 ? atol(argv[2]) : 2000000;
+    unsigned long seed = argc > 3 ? strtoul(argv[3], NULL, 0) : (unsigned long) time(NULL);
+    int size, shape;
+    unsigned int i;
+
+    if (max_keys < 1000 || stress_ops < 0 || seed == 0) {
+        fprintf(stderr, "usage: %s [max keys >= 1000] [stress ops] [seed != 0]\n", argv[0]);
+        return 1;
+    }
+
+    for (shape = 0; shape < 3; shape++) {
+        printf("%s:\n", shapes[shape]);
+        for (size = 1000; size <= max_keys; size *= 16) {
+            bench_operations(size, shape);
+        }
+    }
+
+    printf("insert/delete churn:\n");
+    for (size = 1000; size <= max_keys; size *= 16) {
+        for (i = 0; i < sizeof(put_percents) / sizeof(put_percents[0]); i++) {
+            bench_churn(size, put_percents[i], size * 4);
+        }
+    }
+
+    printf("differential stress:\n");
+    stress(seed, stress_ops);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Write throughput with and without the journal.
+ *
+ * Each thread appends writes to a file of its own the way write_node
+ * does: copy into the Content under the file's lock, log the record
+ * under the same lock, then wait for it to be durable with the lock
+ * dropped. The run is repeated in memory only and with the journal at
+ * each flush interval, and ops/sec and records per group commit are
+ * printed for each thread count.
+ *
+ * The log is written to journal_bench.log in the current directory, so
+ * run it from the filesystem the journal would live on.
+ *
+ * usage: journal_bench [ops per thread] [write size] [max threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "content.h"
+#include "journal.h"
+
+#define LOG_PATH "journal_bench.log"
+
+typedef struct bench_file
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    Content content;
+    char path[32];
+    int failed;
+} BenchFile;
+
+static int ops;
+static size_t write_size;
+static char *payload;
+
+static void *run_writes(void *arg) {
+    BenchFile *file = (BenchFile *) arg;
+    int i;
+    for (i = 0; i < ops; i++) {
+        off_t offset = (off_t) i * write_size;
+        pthread_mutex_lock(&file->lock);
+        if (content_write(&file->content, payload, write_size, offset) != 0) {
+            file->failed = 1;
+        }
+        JournalRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.op = JOURNAL_WRITE;
+        rec.offset = offset;
+        struct iovec iov = {payload, write_size};
+        journal_append(&rec, file->path, &iov, 1);
+        pthread_mutex_unlock(&file->lock);
+        if (journal_commit() != 0) {
+            file->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * One run; interval_ms < 0 means no journal. Returns ops/sec.
+ */
+static double run(int threads, int interval_ms, double *per_commit) {
+    BenchFile *files = calloc(threads, sizeof(BenchFile));
+    JournalStats before, after;
+    struct timespec start, end;
+    int i;
+
+    if (interval_ms >= 0) {
+        unlink(LOG_PATH);
+        if (journal_open(LOG_PATH, 0, NULL) != 0) {
+            fprintf(stderr, "cannot open %s\n", LOG_PATH);
+            exit(1);
+        }
+        journal_start(interval_ms, 0, NULL);
+    }
+    journal_get_stats(&before);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&files[i].lock, NULL);
+        content_init(&files[i].content);
+        snprintf(files[i].path, sizeof(files[i].path), "/file%d", i);
+        pthread_create(&files[i].thread, NULL, run_writes, &files[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(files[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    journal_get_stats(&after);
+    if (interval_ms >= 0) {
+        journal_close();
+        unlink(LOG_PATH);
+    }
+    for (i = 0; i < threads; i++) {
+        if (files[i].failed) {
+            fprintf(stderr, "writes failed\n");
+            exit(1);
+        }
+        content_free(&files[i].content);
+        pthread_mutex_destroy(&files[i].lock);
+    }
+    free(files);
+
+    unsigned long flushes = after.flushes - before.flushes;
+    *per_commit = flushes > 0 ? (double) (after.records - before.records) / flushes : 0;
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double) threads * ops / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    static const int intervals[] = {-1, 0, 1, 5};
+    int max_threads, threads;
+    unsigned int i;
+
+    ops = argc > 1 ? atoi(argv[1]) : 2000;
+    write_size = argc > 2 ? (size_t) atol(argv[2]) : 4096;
+    max_threads = argc > 3 ? atoi(argv[3]) : 16;
+    if (ops <= 0 || write_size == 0 || max_threads <= 0) {
+        fprintf(stderr, "usage: %s [ops per thread] [write size] [max threads]\n", argv[0]);
+        return 1;
+    }
+    payload = malloc(write_size);
+    memset(payload, 'x', write_size);
+
+    printf("%7s  %-14s %12s %12s\n", "threads", "mode", "ops/sec", "ops/commit");
+    for (threads = 1; threads <= max_threads; threads *= 4) {
+        for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+            double per_commit;
+            double rate = run(threads, intervals[i], &per_commit);
+            char mode[32];
+            if (intervals[i] < 0) {
+                snprintf(mode, sizeof(mode), "memory");
+            } else {
+                snprintf(mode, sizeof(mode), "journal %dms", intervals[i]);
+            }
+            printf("%7d  %-14s %12.0f %12.1f\n", threads, mode, rate, per_commit);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Concurrent map with lock-free lookups.
+ *
+ * Open addressing with linear probing over a power-of-two table of slot
+ * pointers. Entries are immutable once published: replacing a value
+ * publishes a fresh entry in the same slot, removing one stores a
+ * tombstone. A reader therefore only ever sees a NULL slot, a tombstone
+ * or a complete entry, and needs nothing but acquire loads.
+ *
+ * Writers hold the map mutex. When live entries plus tombstones would
+ * pass half the table, the live entries are moved into a fresh table that
+ * is published with one release store; the old table, like every
+ * unlinked entry, is handed to epoch_retire.
+ */
+#include "chashmap.h"
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct _chashmap_entry{
+	unsigned long hash;
+	char* key;
+	any_t data;
+} chashmap_entry;
+
+typedef struct _chashmap_table{
+	unsigned long mask;
+	chashmap_entry *slots[];
+} chashmap_table;
+
+typedef struct _chashmap_map{
+	chashmap_table *table;
+	int size;	/* live entries */
+	int used;	/* live entries plus tombstones */
+	pthread_mutex_t lock;
+} chashmap_map;
+
+/* Marks a slot whose entry was removed; probing continues past it. */
+static chashmap_entry tombstone;
+#define TOMBSTONE (&tombstone)
+
+static chashmap_table *table_new(unsigned long size) {
+	chashmap_table *t = (chashmap_table *) calloc(1, sizeof(chashmap_table) + size * sizeof(chashmap_entry *));
+	if (t)
+		t->mask = size - 1;
+	return t;
+}
+
+static void free_table(void *arg) {
+	free(arg);
+}
+
+/* Retire callback for a table that was emptied by chashmap_clear. */
+static void free_table_entries(void *arg) {
+	chashmap_table *t = (chashmap_table *) arg;
+	unsigned long i;
+	for (i = 0; i <= t->mask; i++) {
+		if (t->slots[i] != NULL && t->slots[i] != TOMBSTONE)
+			free(t->slots[i]);
+	}
+	free(t);
+}
+
+cmap_t chashmap_new() {
+	chashmap_map *m = (chashmap_map *) malloc(sizeof(chashmap_map));
+	if (!m)
+		return NULL;
+	m->table = table_new(CHASHMAP_INITIAL_SIZE);
+	if (!m->table) {
+		free(m);
+		return NULL;
+	}
+	m->size = 0;
+	m->used = 0;
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+int chashmap_get(cmap_t in, const char* key, any_t *arg) {
+	chashmap_map *m = (chashmap_map *) in;
+	chashmap_table *t = __atomic_load_n(&m->table, __ATOMIC_ACQUIRE);
+	unsigned long hash = hashmap_hash_string(key);
+	unsigned long i = hash & t->mask;
+
+	for (;;) {
+		chashmap_entry *e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+		if (e == NULL)
+			return MAP_MISSING;
+		if (e != TOMBSTONE && e->hash == hash && strcmp(e->key, key) == 0) {
+			*arg = e->data;
+			return MAP_OK;
+		}
+		i = (i + 1) & t->mask;
+	}
+}
+
+/*
+ * Find the slot holding key, or MAP_MISSING. If free_slot is not NULL it
+ * receives the first reusable slot on the probe path. Called with the
+ * map lock held.
+ */
+static long find_slot(chashmap_table *t, unsigned long hash, const char* key, long *free_slot) {
+	unsigned long i = hash & t->mask;
+	long reuse = -1;
+
+	for (;;) {
+		chashmap_entry *e = t->slots[i];
+		if (e == NULL) {
+			if (reuse < 0)
+				reuse = i;
+			break;
+		}
+		if (e == TOMBSTONE) {
+			if (reuse < 0)
+				reuse = i;
+		} else if (e->hash == hash && strcmp(e->key, key) == 0) {
+			return i;
+		}
+		i = (i + 1) & t->mask;
+	}
+	if (free_slot)
+		*free_slot = reuse;
+	return MAP_MISSING;
+}
+
+/*
+ * Move the live entries into a table sized for twice the current
+ * population and publish it. Called with the map lock held.
+ */
+static int rehash(chashmap_map *m) {
+	chashmap_table *old = m->table;
+	unsigned long size = CHASHMAP_INITIAL_SIZE;
+	unsigned long i;
+
+	while (size < (unsigned long) (m->size + 1) * 4)
+		size <<= 1;
+	chashmap_table *t = table_new(size);
+	if (!t)
+		return MAP_OMEM;
+
+	for (i = 0; i <= old->mask; i++) {
+		chashmap_entry *e = old->slots[i];
+		if (e != NULL && e != TOMBSTONE) {
+			unsigned long j = e->hash & t->mask;
+			while (t->slots[j] != NULL)
+				j = (j + 1) & t->mask;
+			t->slots[j] = e;
+		}
+	}
+
+	__atomic_store_n(&m->table, t, __ATOMIC_RELEASE);
+	m->used = m->size;
+	epoch_retire(old, free_table);
+	return MAP_OK;
+}
+
+int chashmap_put(cmap_t in, char* key, any_t value, any_t *old) {
+	chashmap_map *m = (chashmap_map *) in;
+	unsigned long hash = hashmap_hash_string(key);
+	chashmap_entry *e = (chashmap_entry *) malloc(sizeof(chashmap_entry));
+	long slot, free_slot;
+
+	if (!e)
+		return MAP_OMEM;
+	e->hash = hash;
+	e->key = key;
+	e->data = value;
+
+	pthread_mutex_lock(&m->lock);
+	slot = find_slot(m->table, hash, key, &free_slot);
+	if (slot != MAP_MISSING) {
+		chashmap_entry *prev = m->table->slots[slot];
+		__atomic_store_n(&m->table->slots[slot], e, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&m->lock);
+		if (old)
+			*old = prev->data;
+		epoch_retire(prev, free);
+		return MAP_OK;
+	}
+
+	if (m->table->slots[free_slot] == NULL && (unsigned long) (m->used + 1) * 2 > m->table->mask + 1) {
+		if (rehash(m) != MAP_OK) {
+			pthread_mutex_unlock(&m->lock);
+			free(e);
+			return MAP_OMEM;
+		}
+		find_slot(m->table, hash, key, &free_slot);
+	}
+	if (m->table->slots[free_slot] == NULL)
+		m->used++;
+	__atomic_store_n(&m->size, m->size + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->table->slots[free_slot], e, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m->lock);
+
+	if (old)
+		*old = NULL;
+	return MAP_OK;
+}
+
+int chashmap_remove(cmap_t in, const char* key, any_t *old) {
+	chashmap_map *m = (chashmap_map *) in;
+	chashmap_entry *prev;
+	long slot;
+
+	pthread_mutex_lock(&m->lock);
+	slot = find_slot(m->table, hashmap_hash_string(key), key, NULL);
+	if (slot == MAP_MISSING) {
+		pthread_mutex_unlock(&m->lock);
+		return MAP_MISSING;
+	}
+	prev = m->table->slots[slot];
+	__atomic_store_n(&m->table->slots[slot], TOMBSTONE, __ATOMIC_RELEASE);
+	__atomic_store_n(&m->size, m->size - 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->lock);
+
+	if (old)
+		*old = prev->data;
+	epoch_retire(prev, free);
+	return MAP_OK;
+}
+
+void chashmap_clear(cmap_t in, PFany f, any_t item) {
+	chashmap_map *m = (chashmap_map *) in;
+	chashmap_table *t = table_new(CHASHMAP_INITIAL_SIZE);
+	chashmap_table *old;
+	unsigned long i;
+
+	pthread_mutex_lock(&m->lock);
+	old = m->table;
+	if (f) {
+		for (i = 0; i <= old->mask; i++) {
+			chashmap_entry *e = old->slots[i];
+			if (e != NULL && e != TOMBSTONE)
+				f(item, e->data);
+		}
+	}
+	if (!t) {
+		/* Fall back to tombstoning the slots in place. */
+		for (i = 0; i <= old->mask; i++) {
+			chashmap_entry *e = old->slots[i];
+			if (e != NULL && e != TOMBSTONE) {
+				__atomic_store_n(&old->slots[i], TOMBSTONE, __ATOMIC_RELEASE);
+				epoch_retire(e, free);
+			}
+		}
+		__atomic_store_n(&m->size, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&m->lock);
+		return;
+	}
+	__atomic_store_n(&m->table, t, __ATOMIC_RELEASE);
+	__atomic_store_n(&m->size, 0, __ATOMIC_RELAXED);
+	m->used = 0;
+	pthread_mutex_unlock(&m->lock);
+
+	epoch_retire(old, free_table_entries);
+}
+
+int chashmap_length(cmap_t in) {
+	chashmap_map *m = (chashmap_map *) in;
+	return __atomic_load_n(&m->size, __ATOMIC_RELAXED);
+}
+
+void chashmap_free(cmap_t in) {
+	chashmap_map *m = (chashmap_map *) in;
+	free_table_entries(m->table);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
@@ -0,0 +1,61 @@
+/*
+ * Concurrent variant of the hashmap in hashmap.h.
+ *
+ * chashmap_get takes no lock and performs no atomic read-modify-write, so
+ * lookups from any number of threads never write to shared memory.
+ * Writers serialize on a per-map mutex and publish with atomic stores;
+ * memory they unlink (entries, old tables after a rehash) is reclaimed
+ * through epoch.h once no reader can still see it.
+ */
+#ifndef __CHASHMAP_H__
+#define __CHASHMAP_H__
+
+#include "hashmap.h"
+
+#define CHASHMAP_INITIAL_SIZE (256)
+
+typedef any_t cmap_t;
+
+/*
+ * Return an empty map, or NULL on failure.
+ */
+extern cmap_t chashmap_new();
+
+/*
+ * Look up key. Return MAP_OK or MAP_MISSING.
+ *
+ * The caller must be inside an epoch read section (epoch_enter) for the
+ * call and for as long as it uses the returned value, if values are
+ * reclaimed through epoch_retire.
+ */
+extern int chashmap_get(cmap_t in, const char *key, any_t *arg);
+
+/*
+ * Add or replace key. The map keeps the key pointer. If old is not NULL
+ * it receives the replaced value, or NULL. Return MAP_OK or MAP_OMEM.
+ */
+extern int chashmap_put(cmap_t in, char *key, any_t value, any_t *old);
+
+/*
+ * Remove key. If old is not NULL it receives the removed value.
+ * Return MAP_OK or MAP_MISSING.
+ */
+extern int chashmap_remove(cmap_t in, const char *key, any_t *old);
+
+/*
+ * Remove every element, calling f(item, value) for each one first under
+ * the writer lock. f must not call back into the map.
+ */
+extern void chashmap_clear(cmap_t in, PFany f, any_t item);
+
+/*
+ * Number of live elements.
+ */
+extern int chashmap_length(cmap_t in);
+
+/*
+ * Free the map. No reader or writer may still be using it.
+ */
+extern void chashmap_free(cmap_t in);
+
+#endif //__CHASHMAP_H__
@@ -0,0 +1,229 @@
+/*
+ * Directory entries.
+ *
+ * Most directories hold a handful of entries, and files hold none, so a
+ * hashmap per node mostly paid for empty buckets. Entries start in an
+ * array grown by doubling from CHILDREN_MIN_CAPACITY, where a lookup is a
+ * short strcmp scan; a directory that grows past CHILDREN_ARRAY_MAX moves
+ * to a hashmap and stays there.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "hashmap.h"
+#include "xyfs.h"
+#include "children.h"
+
+void children_init(Children *children) {
+    children->count = 0;
+    children->capacity = 0;
+    children->u.array = NULL;
+}
+
+static int is_map(Children *children) {
+    return children->capacity == 0 && children->u.map != NULL;
+}
+
+static int find_in_array(Children *children, const char *name) {
+    int i;
+    for (i = 0; i < children->count; i++) {
+        if (strcmp(children->u.array[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Node *children_get(Children *children, const char *name) {
+    Node *child;
+    int i;
+    if (is_map(children)) {
+        if (hashmap_get(children->u.map, (char *) name, (void **) (&child)) != MAP_OK) {
+            return NULL;
+        }
+        return child;
+    }
+    i = find_in_array(children, name);
+    return i < 0 ? NULL : children->u.array[i];
+}
+
+/* Move every entry of a full array into a new hashmap. */
+static int promote(Children *children) {
+    map_t map = hashmap_new();
+    int i;
+    if (map == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < children->count; i++) {
+        if (hashmap_put(map, children->u.array[i]->name, children->u.array[i]) != MAP_OK) {
+            hashmap_free(map);
+            return -ENOMEM;
+        }
+    }
+    free(children->u.array);
+    children->u.map = map;
+    children->capacity = 0;
+    return 0;
+}
+
+int children_add(Children *children, Node *child) {
+    if (!is_map(children) && children->count == children->capacity) {
+        if (children->capacity >= CHILDREN_ARRAY_MAX) {
+            if (promote(children) != 0) {
+                return -ENOMEM;
+            }
+        } else {
+            int capacity = children->capacity == 0 ? CHILDREN_MIN_CAPACITY : children->capacity * 2;
+            Node **array = (Node **) realloc(children->u.array, capacity * sizeof(Node *));
+            if (array == NULL) {
+                return -ENOMEM;
+            }
+            children->u.array = array;
+            children->capacity = capacity;
+        }
+    }
+
+    if (is_map(children)) {
+        if (hashmap_put(children->u.map, child->name, child) != MAP_OK) {
+            return -ENOMEM;
+        }
+    } else {
+        children->u.array[children->count] = child;
+    }
+    children->count++;
+    return 0;
+}
+
+int children_remove(Children *children, const char *name) {
+    int i;
+    if (is_map(children)) {
+        if (hashmap_remove(children->u.map, (char *) name) != MAP_OK) {
+            return -ENOENT;
+        }
+        children->count--;
+        return 0;
+    }
+    i = find_in_array(children, name);
+    if (i < 0) {
+        return -ENOENT;
+    }
+    children->u.array[i] = children->u.array[--children->count];
+    if (children->count == 0) {
+        /* An emptied directory goes back to costing nothing. */
+        free(children->u.array);
+        children_init(children);
+    }
+    return 0;
+}
+
+/*
+ * Unlink child, which is linked under name. In an array that name may no
+ * longer be child's, so the entry is found by the node instead.
+ */
+static void unlink_entry(Children *children, const char *name, Node *child) {
+    int i;
+    if (is_map(children)) {
+        hashmap_remove(children->u.map, (char *) name);
+        children->count--;
+        return;
+    }
+    for (i = 0; children->u.array[i] != child; i++) {
+    }
+    children->u.array[i] = children->u.array[--children->count];
+    if (children->count == 0) {
+        free(children->u.array);
+        children_init(children);
+    }
+}
+
+/*
+ * Put child where old is, under child->name, which is the name old was
+ * linked under. Overwriting a key the map holds never allocates.
+ */
+static void replace_entry(Children *children, Node *old, Node *child) {
+    int i;
+    if (is_map(children)) {
+        hashmap_put(children->u.map, child->name, child);
+        return;
+    }
+    for (i = 0; children->u.array[i] != old; i++) {
+    }
+    children->u.array[i] = child;
+}
+
+int children_move(Children *from, const char *old_name, Children *to, Node *child) {
+    if (from == to && !is_map(from)) {
+        /* The array finds the entry by the node's name: it has moved. */
+        return 0;
+    }
+    if (children_add(to, child) != 0) {
+        return -ENOMEM;
+    }
+    unlink_entry(from, old_name, child);
+    return 0;
+}
+
+void children_replace(Children *from, const char *old_name, Children *to, Node *target, Node *child) {
+    unlink_entry(from, old_name, child);
+    replace_entry(to, target, child);
+}
+
+void children_exchange(Children *from, Node *a, Children *to, Node *b) {
+    if (from == to && !is_map(from)) {
+        return;
+    }
+    replace_entry(from, a, b);
+    replace_entry(to, b, a);
+}
+
+int children_count(Children *children) {
+    return children->count;
+}
+
+int children_names(Children *children, char *names[]) {
+    int i;
+    if (is_map(children)) {
+        return hashmap_keys(children->u.map, names);
+    }
+    for (i = 0; i < children->count; i++) {
+        names[i] = children->u.array[i]->name;
+    }
+    return children->count;
+}
+
+static int collect_node(any_t item, any_t data) {
+    Node ***next = (Node ***) item;
+    *(*next)++ = (Node *) data;
+    return MAP_OK;
+}
+
+int children_nodes(Children *children, Node *nodes[]) {
+    if (is_map(children)) {
+        Node **next = nodes;
+        hashmap_iterate(children->u.map, collect_node, &next);
+        return next - nodes;
+    }
+    memcpy(nodes, children->u.array, children->count * sizeof(Node *));
+    return children->count;
+}
+
+int children_stalled(Children *children) {
+    return is_map(children) && hashmap_stalled(children->u.map);
+}
+
+void children_settle(Children *children) {
+    if (is_map(children)) {
+        hashmap_settle(children->u.map);
+    }
+}
+
+void children_free(Children *children) {
+    if (is_map(children)) {
+        hashmap_free(children->u.map);
+    } else {
+        free(children->u.array);
+    }
+    children_init(children);
+}
@@ -0,0 +1,94 @@
+//
+// Directory entries: the children of a directory Node, by name.
+//
+
+#ifndef XYFS_CHILDREN_H
+#define XYFS_CHILDREN_H
+
+#define CHILDREN_MIN_CAPACITY 4
+#define CHILDREN_ARRAY_MAX 16
+
+struct node;
+
+/*
+ * Nothing is allocated until the first entry goes in, so files and empty
+ * directories cost no more than this struct. Up to CHILDREN_ARRAY_MAX
+ * entries live in a small array that is scanned linearly; past that the
+ * directory is promoted to a hashmap keyed by the child's name.
+ */
+typedef struct children
+{
+    int count;
+    int capacity;       /* slots in array; 0 once promoted to map */
+    union
+    {
+        struct node **array;
+        void *map;
+    } u;
+} Children;
+
+extern void children_init(Children *children);
+
+/*
+ * Return the child called name, or NULL.
+ */
+extern struct node *children_get(Children *children, const char *name);
+
+/*
+ * Add child under child->name, which must stay valid while it is linked.
+ * The name must not be present yet. Returns 0 or -ENOMEM.
+ */
+extern int children_add(Children *children, struct node *child);
+
+/*
+ * Unlink the child called name. Returns 0 or -ENOENT.
+ */
+extern int children_remove(Children *children, const char *name);
+
+/*
+ * Renames. child has just been given its new name in child->name, and is
+ * still linked in from, where it was found under old_name; to may be from.
+ *
+ * children_move links it into to under the new name, which must not be
+ * present there yet, and unlinks the old entry. Returns 0, or -ENOMEM
+ * with nothing changed.
+ *
+ * children_replace unlinks the old entry and puts child in the place of
+ * target, the child of to that has the new name. It allocates nothing,
+ * so it cannot fail.
+ */
+extern int children_move(Children *from, const char *old_name, Children *to, struct node *child);
+extern void children_replace(Children *from, const char *old_name, Children *to, struct node *target,
+                             struct node *child);
+
+/*
+ * a in from and b in to have just swapped names: swap their entries.
+ * Allocates nothing.
+ */
+extern void children_exchange(Children *from, struct node *a, Children *to, struct node *b);
+
+extern int children_count(Children *children);
+
+/*
+ * Store the name of every child in names, which has room for
+ * children_count entries. Returns the number stored.
+ */
+extern int children_names(Children *children, char *names[]);
+
+/*
+ * Store every child in nodes, which has room for children_count entries.
+ * Returns the number stored.
+ */
+extern int children_nodes(Children *children, struct node *nodes[]);
+
+/*
+ * Whether a rebuild of the entry table has stalled (hashmap_stalled), and
+ * finish it. children_stalled may be called under the directory's read
+ * lock; children_settle needs its write lock.
+ */
+extern int children_stalled(Children *children);
+extern void children_settle(Children *children);
+
+extern void children_free(Children *children);
+
+#endif //XYFS_CHILDREN_H
@@ -0,0 +1,157 @@
+/*
+ * Cold chunk compression.
+ *
+ * Chunks are compressed with the block codec in lz.c. Reads decompress a
+ * whole chunk into a small direct-mapped cache, indexed by chunk id, and
+ * copy out of it, so a run of reads through a cold chunk pays for one
+ * decompression. Each cache entry has its own lock, held while it is
+ * filled and copied from; two readers only wait for each other when their
+ * chunks map to the same entry. An entry can still hold a chunk that was
+ * freed since: ids are never reused, so it just never matches again.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "cold.h"
+#include "lz.h"
+
+typedef struct cache_entry
+{
+    pthread_mutex_t lock;
+    uint64_t id;            /* 0 when empty */
+    unsigned int capacity;
+    char *data;
+} CacheEntry;
+
+static unsigned int cache_size = COLD_DEFAULT_CACHE;
+static CacheEntry *cache;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static uint64_t next_id = 1;
+static ColdStats stats;
+
+void cold_set_cache(unsigned int blocks) {
+    cache_size = blocks > 0 ? blocks : 1;
+}
+
+static void init_cache() {
+    unsigned int i;
+    cache = (CacheEntry *) calloc(cache_size, sizeof(CacheEntry));
+    for (i = 0; cache != NULL && i < cache_size; i++) {
+        pthread_mutex_init(&cache[i].lock, NULL);
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *decompress(ColdChunk *chunk) {
+    char *data = (char *) malloc(chunk->size);
+    if (data == NULL) {
+        return NULL;
+    }
+    if (lz_decompress(chunk->data, chunk->length, data, chunk->size) != 0) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+ColdChunk *cold_compress(const char *data, unsigned int size) {
+    unsigned int capacity = size - size / 8;
+    if (size < COLD_MIN_SIZE) {
+        return NULL;
+    }
+    ColdChunk *chunk = (ColdChunk *) malloc(sizeof(ColdChunk) + capacity);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    int length = lz_compress(data, size, chunk->data, capacity);
+    if (length == 0) {
+        free(chunk);
+        return NULL;
+    }
+    ColdChunk *shrunk = (ColdChunk *) realloc(chunk, sizeof(ColdChunk) + length);
+    if (shrunk != NULL) {
+        chunk = shrunk;
+    }
+    chunk->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    chunk->size = size;
+    chunk->length = length;
+    __atomic_add_fetch(&stats.chunks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.compressed_bytes, length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.uncompressed_bytes, size, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+void cold_read(ColdChunk *chunk, size_t within, char *buf, size_t n) {
+    pthread_once(&cache_once, init_cache);
+    if (cache == NULL) {
+        /* No memory for a cache at startup: decompress every time. */
+        char *data = decompress(chunk);
+        if (data != NULL) {
+            memcpy(buf, data + within, n);
+            free(data);
+        } else {
+            memset(buf, 0, n);
+        }
+        return;
+    }
+    CacheEntry *entry = &cache[chunk->id % cache_size];
+
+    pthread_mutex_lock(&entry->lock);
+    if (entry->id == chunk->id) {
+        __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+    } else {
+        uint64_t start = now_ns();
+        entry->id = 0;
+        if (entry->capacity < chunk->size) {
+            char *data = (char *) realloc(entry->data, chunk->size);
+            if (data != NULL) {
+                entry->data = data;
+                entry->capacity = chunk->size;
+            }
+        }
+        if (entry->capacity >= chunk->size &&
+            lz_decompress(chunk->data, chunk->length, entry->data, chunk->size) == 0) {
+            entry->id = chunk->id;
+        }
+        __atomic_add_fetch(&stats.misses, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.miss_ns, now_ns() - start, __ATOMIC_RELAXED);
+    }
+    if (entry->id == chunk->id) {
+        memcpy(buf, entry->data + within, n);
+    } else {
+        /* Out of memory for the entry; there is no error to return. */
+        memset(buf, 0, n);
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+char *cold_decompress(ColdChunk *chunk) {
+    char *data = decompress(chunk);
+    if (data != NULL) {
+        __atomic_add_fetch(&stats.thaws, 1, __ATOMIC_RELAXED);
+    }
+    return data;
+}
+
+void cold_free(ColdChunk *chunk) {
+    __atomic_sub_fetch(&stats.chunks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.compressed_bytes, chunk->length, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.uncompressed_bytes, chunk->size, __ATOMIC_RELAXED);
+    free(chunk);
+}
+
+void cold_get_stats(ColdStats *out) {
+    out->chunks = __atomic_load_n(&stats.chunks, __ATOMIC_RELAXED);
+    out->compressed_bytes = __atomic_load_n(&stats.compressed_bytes, __ATOMIC_RELAXED);
+    out->uncompressed_bytes = __atomic_load_n(&stats.uncompressed_bytes, __ATOMIC_RELAXED);
+    out->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+    out->thaws = __atomic_load_n(&stats.thaws, __ATOMIC_RELAXED);
+    out->miss_ns = __atomic_load_n(&stats.miss_ns, __ATOMIC_RELAXED);
+}
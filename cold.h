@@ -0,0 +1,71 @@
+//
+// Compressed storage for file data chunks that have gone cold.
+//
+
+#ifndef XYFS_COLD_H
+#define XYFS_COLD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COLD_DEFAULT_CACHE 64
+#define COLD_MIN_SIZE 1024
+
+/*
+ * One compressed chunk. id names it in the decompression cache and is
+ * never reused, so a freed chunk cannot be confused with a later one.
+ */
+typedef struct cold_chunk
+{
+    uint64_t id;
+    unsigned int size;      /* bytes when decompressed */
+    unsigned int length;    /* bytes of data */
+    char data[];
+} ColdChunk;
+
+/*
+ * chunks, compressed_bytes and uncompressed_bytes count what is stored
+ * compressed now. miss_ns is the time spent decompressing for cache
+ * misses, so miss_ns / misses is the extra latency of a cold read.
+ */
+typedef struct cold_stats
+{
+    unsigned long chunks;
+    size_t compressed_bytes;
+    size_t uncompressed_bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long thaws;        /* chunks decompressed for a write */
+    uint64_t miss_ns;
+} ColdStats;
+
+/*
+ * Set the number of decompressed chunks kept for reads, at least 1. Must
+ * be called before the first cold_read.
+ */
+extern void cold_set_cache(unsigned int blocks);
+
+/*
+ * Compress size bytes at data. Returns NULL if out of memory, if size is
+ * below COLD_MIN_SIZE or if compressing would not save at least an
+ * eighth; data is left alone either way.
+ */
+extern ColdChunk *cold_compress(const char *data, unsigned int size);
+
+/*
+ * Copy n bytes at within of the decompressed chunk into buf, through the
+ * cache. Safe to call from any number of threads at once.
+ */
+extern void cold_read(ColdChunk *chunk, size_t within, char *buf, size_t n);
+
+/*
+ * Return the chunk's bytes in new malloc'd memory, or NULL when out of
+ * memory. The chunk itself is left alone.
+ */
+extern char *cold_decompress(ColdChunk *chunk);
+
+extern void cold_free(ColdChunk *chunk);
+
+extern void cold_get_stats(ColdStats *stats);
+
+#endif //XYFS_COLD_H
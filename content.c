@@ -0,0 +1,831 @@
+/*
+ * Chunked file content store.
+ *
+ * A file is a radix tree of RADIX_FANOUT-way interior nodes whose leaves
+ * are CHUNK_SIZE data chunks. Appending allocates at most one new chunk
+ * (plus an interior node every RADIX_FANOUT chunks), overwrites touch only
+ * the chunks they cover, and a write past EOF leaves real holes.
+ *
+ * The smallest files keep their only chunk inline in the Content itself
+ * and move to the heap the first time they outgrow it. Files restored
+ * from a snapshot image read from the mapping until they are written.
+ *
+ * Truncating and punching holes cut chunks out of the tree, free the
+ * interior nodes left empty and lower the tree while it has more levels
+ * than the chunks left need. Read replies may point into a chunk after
+ * the file lock is dropped, so chunks cut from an open file are kept
+ * until content_release.
+ *
+ * A chunk pointer with SHARED_TAG set is a DedupBlock holding the chunk,
+ * shared with other files; it is copied before it is written. One with
+ * COLD_TAG set is a ColdChunk holding it compressed; reads go through the
+ * cold cache and a write decompresses it for good.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include "content.h"
+#include "dedup.h"
+#include "cold.h"
+
+#define SHARED_TAG 1UL
+#define COLD_TAG 2UL
+#define OFFSET_MAX ((off_t) (UINT64_MAX >> 1))
+
+/* Backing for holes handed out by content_map_read. */
+static const char zero_chunk[CHUNK_SIZE];
+
+void content_init(Content *content) {
+    content->u.tree = NULL;
+    content->height = 0;
+    content->head_capacity = 0;
+}
+
+void content_init_image(Content *content, const char *base, size_t length) {
+    content->u.image.base = base;
+    content->u.image.length = length;
+    content->height = CONTENT_IMAGE_HEIGHT;
+    content->head_capacity = 0;
+}
+
+/*
+ * Copy image-backed content into chunks of its own. Returns 0 or -ENOMEM,
+ * in which case the content is still image-backed.
+ */
+static int copy_image(Content *content) {
+    Content copy;
+    content_init(&copy);
+    if (content_write(&copy, content->u.image.base, content->u.image.length, 0) != 0) {
+        content_free(&copy);
+        return -ENOMEM;
+    }
+    *content = copy;
+    return 0;
+}
+
+static int is_shared(void *chunk) {
+    return ((uintptr_t) chunk & SHARED_TAG) != 0;
+}
+
+static DedupBlock *shared_block(void *chunk) {
+    return (DedupBlock *) ((uintptr_t) chunk & ~SHARED_TAG);
+}
+
+static int is_cold(void *chunk) {
+    return ((uintptr_t) chunk & COLD_TAG) != 0;
+}
+
+static ColdChunk *cold_chunk(void *chunk) {
+    return (ColdChunk *) ((uintptr_t) chunk & ~COLD_TAG);
+}
+
+static int is_tagged(void *chunk) {
+    return ((uintptr_t) chunk & (SHARED_TAG | COLD_TAG)) != 0;
+}
+
+/* The memory of a chunk, shared or not. Not for cold chunks. */
+static char *chunk_data(void *chunk) {
+    return is_shared(chunk) ? shared_block(chunk)->data : (char *) chunk;
+}
+
+/*
+ * Make the chunk in *slot private before it is written. Returns its
+ * memory, or NULL when out of memory.
+ */
+static char *own_chunk(Content *content, void **slot) {
+    if (is_shared(*slot)) {
+        char *data = dedup_unshare(shared_block(*slot), content);
+        if (data == NULL) {
+            return NULL;
+        }
+        *slot = data;
+    } else if (is_cold(*slot)) {
+        char *data = cold_decompress(cold_chunk(*slot));
+        if (data == NULL) {
+            return NULL;
+        }
+        cold_free(cold_chunk(*slot));
+        *slot = data;
+    }
+    return (char *) *slot;
+}
+
+static int is_inline(Content *content) {
+    return content->height == 0 && content->head_capacity == CONTENT_INLINE_SIZE;
+}
+
+/* Chunk 0 of a height 0 file, or NULL if nothing was written yet. */
+static char *head_chunk(Content *content) {
+    if (content->head_capacity == 0) {
+        return NULL;
+    }
+    return is_inline(content) ? content->u.data : chunk_data(content->u.tree);
+}
+
+/*
+ * Give chunk 0 of a height 0 file room for capacity bytes, moving it out
+ * of the Content or reallocating it, and zero the new tail.
+ */
+static char *resize_head(Content *content, unsigned int capacity) {
+    char *chunk;
+    if (capacity <= CONTENT_INLINE_SIZE && content->head_capacity == 0) {
+        memset(content->u.data, 0, CONTENT_INLINE_SIZE);
+        content->head_capacity = CONTENT_INLINE_SIZE;
+        return content->u.data;
+    }
+    if (is_inline(content)) {
+        chunk = (char *) malloc(capacity);
+        if (chunk != NULL) {
+            memcpy(chunk, content->u.data, CONTENT_INLINE_SIZE);
+        }
+    } else if (is_tagged(content->u.tree) && own_chunk(content, &content->u.tree) == NULL) {
+        return NULL;
+    } else {
+        chunk = (char *) realloc(content->u.tree, capacity);
+    }
+    if (chunk == NULL) {
+        return NULL;
+    }
+    memset(chunk + content->head_capacity, 0, capacity - content->head_capacity);
+    content->u.tree = chunk;
+    content->head_capacity = capacity;
+    return chunk;
+}
+
+/* Number of chunks a tree of the given height can address. */
+static unsigned long tree_capacity(int height) {
+    return 1UL << (height * RADIX_SHIFT);
+}
+
+/*
+ * Return the slot holding chunk index, or NULL if the path to it does not
+ * exist and create is not set.
+ */
+static void **chunk_slot(Content *content, unsigned long index, int create) {
+    while (index >= tree_capacity(content->height)) {
+        if (!create) {
+            return NULL;
+        }
+        /* Chunk 0 is about to get siblings, give it a full chunk. */
+        if (content->height == 0 && content->head_capacity != 0 && content->head_capacity < CHUNK_SIZE) {
+            if (resize_head(content, CHUNK_SIZE) == NULL) {
+                return NULL;
+            }
+        }
+        void **radix_node = (void **) calloc(RADIX_FANOUT, sizeof(void *));
+        if (radix_node == NULL) {
+            return NULL;
+        }
+        radix_node[0] = content->u.tree;
+        content->u.tree = radix_node;
+        content->height++;
+    }
+
+    void **slot = &content->u.tree;
+    int level;
+    for (level = content->height; level > 0; level--) {
+        if (*slot == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            *slot = calloc(RADIX_FANOUT, sizeof(void *));
+            if (*slot == NULL) {
+                return NULL;
+            }
+        }
+        unsigned long i = (index >> ((level - 1) * RADIX_SHIFT)) & (RADIX_FANOUT - 1);
+        slot = &((void **) *slot)[i];
+    }
+    return slot;
+}
+
+/*
+ * Make sure chunk 0 of a single-chunk file can hold end bytes.
+ */
+static char *grow_head(Content *content, size_t end) {
+    unsigned int capacity = content->head_capacity;
+    if (end <= capacity) {
+        return is_inline(content) ? content->u.data : own_chunk(content, &content->u.tree);
+    }
+    if (end <= CONTENT_INLINE_SIZE) {
+        return resize_head(content, CONTENT_INLINE_SIZE);
+    }
+    capacity = MIN_HEAD_CAPACITY;
+    while (capacity < end) {
+        capacity *= 2;
+    }
+    if (capacity > CHUNK_SIZE) {
+        capacity = CHUNK_SIZE;
+    }
+    return resize_head(content, capacity);
+}
+
+int content_map_read(Content *content, size_t size, off_t offset, struct iovec *iov, int max) {
+    int count = 0;
+    while (size > 0 && count < max) {
+        unsigned long index = offset >> CHUNK_SHIFT;
+        size_t within = offset & (CHUNK_SIZE - 1);
+        size_t n = CHUNK_SIZE - within;
+        if (n > size) {
+            n = size;
+        }
+
+        if (content->height == CONTENT_IMAGE_HEIGHT) {
+            if ((size_t) offset >= content->u.image.length) {
+                iov[count].iov_base = (void *) zero_chunk;
+            } else {
+                if (offset + n > content->u.image.length) {
+                    n = content->u.image.length - offset;
+                }
+                iov[count].iov_base = (char *) content->u.image.base + offset;
+            }
+        } else if (content->height == 0) {
+            if (index != 0 || within >= content->head_capacity) {
+                iov[count].iov_base = (void *) zero_chunk;
+            } else {
+                if (within + n > content->head_capacity) {
+                    /* The rest of a short head chunk is zeros. */
+                    n = content->head_capacity - within;
+                }
+                if (!is_inline(content) && is_cold(content->u.tree)) {
+                    iov[count].iov_base = NULL;
+                } else {
+                    iov[count].iov_base = head_chunk(content) + within;
+                }
+            }
+        } else {
+            void **slot = chunk_slot(content, index, 0);
+            if (slot == NULL || *slot == NULL) {
+                iov[count].iov_base = (void *) zero_chunk;
+            } else if (is_cold(*slot)) {
+                iov[count].iov_base = NULL;
+            } else {
+                iov[count].iov_base = chunk_data(*slot) + within;
+            }
+        }
+        iov[count].iov_len = n;
+        count++;
+
+        offset += n;
+        size -= n;
+    }
+    return count;
+}
+
+int content_map_write(Content *content, size_t size, off_t offset, struct iovec *iov, int max) {
+    int count = 0;
+    if (content->height == CONTENT_IMAGE_HEIGHT && copy_image(content) != 0) {
+        return -ENOMEM;
+    }
+    while (size > 0 && count < max) {
+        unsigned long index = offset >> CHUNK_SHIFT;
+        size_t within = offset & (CHUNK_SIZE - 1);
+        size_t n = CHUNK_SIZE - within;
+        if (n > size) {
+            n = size;
+        }
+
+        char *chunk;
+        if (index == 0 && content->height == 0) {
+            chunk = grow_head(content, within + n);
+        } else {
+            void **slot = chunk_slot(content, index, 1);
+            if (slot == NULL) {
+                return -ENOMEM;
+            }
+            if (*slot == NULL) {
+                *slot = calloc(1, CHUNK_SIZE);
+            }
+            chunk = *slot == NULL ? NULL : own_chunk(content, slot);
+        }
+        if (chunk == NULL) {
+            return -ENOMEM;
+        }
+        iov[count].iov_base = chunk + within;
+        iov[count].iov_len = n;
+        count++;
+
+        offset += n;
+        size -= n;
+    }
+    return count;
+}
+
+#define COPY_SEGMENTS 8
+
+/*
+ * Copy from the cold chunk holding [offset, offset + size), which
+ * content_map_read described as a NULL segment.
+ */
+static void read_cold(Content *content, char *buf, size_t size, off_t offset) {
+    void *chunk = content->u.tree;
+    if (content->height > 0) {
+        chunk = *chunk_slot(content, offset >> CHUNK_SHIFT, 0);
+    }
+    cold_read(cold_chunk(chunk), offset & (CHUNK_SIZE - 1), buf, size);
+}
+
+void content_read(Content *content, char *buf, size_t size, off_t offset) {
+    struct iovec iov[COPY_SEGMENTS];
+    while (size > 0) {
+        int count = content_map_read(content, size, offset, iov, COPY_SEGMENTS);
+        int i;
+        for (i = 0; i < count; i++) {
+            if (iov[i].iov_base == NULL) {
+                read_cold(content, buf, iov[i].iov_len, offset);
+            } else {
+                memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+            }
+            buf += iov[i].iov_len;
+            offset += iov[i].iov_len;
+            size -= iov[i].iov_len;
+        }
+    }
+}
+
+int content_write(Content *content, const char *buf, size_t size, off_t offset) {
+    struct iovec iov[COPY_SEGMENTS];
+    while (size > 0) {
+        int count = content_map_write(content, size, offset, iov, COPY_SEGMENTS);
+        if (count < 0) {
+            return count;
+        }
+        int i;
+        for (i = 0; i < count; i++) {
+            memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+            buf += iov[i].iov_len;
+            offset += iov[i].iov_len;
+            size -= iov[i].iov_len;
+        }
+    }
+    return 0;
+}
+
+static void free_tree(void *tree, int height) {
+    if (tree == NULL) {
+        return;
+    }
+    if (is_shared(tree)) {
+        dedup_put(shared_block(tree));
+        return;
+    }
+    if (is_cold(tree)) {
+        cold_free(cold_chunk(tree));
+        return;
+    }
+    if (height > 0) {
+        int i;
+        for (i = 0; i < RADIX_FANOUT; i++) {
+            free_tree(((void **) tree)[i], height - 1);
+        }
+    }
+    free(tree);
+}
+
+/*
+ * Chunks cut from a file that is open. A read reply may still point into
+ * them, so they are kept until content_release. Cutting chunks from an
+ * open file is rare, so one list serves every file.
+ */
+typedef struct retired_tree
+{
+    const Content *owner;
+    void *tree;
+    int height;
+    struct retired_tree *next;
+} RetiredTree;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static RetiredTree *retired;
+static unsigned long retired_count;
+
+void content_release(Content *content) {
+    RetiredTree *released = NULL;
+
+    dedup_release(content);
+    if (__atomic_load_n(&retired_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&retired_lock);
+    RetiredTree **link = &retired;
+    while (*link != NULL) {
+        RetiredTree *r = *link;
+        if (r->owner != content) {
+            link = &r->next;
+            continue;
+        }
+        *link = r->next;
+        __atomic_store_n(&retired_count, retired_count - 1, __ATOMIC_RELAXED);
+        r->next = released;
+        released = r;
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while (released != NULL) {
+        RetiredTree *next = released->next;
+        free_tree(released->tree, released->height);
+        free(released);
+        released = next;
+    }
+}
+
+void content_free(Content *content) {
+    if (!is_inline(content) && content->height != CONTENT_IMAGE_HEIGHT) {
+        free_tree(content->u.tree, content->height);
+    }
+    content_release(content);
+    content_init(content);
+}
+
+/*
+ * Take the subtree in *slot out of the content, freeing it now or, when
+ * in_use, at content_release. Returns 0, or -ENOMEM with *slot untouched.
+ */
+static int cut(Content *content, void **slot, int height, int in_use) {
+    if (*slot == NULL) {
+        return 0;
+    }
+    if (in_use) {
+        RetiredTree *r = (RetiredTree *) malloc(sizeof(RetiredTree));
+        if (r == NULL) {
+            return -ENOMEM;
+        }
+        r->owner = content;
+        r->tree = *slot;
+        r->height = height;
+        pthread_mutex_lock(&retired_lock);
+        r->next = retired;
+        retired = r;
+        __atomic_store_n(&retired_count, retired_count + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&retired_lock);
+    } else {
+        free_tree(*slot, height);
+    }
+    *slot = NULL;
+    return 0;
+}
+
+/* Whether slots from to RADIX_FANOUT - 1 of an interior node are empty. */
+static int radix_empty(void **radix_node, int from) {
+    int i;
+    for (i = from; i < RADIX_FANOUT; i++) {
+        if (radix_node[i] != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Cut chunks first to last - 1 out of the subtree in *slot, which starts
+ * at chunk base. Subtrees wholly inside the range go in one piece, and
+ * interior nodes left empty are freed; no read reply points into those.
+ */
+static int cut_range(Content *content, void **slot, int height, unsigned long base,
+                     unsigned long first, unsigned long last, int in_use) {
+    unsigned long span = tree_capacity(height);
+    if (*slot == NULL || last <= base || first >= base + span) {
+        return 0;
+    }
+    if (first <= base && base + span <= last) {
+        return cut(content, slot, height, in_use);
+    }
+    unsigned long child_span = span / RADIX_FANOUT;
+    int i;
+    for (i = 0; i < RADIX_FANOUT; i++) {
+        int rc = cut_range(content, &((void **) *slot)[i], height - 1, base + i * child_span,
+                           first, last, in_use);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    if (radix_empty((void **) *slot, 0)) {
+        free(*slot);
+        *slot = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Lower the tree while everything in it hangs off its first slot, so a
+ * file that shrank is addressed by the smallest tree that holds it.
+ */
+static void shrink_tree(Content *content) {
+    if (content->height == 0) {
+        return;
+    }
+    while (content->height > 0) {
+        void **radix_node = (void **) content->u.tree;
+        if (radix_node != NULL && !radix_empty(radix_node, 1)) {
+            return;
+        }
+        content->u.tree = radix_node != NULL ? radix_node[0] : NULL;
+        free(radix_node);
+        content->height--;
+    }
+    /* Chunk 0 was given a full chunk when it got siblings. */
+    content->head_capacity = content->u.tree != NULL ? CHUNK_SIZE : 0;
+}
+
+/*
+ * Give the head chunk of a file cut to size only the room grow_head
+ * would have given it, inline if that is enough. While in_use a read
+ * reply may point into the old chunk, so it is retired like a cut chunk
+ * rather than freed. Shared and compressed heads are left as they are.
+ */
+static void shrink_head(Content *content, size_t size, int in_use) {
+    if (content->height != 0 || content->head_capacity == 0 || is_inline(content) ||
+        is_tagged(content->u.tree)) {
+        return;
+    }
+    unsigned int capacity = CONTENT_INLINE_SIZE;
+    if (size > CONTENT_INLINE_SIZE) {
+        capacity = MIN_HEAD_CAPACITY;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+    }
+    if (capacity >= content->head_capacity) {
+        return;
+    }
+
+    void *old = content->u.tree;
+    char *chunk = NULL;
+    char head[CONTENT_INLINE_SIZE];
+    if (capacity > CONTENT_INLINE_SIZE) {
+        /* Keeping the bigger chunk is harmless if this fails. */
+        chunk = (char *) malloc(capacity);
+        if (chunk == NULL) {
+            return;
+        }
+        memcpy(chunk, old, capacity);
+    } else {
+        memcpy(head, old, CONTENT_INLINE_SIZE);
+    }
+    if (cut(content, &old, 0, in_use) != 0) {
+        free(chunk);
+        return;
+    }
+    if (chunk != NULL) {
+        content->u.tree = chunk;
+    } else {
+        memcpy(content->u.data, head, CONTENT_INLINE_SIZE);
+    }
+    content->head_capacity = capacity;
+}
+
+/*
+ * Zero bytes from to to - 1 of chunk index, if it exists.
+ */
+static int zero_within(Content *content, unsigned long index, size_t from, size_t to) {
+    char *chunk;
+    if (content->height == 0) {
+        if (index != 0 || from >= content->head_capacity) {
+            return 0;
+        }
+        if (to > content->head_capacity) {
+            to = content->head_capacity;
+        }
+        chunk = is_inline(content) ? content->u.data : own_chunk(content, &content->u.tree);
+    } else {
+        void **slot = chunk_slot(content, index, 0);
+        if (slot == NULL || *slot == NULL) {
+            return 0;
+        }
+        chunk = own_chunk(content, slot);
+    }
+    if (chunk == NULL) {
+        return -ENOMEM;
+    }
+    memset(chunk + from, 0, to - from);
+    return 0;
+}
+
+/*
+ * Make [start, end) a hole: chunks it covers whole are cut out, the parts
+ * of the chunks at either edge are zeroed. Zeroing matters beyond the
+ * edge of the file too, since bytes past EOF must read back as zeros when
+ * it grows again, and dedup and compression look at whole chunks.
+ */
+static int clear_range(Content *content, off_t start, off_t end, int in_use) {
+    if (content->height == CONTENT_IMAGE_HEIGHT) {
+        if ((size_t) start >= content->u.image.length) {
+            return 0;
+        }
+        if ((size_t) end >= content->u.image.length) {
+            /* The mapping stays; reads just stop short of the cut. */
+            content->u.image.length = start;
+            return 0;
+        }
+        if (copy_image(content) != 0) {
+            return -ENOMEM;
+        }
+    }
+
+    unsigned long start_index = start >> CHUNK_SHIFT;
+    unsigned long end_index = end >> CHUNK_SHIFT;
+    size_t start_within = start & (CHUNK_SIZE - 1);
+    size_t end_within = end & (CHUNK_SIZE - 1);
+    unsigned long first = start_within == 0 ? start_index : start_index + 1;
+    int rc = 0;
+
+    if (start_within != 0) {
+        rc = zero_within(content, start_index, start_within, end_index == start_index ? end_within : CHUNK_SIZE);
+    }
+    if (rc == 0 && end_within != 0 && end_index >= first) {
+        rc = zero_within(content, end_index, 0, end_within);
+    }
+    if (rc != 0 || first >= end_index) {
+        return rc;
+    }
+    if (content->height > 0) {
+        rc = cut_range(content, &content->u.tree, content->height, 0, first, end_index, in_use);
+        shrink_tree(content);
+        return rc;
+    }
+    if (first > 0) {
+        return 0;
+    }
+    /* The head chunk is covered whole. */
+    if (!is_inline(content)) {
+        rc = cut(content, &content->u.tree, 0, in_use);
+    }
+    if (rc == 0) {
+        content_init(content);
+    }
+    return rc;
+}
+
+int content_truncate(Content *content, off_t size, int in_use) {
+    int rc = clear_range(content, size, OFFSET_MAX, in_use);
+    if (rc == 0) {
+        shrink_head(content, size, in_use);
+    }
+    return rc;
+}
+
+int content_punch(Content *content, off_t offset, off_t length, int in_use) {
+    return clear_range(content, offset, offset + length, in_use);
+}
+
+int content_reserve(Content *content, off_t offset, off_t length) {
+    struct iovec iov[COPY_SEGMENTS];
+    while (length > 0) {
+        int count = content_map_write(content, length, offset, iov, COPY_SEGMENTS);
+        if (count < 0) {
+            return count;
+        }
+        int i;
+        for (i = 0; i < count; i++) {
+            offset += iov[i].iov_len;
+            length -= iov[i].iov_len;
+        }
+    }
+    return 0;
+}
+
+/*
+ * First chunk at or after from in the subtree at tree, which starts at
+ * chunk base, that is present (or missing, if present is 0). Returns
+ * ULONG_MAX if there is none in the subtree.
+ */
+static unsigned long find_chunk(void *tree, int height, unsigned long base, unsigned long from, int present) {
+    if (tree == NULL || height == 0) {
+        if ((tree != NULL) != present) {
+            return ULONG_MAX;
+        }
+        return from > base ? from : base;
+    }
+    unsigned long child_span = tree_capacity(height) / RADIX_FANOUT;
+    unsigned long i = from > base ? (from - base) / child_span : 0;
+    for (; i < RADIX_FANOUT; i++) {
+        unsigned long found = find_chunk(((void **) tree)[i], height - 1, base + i * child_span, from, present);
+        if (found != ULONG_MAX) {
+            return found;
+        }
+    }
+    return ULONG_MAX;
+}
+
+off_t content_seek(Content *content, off_t offset, int hole) {
+    unsigned long index = offset >> CHUNK_SHIFT;
+    unsigned long found;
+
+    if (content->height == CONTENT_IMAGE_HEIGHT) {
+        if ((size_t) offset < content->u.image.length) {
+            return hole ? (off_t) content->u.image.length : offset;
+        }
+        return hole ? offset : -1;
+    }
+    if (index >= tree_capacity(content->height)) {
+        return hole ? offset : -1;
+    }
+    if (content->height == 0) {
+        found = (content->head_capacity != 0) != hole ? 0 : ULONG_MAX;
+    } else {
+        found = find_chunk(content->u.tree, content->height, 0, index, !hole);
+    }
+    if (found == ULONG_MAX) {
+        /* The rest of what the tree addresses is data, or all holes. */
+        unsigned long end = tree_capacity(content->height);
+        if (!hole) {
+            return -1;
+        }
+        return end > (unsigned long) (OFFSET_MAX >> CHUNK_SHIFT) ? OFFSET_MAX : (off_t) end << CHUNK_SHIFT;
+    }
+    return found == index ? offset : (off_t) found << CHUNK_SHIFT;
+}
+
+static size_t tree_memory(void *tree, int height) {
+    if (tree == NULL || is_tagged(tree)) {
+        return 0;
+    }
+    if (height == 0) {
+        return CHUNK_SIZE;
+    }
+    size_t bytes = RADIX_FANOUT * sizeof(void *);
+    int i;
+    for (i = 0; i < RADIX_FANOUT; i++) {
+        bytes += tree_memory(((void **) tree)[i], height - 1);
+    }
+    return bytes;
+}
+
+size_t content_memory(Content *content) {
+    if (content->height == CONTENT_IMAGE_HEIGHT || is_inline(content)) {
+        return 0;
+    }
+    if (content->height == 0) {
+        return content->u.tree == NULL || is_tagged(content->u.tree) ? 0 : content->head_capacity;
+    }
+    return tree_memory(content->u.tree, content->height);
+}
+
+static void walk_tree(void **slot, int height, void (*fn)(void **slot, unsigned int size)) {
+    if (*slot == NULL) {
+        return;
+    }
+    if (height == 0) {
+        fn(slot, CHUNK_SIZE);
+        return;
+    }
+    int i;
+    for (i = 0; i < RADIX_FANOUT; i++) {
+        walk_tree(&((void **) *slot)[i], height - 1, fn);
+    }
+}
+
+/*
+ * Put the chunk in *slot into the block store, if it is not there yet.
+ */
+static void share_chunk(void **slot, unsigned int size) {
+    if (*slot == NULL || is_tagged(*slot)) {
+        return;
+    }
+    DedupBlock *block = dedup_share((char *) *slot, size);
+    if (block != NULL) {
+        *slot = (void *) ((uintptr_t) block | SHARED_TAG);
+    }
+}
+
+/*
+ * Call fn on the slot of every chunk of the content, with the chunk's
+ * size. Inline and image-backed content has no chunks of its own.
+ */
+static void for_each_chunk(Content *content, void (*fn)(void **slot, unsigned int size)) {
+    if (content->height == CONTENT_IMAGE_HEIGHT || is_inline(content)) {
+        return;
+    }
+    if (content->height == 0) {
+        fn(&content->u.tree, content->head_capacity);
+    } else {
+        walk_tree(&content->u.tree, content->height, fn);
+    }
+}
+
+void content_dedup(Content *content) {
+    content_release(content);
+    for_each_chunk(content, share_chunk);
+}
+
+/*
+ * Replace the private chunk in *slot with a compressed copy, if that
+ * saves enough to be worth it.
+ */
+static void compress_chunk(void **slot, unsigned int size) {
+    if (*slot == NULL || is_tagged(*slot)) {
+        return;
+    }
+    ColdChunk *cold = cold_compress((char *) *slot, size);
+    if (cold != NULL) {
+        free(*slot);
+        *slot = (void *) ((uintptr_t) cold | COLD_TAG);
+    }
+}
+
+void content_compress(Content *content) {
+    for_each_chunk(content, compress_chunk);
+}
@@ -0,0 +1,155 @@
+//
+// Chunked file content store.
+//
+
+#ifndef XYFS_CONTENT_H
+#define XYFS_CONTENT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CHUNK_SHIFT 16
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define RADIX_SHIFT 9
+#define RADIX_FANOUT (1 << RADIX_SHIFT)
+#define MIN_HEAD_CAPACITY 64
+#define CONTENT_INLINE_SIZE 56
+#define CONTENT_IMAGE_HEIGHT (-1)
+
+/*
+ * File data as fixed CHUNK_SIZE chunks hung off a radix tree indexed by
+ * chunk number. Missing chunks are holes and read back as zeros.
+ *
+ * While the whole file fits in chunk 0 (height 0), that chunk is sized to
+ * head_capacity and grown by doubling, so small files do not pay for a
+ * full chunk. Up to CONTENT_INLINE_SIZE bytes it is not allocated at all
+ * but kept in u.data, inside the Node; head_capacity is then exactly
+ * CONTENT_INLINE_SIZE.
+ *
+ * Content loaded from a snapshot image stays in the read-only mapping
+ * (u.image, height CONTENT_IMAGE_HEIGHT) until the first write copies it.
+ */
+typedef struct content
+{
+    union
+    {
+        void *tree;
+        char data[CONTENT_INLINE_SIZE];
+        struct
+        {
+            const char *base;
+            size_t length;
+        } image;
+    } u;
+    int height;
+    unsigned int head_capacity;
+} Content;
+
+extern void content_init(Content *content);
+
+/*
+ * Serve the content from length bytes of read-only memory at base, which
+ * must outlive it. The first write copies the bytes into chunks.
+ */
+extern void content_init_image(Content *content, const char *base, size_t length);
+
+/*
+ * Copy size bytes at offset into buf. The caller clamps to the file size;
+ * holes are filled with zeros.
+ */
+extern void content_read(Content *content, char *buf, size_t size, off_t offset);
+
+/*
+ * Store size bytes from buf at offset, allocating chunks as needed.
+ * Returns 0 or -ENOMEM.
+ */
+extern int content_write(Content *content, const char *buf, size_t size, off_t offset);
+
+/*
+ * Upper bound on the number of segments content_map_* produce for a range.
+ */
+#define CONTENT_MAX_SEGMENTS(size, offset) \
+    ((((offset) & (CHUNK_SIZE - 1)) + (size) + CHUNK_SIZE - 1) / CHUNK_SIZE + 1)
+
+/*
+ * Describe [offset, offset + size) as iovecs pointing straight at chunk
+ * memory, without copying. Holes point at a shared read-only zero chunk.
+ * Compressed chunks cannot be pointed at: their segments have a NULL
+ * iov_base and are read with content_read. Returns the number of
+ * segments used, at most max.
+ */
+extern int content_map_read(Content *content, size_t size, off_t offset, struct iovec *iov, int max);
+
+/*
+ * Allocate the chunks covering [offset, offset + size) and describe them
+ * as writable iovecs. Returns the number of segments or -ENOMEM.
+ */
+extern int content_map_write(Content *content, size_t size, off_t offset, struct iovec *iov, int max);
+
+/*
+ * Release every chunk.
+ */
+extern void content_free(Content *content);
+
+/*
+ * Drop everything kept for pointers content_map_read handed out: chunks
+ * cut from the file while in use, and dedup references parked by writes.
+ * Call once no such pointer can still be in use.
+ */
+extern void content_release(Content *content);
+
+/*
+ * Cut the content at size. Chunks past it are freed, or kept until
+ * content_release if in_use says read replies may still point into them,
+ * and the rest of the chunk at size is zeroed. The tree loses the levels
+ * and interior nodes it no longer needs, and a lone head chunk shrinks to
+ * what size needs. Growing needs no call: bytes past the end always read
+ * as zeros. Returns 0 or -ENOMEM.
+ */
+extern int content_truncate(Content *content, off_t size, int in_use);
+
+/*
+ * Turn [offset, offset + length) into a hole, freeing the chunks it
+ * covers whole as content_truncate does and zeroing the partial ones.
+ */
+extern int content_punch(Content *content, off_t offset, off_t length, int in_use);
+
+/*
+ * Bytes of heap the content holds for itself: interior nodes, private
+ * chunks and a heap head chunk. Shared and compressed chunks, inline and
+ * image-backed data, and chunks waiting for content_release are not
+ * counted. Walks the whole tree.
+ */
+extern size_t content_memory(Content *content);
+
+/*
+ * Allocate the chunks covering [offset, offset + length), so that writes
+ * there do not have to. Returns 0 or -ENOMEM.
+ */
+extern int content_reserve(Content *content, off_t offset, off_t length);
+
+/*
+ * The first offset at or after offset that holds data or, with hole set,
+ * that is in a hole. Granularity is a chunk; allocated chunks count as
+ * data even if zero. Returns -1 if there is no data at or after offset;
+ * past the last chunk it is all hole.
+ */
+extern off_t content_seek(Content *content, off_t offset, int hole);
+
+/*
+ * Move every chunk into the block store (dedup.h), sharing it with any
+ * identical chunk already there, and do what content_release does.
+ * Chunks may be freed, so no pointer content_map_read handed out may
+ * still be in use. Inline content is left alone.
+ */
+extern void content_dedup(Content *content);
+
+/*
+ * Compress every private chunk (cold.h) that shrinks enough; shared
+ * chunks, inline and image-backed content are left alone. Chunks are
+ * freed, so as for content_dedup no pointer content_map_read handed out
+ * may still be in use.
+ */
+extern void content_compress(Content *content);
+
+#endif //XYFS_CONTENT_H
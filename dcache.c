@@ -0,0 +1,154 @@
+/*
+ * Full-path dentry cache.
+ *
+ * Maps an absolute path string to the Node it resolved to, so a repeat
+ * lookup costs one hash probe instead of one probe per path component.
+ * Only positive entries are cached, which means create/mkdir never have
+ * to invalidate anything; unlink/rmdir drop the exact path they remove.
+ *
+ * Entries are inserted and invalidated while the parent directory's lock
+ * is held, so an entry never outlives the directory link that keeps its
+ * node alive. A directory rename changes paths below directories whose
+ * locks it does not hold, and a walk already down there could cache an
+ * old path after any flush; so instead every entry carries the
+ * generation its walk started in, and the rename starts a new one.
+ * Lookups take no lock: they run inside an epoch read section,
+ * which keeps both the dentry and the node from being freed under them,
+ * and only take a reference if the node's count has not already dropped
+ * to zero.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "hashmap.h"
+#include "chashmap.h"
+#include "xyfs.h"
+#include "dcache.h"
+#include "epoch.h"
+
+#define STAT_SHARDS 64
+
+/* The map keeps a pointer to its key, so the path lives in the entry. */
+typedef struct dentry
+{
+    Node *node;
+    unsigned long generation;
+    char path[];
+} Dentry;
+
+/*
+ * Hit and miss counters are split across cache-line sized shards so that
+ * concurrent lookups do not all bounce the same line.
+ */
+typedef struct stat_shard
+{
+    unsigned long hits;
+    unsigned long misses;
+} __attribute__((aligned(64))) StatShard;
+
+static cmap_t cache;
+static StatShard stat_shards[STAT_SHARDS];
+static unsigned long flushes;
+static unsigned long current_generation;
+static unsigned int next_shard;
+static __thread StatShard *my_shard;
+
+void dcache_init() {
+    cache = chashmap_new();
+}
+
+static StatShard *get_shard() {
+    if (my_shard == NULL) {
+        my_shard = &stat_shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % STAT_SHARDS];
+    }
+    return my_shard;
+}
+
+Node *dcache_lookup(const char *path) {
+    Dentry *dentry;
+    Node *node = NULL;
+    StatShard *shard = get_shard();
+
+    epoch_enter();
+    if (chashmap_get(cache, path, (void **) (&dentry)) == MAP_OK &&
+        dentry->generation == __atomic_load_n(&current_generation, __ATOMIC_ACQUIRE)) {
+        node = dentry->node;
+        if (!get_node_unless_zero(node)) {
+            /* Lost a race with the last put; the walk will find out why. */
+            node = NULL;
+        }
+    }
+    epoch_exit();
+
+    if (node != NULL) {
+        __atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+    }
+    return node;
+}
+
+static void free_dentry(void *dentry) {
+    free(dentry);
+}
+
+static int retire_dentry(any_t item, any_t data) {
+    epoch_retire(data, free_dentry);
+    return MAP_OK;
+}
+
+unsigned long dcache_generation() {
+    return __atomic_load_n(&current_generation, __ATOMIC_ACQUIRE);
+}
+
+void dcache_insert(const char *path, Node *node, unsigned long generation) {
+    size_t len = strlen(path);
+    Dentry *dentry = (Dentry *) malloc(sizeof(Dentry) + len + 1);
+    Dentry *old;
+    if (dentry == NULL) {
+        return;
+    }
+    dentry->node = node;
+    dentry->generation = generation;
+    memcpy(dentry->path, path, len + 1);
+
+    if (chashmap_length(cache) >= DCACHE_MAX_ENTRIES) {
+        chashmap_clear(cache, retire_dentry, NULL);
+        __atomic_add_fetch(&flushes, 1, __ATOMIC_RELAXED);
+    }
+    if (chashmap_put(cache, dentry->path, dentry, (void **) (&old)) != MAP_OK) {
+        free(dentry);
+        return;
+    }
+    if (old != NULL) {
+        /* Another walker cached the same path first. */
+        epoch_retire(old, free_dentry);
+    }
+}
+
+void dcache_invalidate(const char *path) {
+    Dentry *dentry;
+    if (chashmap_remove(cache, path, (void **) (&dentry)) == MAP_OK) {
+        epoch_retire(dentry, free_dentry);
+    }
+}
+
+void dcache_flush() {
+    chashmap_clear(cache, retire_dentry, NULL);
+}
+
+void dcache_invalidate_all() {
+    __atomic_add_fetch(&current_generation, 1, __ATOMIC_RELEASE);
+}
+
+void dcache_get_stats(DcacheStats *out) {
+    int i;
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < STAT_SHARDS; i++) {
+        out->hits += __atomic_load_n(&stat_shards[i].hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&stat_shards[i].misses, __ATOMIC_RELAXED);
+    }
+    out->flushes = __atomic_load_n(&flushes, __ATOMIC_RELAXED);
+    out->entries = chashmap_length(cache);
+}
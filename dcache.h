@@ -0,0 +1,67 @@
+//
+// Full-path dentry cache sitting in front of get_node_by_path.
+//
+
+#ifndef XYFS_DCACHE_H
+#define XYFS_DCACHE_H
+
+#define DCACHE_MAX_ENTRIES (1 << 16)
+
+/*
+ * Counters for sizing the cache. entries is the current population,
+ * flushes counts how often the cache hit DCACHE_MAX_ENTRIES and was emptied.
+ */
+typedef struct dcache_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long flushes;
+    int entries;
+} DcacheStats;
+
+/*
+ * Create the path -> Node table. Must run before the first lookup.
+ */
+extern void dcache_init();
+
+/*
+ * Return the cached node for a full path with a reference taken, or NULL
+ * on a miss.
+ */
+extern Node *dcache_lookup(const char *path);
+
+/*
+ * The current generation. Read it before starting a walk and pass it to
+ * dcache_insert; entries from an older generation are never returned.
+ */
+extern unsigned long dcache_generation();
+
+/*
+ * Remember that path resolves to node, as found by a walk started in
+ * generation. The path is copied. The caller holds the lock of node's
+ * parent directory.
+ */
+extern void dcache_insert(const char *path, Node *node, unsigned long generation);
+
+/*
+ * Drop the entry for path, if any. Callers must invalidate under the
+ * parent directory's write lock, before the link to the node is dropped.
+ */
+extern void dcache_invalidate(const char *path);
+
+/*
+ * Drop every entry.
+ */
+extern void dcache_flush();
+
+/*
+ * Make every entry stale in O(1) by starting a new generation, for a
+ * directory rename, which changes the path of everything under it.
+ * Call under the write locks the rename holds, so that a walk started
+ * afterwards can only see the tree as the rename left it.
+ */
+extern void dcache_invalidate_all();
+
+extern void dcache_get_stats(DcacheStats *stats);
+
+#endif //XYFS_DCACHE_H
@@ -0,0 +1,250 @@
+/*
+ * Block deduplication.
+ *
+ * Blocks are kept in a chained hash table keyed by a 64-bit hash of their
+ * bytes. The hash only picks candidates: a match is confirmed with memcmp,
+ * so a collision costs a compare, never wrong data. One mutex guards the
+ * table, the reference counts and the parked references; it is innermost,
+ * taken with node locks held and never the other way round. Hashing and
+ * copying happen outside it.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dedup.h"
+#include "slab.h"
+
+/* A reference given up by dedup_unshare, dropped by dedup_release. */
+typedef struct parked_ref
+{
+    const void *owner;
+    DedupBlock *block;
+    struct parked_ref *next;
+} ParkedRef;
+
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static DedupBlock **buckets;
+static size_t bucket_mask;
+static ParkedRef *parked[DEDUP_DEFER_BUCKETS];
+static unsigned long parked_count;
+static DedupStats stats;
+
+/*
+ * Four independent multiply-xorshift lanes, so the loop is not one long
+ * dependency chain. size is a multiple of 32 for every chunk size the
+ * content store uses; any remainder is folded in bytewise.
+ */
+static uint64_t hash_block(const char *data, size_t size) {
+    uint64_t h0 = 0x9e3779b97f4a7c15ULL, h1 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t h2 = 0x165667b19e3779f9ULL, h3 = 0x27d4eb2f165667c5ULL;
+    const uint64_t k = 0xff51afd7ed558ccdULL;
+    size_t i;
+    for (i = 0; i + 32 <= size; i += 32) {
+        uint64_t w[4];
+        memcpy(w, data + i, 32);
+        h0 = (h0 ^ w[0]) * k;
+        h1 = (h1 ^ w[1]) * k;
+        h2 = (h2 ^ w[2]) * k;
+        h3 = (h3 ^ w[3]) * k;
+        h0 ^= h0 >> 31;
+        h1 ^= h1 >> 31;
+        h2 ^= h2 >> 31;
+        h3 ^= h3 >> 31;
+    }
+    for (; i < size; i++) {
+        h0 = (h0 ^ (unsigned char) data[i]) * k;
+    }
+    uint64_t h = size;
+    h = (h ^ h0) * k;
+    h = (h ^ h1) * k;
+    h = (h ^ h2) * k;
+    h = (h ^ h3) * k;
+    return h ^ (h >> 29);
+}
+
+/*
+ * Double the table. Called with dedup_lock held; on failure the table
+ * just stays as it is.
+ */
+static void grow_buckets() {
+    size_t size = buckets == NULL ? DEDUP_INITIAL_BUCKETS : (bucket_mask + 1) * 2;
+    DedupBlock **grown = (DedupBlock **) calloc(size, sizeof(DedupBlock *));
+    size_t i;
+    if (grown == NULL) {
+        return;
+    }
+    if (buckets != NULL) {
+        for (i = 0; i <= bucket_mask; i++) {
+            DedupBlock *block = buckets[i];
+            while (block != NULL) {
+                DedupBlock *next = block->next;
+                block->next = grown[block->hash & (size - 1)];
+                grown[block->hash & (size - 1)] = block;
+                block = next;
+            }
+        }
+        free(buckets);
+    }
+    buckets = grown;
+    bucket_mask = size - 1;
+}
+
+/* Take block out of the table. Called with dedup_lock held. */
+static void unlink_block(DedupBlock *block) {
+    DedupBlock **link = &buckets[block->hash & bucket_mask];
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+    stats.blocks--;
+    stats.stored_bytes -= block->size;
+}
+
+DedupBlock *dedup_share(char *data, unsigned int size) {
+    uint64_t hash = hash_block(data, size);
+    DedupBlock *block;
+
+    pthread_mutex_lock(&dedup_lock);
+    if (buckets == NULL) {
+        grow_buckets();
+        if (buckets == NULL) {
+            pthread_mutex_unlock(&dedup_lock);
+            return NULL;
+        }
+    }
+    for (block = buckets[hash & bucket_mask]; block != NULL; block = block->next) {
+        if (block->hash == hash && block->size == size && memcmp(block->data, data, size) == 0) {
+            block->refcount++;
+            stats.hits++;
+            stats.logical_bytes += size;
+            pthread_mutex_unlock(&dedup_lock);
+            free(data);
+            return block;
+        }
+    }
+
+    block = (DedupBlock *) slab_alloc(sizeof(DedupBlock));
+    if (block == NULL) {
+        pthread_mutex_unlock(&dedup_lock);
+        return NULL;
+    }
+    block->hash = hash;
+    block->refcount = 1;
+    block->size = size;
+    block->data = data;
+    block->next = buckets[hash & bucket_mask];
+    buckets[hash & bucket_mask] = block;
+    stats.blocks++;
+    stats.stored_bytes += size;
+    stats.logical_bytes += size;
+    if (stats.blocks > bucket_mask + 1) {
+        grow_buckets();
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return block;
+}
+
+static unsigned long owner_bucket(const void *owner) {
+    return ((uintptr_t) owner >> 6) & (DEDUP_DEFER_BUCKETS - 1);
+}
+
+char *dedup_unshare(DedupBlock *block, const void *owner) {
+    pthread_mutex_lock(&dedup_lock);
+    if (block->refcount == 1) {
+        unlink_block(block);
+        stats.logical_bytes -= block->size;
+        pthread_mutex_unlock(&dedup_lock);
+        char *data = block->data;
+        slab_free(block, sizeof(DedupBlock));
+        return data;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+
+    /* Our reference keeps the block alive while it is copied. */
+    char *copy = (char *) malloc(block->size);
+    ParkedRef *ref = (ParkedRef *) slab_alloc(sizeof(ParkedRef));
+    if (copy == NULL || ref == NULL) {
+        free(copy);
+        if (ref != NULL) {
+            slab_free(ref, sizeof(ParkedRef));
+        }
+        return NULL;
+    }
+    memcpy(copy, block->data, block->size);
+
+    pthread_mutex_lock(&dedup_lock);
+    ref->owner = owner;
+    ref->block = block;
+    ref->next = parked[owner_bucket(owner)];
+    parked[owner_bucket(owner)] = ref;
+    __atomic_store_n(&parked_count, parked_count + 1, __ATOMIC_RELAXED);
+    stats.copies++;
+    pthread_mutex_unlock(&dedup_lock);
+    return copy;
+}
+
+/*
+ * Drop a reference with dedup_lock held. Returns the block if that was
+ * the last one; the caller frees it after unlocking.
+ */
+static DedupBlock *drop_ref(DedupBlock *block) {
+    stats.logical_bytes -= block->size;
+    if (--block->refcount > 0) {
+        return NULL;
+    }
+    unlink_block(block);
+    return block;
+}
+
+static void free_block(DedupBlock *block) {
+    free(block->data);
+    slab_free(block, sizeof(DedupBlock));
+}
+
+void dedup_put(DedupBlock *block) {
+    pthread_mutex_lock(&dedup_lock);
+    DedupBlock *dead = drop_ref(block);
+    pthread_mutex_unlock(&dedup_lock);
+    if (dead != NULL) {
+        free_block(dead);
+    }
+}
+
+void dedup_release(const void *owner) {
+    ParkedRef *released = NULL;
+
+    if (__atomic_load_n(&parked_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&dedup_lock);
+    ParkedRef **link = &parked[owner_bucket(owner)];
+    while (*link != NULL) {
+        ParkedRef *ref = *link;
+        if (ref->owner != owner) {
+            link = &ref->next;
+            continue;
+        }
+        *link = ref->next;
+        __atomic_store_n(&parked_count, parked_count - 1, __ATOMIC_RELAXED);
+        /* Reuse the entry to carry dead blocks out of the lock. */
+        ref->block = drop_ref(ref->block);
+        ref->next = released;
+        released = ref;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+
+    while (released != NULL) {
+        ParkedRef *next = released->next;
+        if (released->block != NULL) {
+            free_block(released->block);
+        }
+        slab_free(released, sizeof(ParkedRef));
+        released = next;
+    }
+}
+
+void dedup_get_stats(DedupStats *out) {
+    pthread_mutex_lock(&dedup_lock);
+    *out = stats;
+    pthread_mutex_unlock(&dedup_lock);
+}
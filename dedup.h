@@ -0,0 +1,71 @@
+//
+// Content-addressed store of file data blocks shared between files.
+//
+
+#ifndef XYFS_DEDUP_H
+#define XYFS_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_INITIAL_BUCKETS 1024
+#define DEDUP_DEFER_BUCKETS 256
+
+/*
+ * One stored block. data is the chunk memory of the file that first
+ * stored it; it is never written while in the store.
+ */
+typedef struct dedup_block
+{
+    struct dedup_block *next;   /* hash chain */
+    uint64_t hash;
+    unsigned long refcount;
+    unsigned int size;
+    char *data;
+} DedupBlock;
+
+/*
+ * blocks and stored_bytes count what is in the store; logical_bytes counts
+ * every reference, so logical_bytes / stored_bytes is the dedup ratio.
+ */
+typedef struct dedup_stats
+{
+    unsigned long blocks;
+    unsigned long hits;         /* blocks found already stored */
+    unsigned long copies;       /* writes that had to copy a shared block */
+    size_t stored_bytes;
+    size_t logical_bytes;
+} DedupStats;
+
+/*
+ * Store size bytes of malloc'd memory at data, taking ownership of it.
+ * If an identical block is already stored, data is freed and that block
+ * gets another reference. Returns NULL, leaving data with the caller,
+ * when out of memory.
+ */
+extern DedupBlock *dedup_share(char *data, unsigned int size);
+
+/*
+ * Trade a reference on block for private, writable memory with the same
+ * bytes: the block's own memory if this was the last reference, a copy
+ * otherwise. Returns NULL when out of memory, the reference then kept.
+ *
+ * A copy leaves the old block's memory possibly still being read through
+ * pointers the owner handed out, so the reference is not dropped but
+ * parked under owner until dedup_release(owner).
+ */
+extern char *dedup_unshare(DedupBlock *block, const void *owner);
+
+/*
+ * Drop a reference, freeing the block with the last one.
+ */
+extern void dedup_put(DedupBlock *block);
+
+/*
+ * Drop the references parked under owner.
+ */
+extern void dedup_release(const void *owner);
+
+extern void dedup_get_stats(DedupStats *stats);
+
+#endif //XYFS_DEDUP_H
@@ -0,0 +1,153 @@
+/*
+ * Epoch-based reclamation.
+ *
+ * Each thread owns a record holding the global epoch it observed when it
+ * entered its current read section, or 0 outside one. A writer that has
+ * unpublished some memory bumps the global epoch and waits until no
+ * record still shows an older epoch; after that no reader can hold a
+ * pointer to the memory and it can be freed.
+ *
+ * Records are padded to a cache line so readers on different cores never
+ * write to the same line. A thread's record is released for reuse when
+ * the thread exits.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "epoch.h"
+
+#define CACHE_LINE 64
+
+typedef struct epoch_record
+{
+    unsigned long epoch;
+    int in_use;
+    struct epoch_record *next;
+} __attribute__((aligned(CACHE_LINE))) EpochRecord;
+
+typedef struct retired
+{
+    void *ptr;
+    void (*fn)(void *);
+} Retired;
+
+static unsigned long global_epoch = 1;
+static EpochRecord *records;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static __thread EpochRecord *my_record;
+
+static Retired retire_queue[EPOCH_RETIRE_BATCH];
+static int num_retired;
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_record(void *arg) {
+    EpochRecord *rec = (EpochRecord *) arg;
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_record_key() {
+    pthread_key_create(&record_key, release_record);
+}
+
+static EpochRecord *register_thread() {
+    EpochRecord *rec;
+    pthread_once(&record_key_once, make_record_key);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        int unused = 0;
+        if (__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (rec == NULL) {
+        if (posix_memalign((void **) &rec, CACHE_LINE, sizeof(EpochRecord)) != 0) {
+            abort();
+        }
+        rec->epoch = 0;
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    my_record = rec;
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+void epoch_enter() {
+    EpochRecord *rec = my_record;
+    if (rec == NULL) {
+        rec = register_thread();
+    }
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    /* Publish the epoch before any protected pointer is loaded. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit() {
+    __atomic_store_n(&my_record->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_synchronize() {
+    unsigned long target = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    EpochRecord *rec;
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        if (rec == my_record) {
+            continue;
+        }
+        for (;;) {
+            unsigned long epoch = __atomic_load_n(&rec->epoch, __ATOMIC_ACQUIRE);
+            if (epoch == 0 || epoch >= target) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void run_retired(Retired *batch, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        batch[i].fn(batch[i].ptr);
+    }
+}
+
+void epoch_retire(void *ptr, void (*fn)(void *)) {
+    Retired batch[EPOCH_RETIRE_BATCH];
+    int count = 0;
+
+    pthread_mutex_lock(&retire_lock);
+    retire_queue[num_retired].ptr = ptr;
+    retire_queue[num_retired].fn = fn;
+    num_retired++;
+    if (num_retired == EPOCH_RETIRE_BATCH) {
+        count = num_retired;
+        memcpy(batch, retire_queue, count * sizeof(Retired));
+        num_retired = 0;
+    }
+    pthread_mutex_unlock(&retire_lock);
+
+    if (count > 0) {
+        epoch_synchronize();
+        run_retired(batch, count);
+    }
+}
+
+void epoch_barrier() {
+    Retired batch[EPOCH_RETIRE_BATCH];
+    int count;
+
+    pthread_mutex_lock(&retire_lock);
+    count = num_retired;
+    memcpy(batch, retire_queue, count * sizeof(Retired));
+    num_retired = 0;
+    pthread_mutex_unlock(&retire_lock);
+
+    epoch_synchronize();
+    run_retired(batch, count);
+}
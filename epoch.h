@@ -0,0 +1,37 @@
+//
+// Epoch-based reclamation for lock-free readers.
+//
+
+#ifndef XYFS_EPOCH_H
+#define XYFS_EPOCH_H
+
+#define EPOCH_RETIRE_BATCH 64
+
+/*
+ * Readers bracket every access to epoch-protected memory with
+ * epoch_enter/epoch_exit. Neither performs an atomic read-modify-write;
+ * a thread registers itself once, on its first epoch_enter. Sections do
+ * not nest.
+ */
+extern void epoch_enter();
+extern void epoch_exit();
+
+/*
+ * Hand ptr to fn once no reader can still see it. Frees are batched:
+ * every EPOCH_RETIRE_BATCH calls wait for a grace period and run the
+ * queued callbacks. Must not be called inside a read section.
+ */
+extern void epoch_retire(void *ptr, void (*fn)(void *));
+
+/*
+ * Wait until every reader that was inside a section when this was called
+ * has left it.
+ */
+extern void epoch_synchronize();
+
+/*
+ * Wait for a grace period and run every queued callback.
+ */
+extern void epoch_barrier();
+
+#endif //XYFS_EPOCH_H
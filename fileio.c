@@ -0,0 +1,45 @@
+/*
+ * File helpers for the journal and the snapshot images, which both
+ * write with pwrite and rename files into place durably.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fileio.h"
+
+int write_all(int fd, const void *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf = (const char *) buf + n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int sync_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash == NULL || slash == path ? 1 : (size_t) (slash - path);
+    char *dir = (char *) malloc(len + 1);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(dir, slash == NULL ? "." : path, len);
+    dir[len] = '\0';
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0) {
+        return -errno;
+    }
+    int rc = fsync(fd) != 0 ? -errno : 0;
+    close(fd);
+    return rc;
+}
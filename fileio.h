@@ -0,0 +1,23 @@
+//
+// File helpers shared by the journal and the snapshot images.
+//
+
+#ifndef XYFS_FILEIO_H
+#define XYFS_FILEIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * pwrite all of buf at offset, retrying short writes and EINTR. Returns
+ * 0 or -errno.
+ */
+extern int write_all(int fd, const void *buf, size_t size, off_t offset);
+
+/*
+ * fsync the directory path is in, so that a rename into it survives a
+ * crash. Returns 0 or -errno.
+ */
+extern int sync_parent(const char *path);
+
+#endif //XYFS_FILEIO_H
@@ -1,48 +1,120 @@
 /*
  * Generic map implementation.
+ *
+ * Swiss-table layout: besides the key/value slots the map keeps one
+ * control byte per slot. A control byte is EMPTY, DELETED, or, for a
+ * full slot, the low 7 bits of the key's hash. Lookups load 16 control
+ * bytes at a time and compare them against the wanted fingerprint in one
+ * SSE2 instruction, so strcmp only runs on slots whose fingerprint
+ * matches. Probing moves group by group and stops at the first group that
+ * contains an EMPTY byte.
+ *
+ * Removed slots become DELETED tombstones unless no probe sequence can
+ * have passed over them, so removing a key never hides another one. The
+ * table is rebuilt once full slots plus tombstones reach 7/8 of capacity,
+ * at the same size if most of that is tombstones, doubled otherwise.
+ *
+ * Rebuilding is incremental: the new table is allocated and the old one
+ * kept beside it, and every put and remove moves the next
+ * HASHMAP_MIGRATE_STEP slots across, so no single insert pays for
+ * re-inserting the whole map. Lookups check the new table, then the old.
+ * Gets never migrate, which keeps them safe to run concurrently under a
+ * reader lock, so a map that stops changing mid-rebuild would probe both
+ * tables for good. Instead gets count themselves while a rebuild waits
+ * on writes, and once HASHMAP_STALL_GETS have gone by the map reports
+ * itself stalled, for the owner to finish the move with hashmap_settle
+ * under its write lock. Building with -DHASHMAP_MIGRATE_STEP=0 moves
+ * everything at once instead.
  */
 #include "hashmap.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-
-#define INITIAL_SIZE (256)
-#define MAX_CHAIN_LENGTH (8)
-
-/* We need to keep keys and values */
+#include <stdint.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define INITIAL_SIZE (32)
+#define GROUP_WIDTH (16)
+
+#ifndef HASHMAP_MIGRATE_STEP
+#define HASHMAP_MIGRATE_STEP (8)
+#endif
+/* A fresh table has room for at least 7/16 of the old table's slots in
+ * new entries, so a rebuild must move three or more slots per operation
+ * to finish before the new table fills. */
+#if HASHMAP_MIGRATE_STEP > 0 && HASHMAP_MIGRATE_STEP < 3
+#error "HASHMAP_MIGRATE_STEP must be 0 or at least 3"
+#endif
+/* A miss costs about one extra group probe in the old table, so this
+ * many of them cost about what finishing a small rebuild does. */
+#ifndef HASHMAP_STALL_GETS
+#define HASHMAP_STALL_GETS (1024)
+#endif
+
+/* Control byte values. Full slots hold a fingerprint in 0..127. */
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+/* We need to keep keys and values. The full hash is kept too, so growing
+ * the table never hashes a string again and a fingerprint collision is
+ * mostly rejected without a strcmp. */
 typedef struct _hashmap_element{
 	char* key;
-	int in_use;
 	any_t data;
+	unsigned long hash;
 } hashmap_element;
 
-/* A hashmap has some maximum size and current size,
- * as well as the data to hold. */
-typedef struct _hashmap_map{
+/* One table of slots. table_size is a power of two; ctrl has
+ * GROUP_WIDTH extra bytes mirroring the first group so that a group load
+ * near the end of the table wraps around. */
+typedef struct _hashmap_table{
 	int table_size;
-	int size;
+	int growth_left;	/* EMPTY slots that may still be filled */
+	int8_t *ctrl;
 	hashmap_element *data;
+} hashmap_table;
+
+/* A hashmap has a current table and, while it is being rebuilt, the old
+ * table whose slots below migrate_pos have already been moved. */
+typedef struct _hashmap_map{
+	hashmap_table cur;
+	hashmap_table old;	/* old.ctrl is NULL when no rebuild runs */
+	int migrate_pos;
+	int idle_gets;		/* during a rebuild, gets since the last write */
+	int size;
 } hashmap_map;
 
+static int table_init(hashmap_table *t, int table_size);
+
+__thread hashmap_counters *hashmap_thread_counters;
+hashmap_counters hashmap_shared_counters;
+
+/* Add n to a counter field, see hashmap.h. */
+#define COUNT(field, n) do { \
+	hashmap_counters *c_ = hashmap_thread_counters; \
+	if (c_ != NULL) \
+		__atomic_store_n(&c_->field, c_->field + (n), __ATOMIC_RELAXED); \
+	else \
+		__atomic_add_fetch(&hashmap_shared_counters.field, (n), __ATOMIC_RELAXED); \
+} while (0)
+
 /*
  * Return an empty hashmap, or NULL on failure.
  */
 map_t hashmap_new() {
-	hashmap_map* m = (hashmap_map*) malloc(sizeof(hashmap_map));
-	if(!m) goto err;
-
-	m->data = (hashmap_element*) calloc(INITIAL_SIZE, sizeof(hashmap_element));
-	if(!m->data) goto err;
+	hashmap_map* m = (hashmap_map*) calloc(1, sizeof(hashmap_map));
+	if(!m) return NULL;
 
-	m->table_size = INITIAL_SIZE;
-	m->size = 0;
+	if (table_init(&m->cur, INITIAL_SIZE) != MAP_OK) {
+		free(m);
+		return NULL;
+	}
 
 	return m;
-	err:
-		if (m)
-			hashmap_free(m);
-		return NULL;
 }
 
 /* The implementation here was originally done by Gary S. Brown.  I have
@@ -146,7 +218,7 @@ static unsigned long crc32_tab[] = {
 
 /* Return a 32-bit CRC of the contents of the buffer. */
 
-unsigned long crc32(const unsigned char *s, unsigned int len)
+static unsigned long crc32(const unsigned char *s, unsigned int len)
 {
   unsigned int i;
   unsigned long crc32val;
@@ -161,12 +233,15 @@ unsigned long crc32(const unsigned char *s, unsigned int len)
   return crc32val;
 }
 
+
 /*
- * Hashing function for a string
+ * The original string hash: table CRC32 after a strlen, then Jenkins and
+ * Knuth mixing. Kept as the reference for hash_bench and selectable with
+ * -DHASHMAP_LEGACY_HASH.
  */
-unsigned int hashmap_hash_int(hashmap_map * m, char* keystring){
+unsigned long hashmap_hash_legacy(const char* keystring){
 
-    unsigned long key = crc32((unsigned char*)(keystring), strlen(keystring));
+    unsigned long key = crc32((const unsigned char*)(keystring), strlen(keystring));
 
 	/* Robert Jenkins' 32 bit Mix Function */
 	key += (key << 12);
@@ -181,104 +256,367 @@ unsigned int hashmap_hash_int(hashmap_map * m, char* keystring){
 	/* Knuth's Multiplicative Method */
 	key = (key >> 3) * 2654435761;
 
-	return key % m->table_size;
+	return key;
+}
+
+/* MurmurHash3 finalizer: every input bit affects every output bit, which
+ * the fingerprint (low 7 bits) and the probe start (the rest) both need. */
+static inline uint64_t hash_finish(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
 }
 
+/* Load the 0..7 trailing bytes of a key into one word, with overlapping
+ * fixed-size loads rather than a variable-length copy. */
+static inline uint64_t load_tail(const char* p, size_t n) {
+	const unsigned char *u = (const unsigned char *) p;
+	uint32_t lo, hi;
+	if (n >= 4) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + n - 4, 4);
+		return lo | ((uint64_t) hi << 32);
+	}
+	if (n > 0)
+		return u[0] | (u[n >> 1] << 8) | (u[n - 1] << 16);
+	return 0;
+}
+
+/*
+ * Portable hash consuming the key eight bytes per step.
+ */
+unsigned long hashmap_hash_word(const char* key){
+	size_t len = strlen(key);
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	uint64_t w;
+
+	for (; len >= 8; len -= 8, key += 8) {
+		memcpy(&w, key, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	h = (h ^ load_tail(key, len)) * 0x100000001b3ULL;
+	return hash_finish(h);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C 1
+
 /*
- * Return the integer of the location in data
- * to store the point to the item, or MAP_FULL.
+ * Hardware CRC32C (SSE4.2), eight bytes per instruction. Only called when
+ * the CPU supports it.
  */
-int hashmap_hash(map_t in, char* key){
-	int curr;
+__attribute__((target("sse4.2")))
+unsigned long hashmap_hash_crc32c(const char* key){
+	size_t len = strlen(key);
+	uint64_t crc = ~0ULL;
+	uint64_t w;
+
+	for (; len >= 8; len -= 8, key += 8) {
+		memcpy(&w, key, 8);
+		crc = _mm_crc32_u64(crc, w);
+	}
+	crc = _mm_crc32_u64(crc, load_tail(key, len) ^ ((uint64_t) len << 59));
+	return hash_finish(crc);
+}
+#endif
+
+static unsigned long hashmap_hash_select(const char* key);
+
+/* Chosen on first use by CPU detection. */
+static unsigned long (*hash_fn)(const char*) = hashmap_hash_select;
+
+static unsigned long hashmap_hash_select(const char* key){
+	unsigned long (*fn)(const char*) = hashmap_hash_word;
+#if defined(HASHMAP_LEGACY_HASH)
+	fn = hashmap_hash_legacy;
+#elif defined(HAVE_CRC32C)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		fn = hashmap_hash_crc32c;
+#endif
+	__atomic_store_n(&hash_fn, fn, __ATOMIC_RELAXED);
+	return fn(key);
+}
+
+/*
+ * Hashing function for a string. The low 7 bits become the control byte
+ * fingerprint, the rest pick the first slot to probe.
+ */
+unsigned long hashmap_hash_string(const char* key){
+	return __atomic_load_n(&hash_fn, __ATOMIC_RELAXED)(key);
+}
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t) ((hash) & 0x7f))
+
+/*
+ * Bitmasks over one group of GROUP_WIDTH control bytes starting at ctrl:
+ * bit i is set when ctrl[i] matches.
+ */
+#ifdef __SSE2__
+static inline unsigned int group_match(const int8_t *ctrl, int8_t h2) {
+	__m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), group));
+}
+
+static inline unsigned int group_match_empty(const int8_t *ctrl) {
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+/* EMPTY and DELETED are the only negative control bytes. */
+static inline unsigned int group_match_empty_or_deleted(const int8_t *ctrl) {
+	__m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+	return _mm_movemask_epi8(group);
+}
+#else
+static inline unsigned int group_match(const int8_t *ctrl, int8_t h2) {
+	unsigned int mask = 0;
 	int i;
+	for (i = 0; i < GROUP_WIDTH; i++)
+		if (ctrl[i] == h2) mask |= 1u << i;
+	return mask;
+}
 
-	/* Cast the hashmap */
-	hashmap_map* m = (hashmap_map *) in;
+static inline unsigned int group_match_empty(const int8_t *ctrl) {
+	return group_match(ctrl, CTRL_EMPTY);
+}
 
-	/* If full, return immediately */
-	if(m->size >= (m->table_size/2)) return MAP_FULL;
+static inline unsigned int group_match_empty_or_deleted(const int8_t *ctrl) {
+	unsigned int mask = 0;
+	int i;
+	for (i = 0; i < GROUP_WIDTH; i++)
+		if (ctrl[i] < 0) mask |= 1u << i;
+	return mask;
+}
+#endif
 
-	/* Find the best index */
-	curr = hashmap_hash_int(m, key);
+/* Set a control byte, keeping the mirrored tail in sync. */
+static inline void set_ctrl(hashmap_table *t, int i, int8_t h) {
+	t->ctrl[i] = h;
+	if (i < GROUP_WIDTH)
+		t->ctrl[t->table_size + i] = h;
+}
 
-	/* Linear probing */
-	for(i = 0; i< MAX_CHAIN_LENGTH; i++){
-		if(m->data[curr].in_use == 0)
-			return curr;
+static int table_init(hashmap_table *t, int table_size) {
+	t->ctrl = (int8_t *) malloc(table_size + GROUP_WIDTH);
+	t->data = (hashmap_element *) malloc(table_size * sizeof(hashmap_element));
+	if (!t->ctrl || !t->data) {
+		free(t->ctrl);
+		free(t->data);
+		t->ctrl = NULL;
+		t->data = NULL;
+		return MAP_OMEM;
+	}
+	memset(t->ctrl, CTRL_EMPTY, table_size + GROUP_WIDTH);
+	t->table_size = table_size;
+	COUNT(slots, table_size);
+	t->growth_left = table_size - table_size / 8;
+	return MAP_OK;
+}
+
+static void table_free(hashmap_table *t) {
+	if (t->ctrl != NULL)
+		COUNT(slots, -t->table_size);
+	free(t->ctrl);
+	free(t->data);
+	t->ctrl = NULL;
+	t->data = NULL;
+}
 
-		if(m->data[curr].in_use == 1 && (strcmp(m->data[curr].key,key)==0))
-			return curr;
+/*
+ * Return the slot of t holding key, or MAP_MISSING.
+ */
+static int table_find(hashmap_table *t, const char* key, unsigned long hash) {
+	int mask = t->table_size - 1;
+	int pos = H1(hash) & mask;
+	int step = 0;
+	int8_t h2 = H2(hash);
+
+	/* Triangular probing over groups visits every group once. */
+	for (;;) {
+		const int8_t *group = t->ctrl + pos;
+		unsigned int match = group_match(group, h2);
+		while (match) {
+			int i = (pos + __builtin_ctz(match)) & mask;
+			if (t->data[i].hash == hash && strcmp(t->data[i].key, key) == 0) {
+				COUNT(probes, step / GROUP_WIDTH + 1);
+				return i;
+			}
+			match &= match - 1;
+		}
+		if (group_match_empty(group)) {
+			COUNT(probes, step / GROUP_WIDTH + 1);
+			return MAP_MISSING;
+		}
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+	}
+}
 
-		curr = (curr + 1) % m->table_size;
+/*
+ * Return the first EMPTY or DELETED slot of t on hash's probe sequence.
+ */
+static int table_find_free(hashmap_table *t, unsigned long hash) {
+	int mask = t->table_size - 1;
+	int pos = H1(hash) & mask;
+	int step = 0;
+
+	for (;;) {
+		unsigned int match = group_match_empty_or_deleted(t->ctrl + pos);
+		if (match)
+			return (pos + __builtin_ctz(match)) & mask;
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
 	}
+}
 
-	return MAP_FULL;
+/* Store an element in a free slot of t; the caller checked growth_left. */
+static void table_insert(hashmap_table *t, int index, hashmap_element *e) {
+	if (t->ctrl[index] == CTRL_EMPTY)
+		t->growth_left--;
+	set_ctrl(t, index, H2(e->hash));
+	t->data[index] = *e;
 }
 
 /*
- * Doubles the size of the hashmap, and rehashes all the elements
+ * Empty a slot. A slot can go back to EMPTY only if the group windows
+ * before and after it already had an EMPTY close enough that no probe
+ * sequence ever found this group full; otherwise it must stay a tombstone
+ * so lookups keep probing past it.
  */
-int hashmap_rehash(map_t in){
-	int i;
-	int old_size;
-	hashmap_element* curr;
-
-	/* Setup the new elements */
-	hashmap_map *m = (hashmap_map *) in;
-	hashmap_element* temp = (hashmap_element *)
-		calloc(2 * m->table_size, sizeof(hashmap_element));
-	if(!temp) return MAP_OMEM;
-
-	/* Update the array */
-	curr = m->data;
-	m->data = temp;
-
-	/* Update the size */
-	old_size = m->table_size;
-	m->table_size = 2 * m->table_size;
-	m->size = 0;
-
-	/* Rehash the elements */
-	for(i = 0; i < old_size; i++){
-        int status;
-
-        if (curr[i].in_use == 0)
-            continue;
-
-		status = hashmap_put(m, curr[i].key, curr[i].data);
-		if (status != MAP_OK)
-			return status;
+static void table_erase(hashmap_table *t, int index) {
+	int mask = t->table_size - 1;
+	unsigned int empty_before = group_match_empty(t->ctrl + ((index - GROUP_WIDTH) & mask));
+	unsigned int empty_after = group_match_empty(t->ctrl + index);
+	int was_never_full = empty_before && empty_after &&
+		__builtin_ctz(empty_after) + __builtin_clz(empty_before << (32 - GROUP_WIDTH)) < GROUP_WIDTH;
+
+	if (was_never_full) {
+		set_ctrl(t, index, CTRL_EMPTY);
+		t->growth_left++;
+	} else {
+		set_ctrl(t, index, CTRL_DELETED);
 	}
+	t->data[index].key = NULL;
+	t->data[index].data = NULL;
+}
 
-	free(curr);
+/*
+ * Move up to count slots of the old table into the current one, and drop
+ * the old table once it is empty. Moved slots become tombstones in the
+ * old table so its probe chains stay intact.
+ */
+static void hashmap_migrate(hashmap_map *m, int count) {
+	hashmap_table *old = &m->old;
+	int end;
+
+	if (old->ctrl == NULL)
+		return;
+
+	m->idle_gets = 0;
+	end = m->migrate_pos + count;
+	if (end > old->table_size || count < 0)
+		end = old->table_size;
+
+	for (; m->migrate_pos < end; m->migrate_pos++) {
+		int i = m->migrate_pos;
+		if (old->ctrl[i] >= 0) {
+			table_insert(&m->cur, table_find_free(&m->cur, old->data[i].hash), &old->data[i]);
+			set_ctrl(old, i, CTRL_DELETED);
+		}
+	}
+
+	if (m->migrate_pos == old->table_size)
+		table_free(old);
+}
 
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Start rebuilding into a fresh table: the same size when tombstones are
+ * what used up the space, double otherwise. A rebuild still in progress
+ * is finished first. On failure the map is left untouched.
+ */
+static int hashmap_rehash(hashmap_map *m){
+	hashmap_table t;
+	int new_size = m->cur.table_size;
+	uint64_t start = now_ns();
+
+	hashmap_migrate(m, -1);
+
+	if (m->size >= (new_size - new_size / 8) / 2)
+		new_size *= 2;
+	if (table_init(&t, new_size) != MAP_OK)
+		return MAP_OMEM;
+
+	m->old = m->cur;
+	m->cur = t;
+	m->migrate_pos = 0;
+#if HASHMAP_MIGRATE_STEP == 0
+	hashmap_migrate(m, -1);
+#endif
+	COUNT(rehashes, 1);
+	COUNT(rehash_ns, now_ns() - start);
 	return MAP_OK;
 }
 
 /*
- * Add a pointer to the hashmap with some key
+ * Find key in either table. Returns the slot, or MAP_MISSING, and sets
+ * *t to the table it is in.
+ */
+static int hashmap_find(hashmap_map *m, const char* key, unsigned long hash, hashmap_table **t) {
+	int index = table_find(&m->cur, key, hash);
+	*t = &m->cur;
+	if (index == MAP_MISSING && m->old.ctrl != NULL) {
+		index = table_find(&m->old, key, hash);
+		*t = &m->old;
+	}
+	return index;
+}
+
+/*
+ * Add a pointer to the hashmap with some key, replacing the value if the
+ * key is already present.
  */
 int hashmap_put(map_t in, char* key, any_t value){
+	hashmap_map* m = (hashmap_map *) in;
+	unsigned long hash = hashmap_hash_string(key);
+	hashmap_element e;
+	hashmap_table *t;
 	int index;
-	hashmap_map* m;
 
-	/* Cast the hashmap */
-	m = (hashmap_map *) in;
+	hashmap_migrate(m, HASHMAP_MIGRATE_STEP);
+	COUNT(lookups, 1);
 
-	/* Find a place to put our value */
-	index = hashmap_hash(in, key);
-	while(index == MAP_FULL){
-		if (hashmap_rehash(in) == MAP_OMEM) {
+	index = hashmap_find(m, key, hash, &t);
+	if (index != MAP_MISSING) {
+		t->data[index].key = key;
+		t->data[index].data = value;
+		return MAP_OK;
+	}
+
+	index = table_find_free(&m->cur, hash);
+	if (m->cur.ctrl[index] == CTRL_EMPTY && m->cur.growth_left == 0) {
+		if (hashmap_rehash(m) != MAP_OK)
 			return MAP_OMEM;
-		}
-		index = hashmap_hash(in, key);
+		index = table_find_free(&m->cur, hash);
 	}
 
-	/* Set the data */
-	m->data[index].data = value;
-	m->data[index].key = key;
-	m->data[index].in_use = 1;
+	e.key = key;
+	e.data = value;
+	e.hash = hash;
+	table_insert(&m->cur, index, &e);
 	m->size++;
+	COUNT(entries, 1);
 
 	return MAP_OK;
 }
@@ -287,34 +625,31 @@ int hashmap_put(map_t in, char* key, any_t value){
  * Get your pointer out of the hashmap with a key
  */
 int hashmap_get(map_t in, char* key, any_t *arg){
-	int curr;
-	int i;
-	hashmap_map* m;
-
-	/* Cast the hashmap */
-	m = (hashmap_map *) in;
-
-	/* Find data location */
-	curr = hashmap_hash_int(m, key);
-
-	/* Linear probing, if necessary */
-	for(i = 0; i<MAX_CHAIN_LENGTH; i++){
+	hashmap_map* m = (hashmap_map *) in;
+	hashmap_table *t;
+	int index;
 
-        int in_use = m->data[curr].in_use;
-        if (in_use == 1){
-            if (strcmp(m->data[curr].key,key)==0){
-                *arg = (m->data[curr].data);
-                return MAP_OK;
-            }
-		}
+	COUNT(lookups, 1);
+	if (m->old.ctrl != NULL)
+		__atomic_add_fetch(&m->idle_gets, 1, __ATOMIC_RELAXED);
+	index = hashmap_find(m, key, hashmap_hash_string(key), &t);
 
-		curr = (curr + 1) % m->table_size;
+	if (index == MAP_MISSING) {
+		*arg = NULL;
+		return MAP_MISSING;
 	}
+	*arg = t->data[index].data;
+	return MAP_OK;
+}
 
-	*arg = NULL;
+int hashmap_stalled(map_t in) {
+	hashmap_map* m = (hashmap_map *) in;
+	return m->old.ctrl != NULL &&
+	       __atomic_load_n(&m->idle_gets, __ATOMIC_RELAXED) >= HASHMAP_STALL_GETS;
+}
 
-	/* Not found */
-	return MAP_MISSING;
+void hashmap_settle(map_t in) {
+	hashmap_migrate((hashmap_map *) in, -1);
 }
 
 /*
@@ -323,7 +658,8 @@ int hashmap_get(map_t in, char* key, any_t *arg){
  * argument and the hashmap element is the second.
  */
 int hashmap_iterate(map_t in, PFany f, any_t item) {
-	int i;
+	hashmap_table *tables[2];
+	int i, j;
 
 	/* Cast the hashmap */
 	hashmap_map* m = (hashmap_map*) in;
@@ -332,15 +668,21 @@ int hashmap_iterate(map_t in, PFany f, any_t item) {
 	if (hashmap_length(m) <= 0)
 		return MAP_MISSING;
 
-	/* Linear probing */
-	for(i = 0; i< m->table_size; i++)
-		if(m->data[i].in_use != 0) {
-			any_t data = (any_t) (m->data[i].data);
-			int status = f(item, data);
-			if (status != MAP_OK) {
-				return status;
+	/* A pass over both tables costs what finishing the move would. */
+	if (m->old.ctrl != NULL)
+		__atomic_store_n(&m->idle_gets, HASHMAP_STALL_GETS, __ATOMIC_RELAXED);
+
+	tables[0] = &m->cur;
+	tables[1] = &m->old;
+	for (j = 0; j < 2 && tables[j]->ctrl != NULL; j++)
+		for(i = 0; i< tables[j]->table_size; i++)
+			if(tables[j]->ctrl[i] >= 0) {
+				any_t data = (any_t) (tables[j]->data[i].data);
+				int status = f(item, data);
+				if (status != MAP_OK) {
+					return status;
+				}
 			}
-		}
 
     return MAP_OK;
 }
@@ -349,43 +691,55 @@ int hashmap_iterate(map_t in, PFany f, any_t item) {
  * Remove an element with that key from the map
  */
 int hashmap_remove(map_t in, char* key){
-	int i;
-	int curr;
-	hashmap_map* m;
+	hashmap_map* m = (hashmap_map *) in;
+	hashmap_table *t;
+	int index;
 
-	/* Cast the hashmap */
-	m = (hashmap_map *) in;
+	hashmap_migrate(m, HASHMAP_MIGRATE_STEP);
+	COUNT(lookups, 1);
 
-	/* Find key */
-	curr = hashmap_hash_int(m, key);
+	index = hashmap_find(m, key, hashmap_hash_string(key), &t);
+	if (index == MAP_MISSING)
+		return MAP_MISSING;
+	table_erase(t, index);
+	m->size--;
+	COUNT(entries, -1);
+	return MAP_OK;
+}
 
-	/* Linear probing, if necessary */
-	for(i = 0; i<MAX_CHAIN_LENGTH; i++){
+/*
+ * Get any element. Return MAP_OK or MAP_MISSING.
+ */
+int hashmap_get_one(map_t in, any_t *arg, int remove){
+	hashmap_map* m = (hashmap_map *) in;
+	int i;
 
-        int in_use = m->data[curr].in_use;
-        if (in_use == 1){
-            if (strcmp(m->data[curr].key,key)==0){
-                /* Blank out the fields */
-                m->data[curr].in_use = 0;
-                m->data[curr].data = NULL;
-                m->data[curr].key = NULL;
+	if (hashmap_length(m) <= 0)
+		return MAP_MISSING;
 
-                /* Reduce the size */
-                m->size--;
-                return MAP_OK;
-            }
+	/* Settle any rebuild so there is one table to look at. */
+	hashmap_migrate(m, -1);
+
+	for (i = 0; i < m->cur.table_size; i++)
+		if (m->cur.ctrl[i] >= 0) {
+			*arg = m->cur.data[i].data;
+			if (remove) {
+				table_erase(&m->cur, i);
+				m->size--;
+				COUNT(entries, -1);
+			}
+			return MAP_OK;
 		}
-		curr = (curr + 1) % m->table_size;
-	}
 
-	/* Data not found */
 	return MAP_MISSING;
 }
 
 /* Deallocate the hashmap */
 void hashmap_free(map_t in){
 	hashmap_map* m = (hashmap_map*) in;
-	free(m->data);
+	COUNT(entries, -m->size);
+	table_free(&m->cur);
+	table_free(&m->old);
 	free(m);
 }
 
@@ -406,14 +760,76 @@ int hashmap_keys(map_t in, char* keys[])
     }
 
     hashmap_map* m = (hashmap_map*) in;
+    hashmap_table *tables[2] = {&m->cur, &m->old};
     int i, j;
-    for (i = j = 0; i< m->table_size; i++)
+    if (m->old.ctrl != NULL)
+        __atomic_store_n(&m->idle_gets, HASHMAP_STALL_GETS, __ATOMIC_RELAXED);
+    for (j = 0; j < 2 && tables[j]->ctrl != NULL; j++)
     {
-        if (m->data[i].in_use != 0) {
-            keys[j++] = m->data[i].key;
-            num_keys++;
+        for (i = 0; i < tables[j]->table_size; i++)
+        {
+            if (tables[j]->ctrl[i] >= 0) {
+                keys[num_keys++] = tables[j]->data[i].key;
+            }
         }
     }
 
     return num_keys;
 }
+
+/* Groups a lookup of hash visits in t up to the one holding index. */
+static int table_probe_length(hashmap_table *t, unsigned long hash, int index) {
+	int mask = t->table_size - 1;
+	int pos = H1(hash) & mask;
+	int step = 0;
+	int groups = 1;
+
+	while (((index - pos) & mask) >= GROUP_WIDTH) {
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+		groups++;
+	}
+	return groups;
+}
+
+/* Groups a lookup of hash visits in t before giving up. */
+static int table_miss_length(hashmap_table *t, unsigned long hash) {
+	int mask = t->table_size - 1;
+	int pos = H1(hash) & mask;
+	int step = 0;
+	int groups = 1;
+
+	while (!group_match_empty(t->ctrl + pos)) {
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+		groups++;
+	}
+	return groups;
+}
+
+void hashmap_get_stats(map_t in, hashmap_stats *stats) {
+	hashmap_map* m = (hashmap_map *) in;
+	hashmap_table *tables[2] = {&m->cur, &m->old};
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->size = m->size;
+	stats->bytes = sizeof(hashmap_map);
+	for (j = 0; j < 2 && tables[j]->ctrl != NULL; j++) {
+		hashmap_table *t = tables[j];
+		stats->slots += t->table_size;
+		stats->bytes += t->table_size + GROUP_WIDTH + t->table_size * sizeof(hashmap_element);
+		for (i = 0; i < t->table_size; i++) {
+			if (t->ctrl[i] == CTRL_DELETED) {
+				stats->tombstones++;
+			} else if (t->ctrl[i] >= 0) {
+				int groups = table_probe_length(t, t->data[i].hash, i);
+				if (j == 1)
+					groups += table_miss_length(&m->cur, t->data[i].hash);
+				if (groups > HASHMAP_PROBE_BUCKETS)
+					groups = HASHMAP_PROBE_BUCKETS;
+				stats->probes[groups - 1]++;
+			}
+		}
+	}
+}
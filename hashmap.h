@@ -62,6 +62,16 @@ extern int hashmap_get(map_t in, char* key, any_t *arg);
  */
 extern int hashmap_remove(map_t in, char* key);
 
+/*
+ * Rebuilds move slots on puts and removes only. hashmap_stalled says
+ * whether one has gone HASHMAP_STALL_GETS gets, or a hashmap_iterate or
+ * hashmap_keys pass, without a write, so that lookups pay for probing two
+ * tables; it may be called alongside gets.
+ * hashmap_settle finishes any rebuild, and needs the map to itself.
+ */
+extern int hashmap_stalled(map_t in);
+extern void hashmap_settle(map_t in);
+
 /*
  * Get any element. Return MAP_OK or MAP_MISSING.
  * remove - should the element be removed from the hashmap
@@ -83,4 +93,55 @@ extern int hashmap_length(map_t in);
  */
 extern int hashmap_keys(map_t in, char* keys[]);
 
+/*
+ * Layout of a map, for benchmarks. probes[i] counts the keys a lookup
+ * finds in group i + 1 of its probe sequence, the last bucket taking the
+ * rest; a key still in the table being rebuilt from also counts the
+ * groups its lookup first misses through in the new one. bytes is the
+ * memory of the tables and the map itself, not of the keys.
+ */
+#define HASHMAP_PROBE_BUCKETS 8
+
+typedef struct _hashmap_stats {
+	int size;
+	int slots;		/* in the current table, plus the old one during a rebuild */
+	int tombstones;
+	unsigned long bytes;
+	unsigned long probes[HASHMAP_PROBE_BUCKETS];
+} hashmap_stats;
+
+extern void hashmap_get_stats(map_t in, hashmap_stats *stats);
+
+/*
+ * Running totals over all maps. A thread that points
+ * hashmap_thread_counters at a block of its own has its operations
+ * counted there, written only by it; other threads add to
+ * hashmap_shared_counters atomically. Readers sum the blocks with
+ * relaxed atomic loads. entries and slots are net changes, so their sums
+ * over all blocks give the keys stored and slots allocated right now.
+ */
+typedef struct _hashmap_counters {
+	unsigned long lookups;		/* gets, puts and removes */
+	unsigned long probes;		/* groups they visited */
+	unsigned long rehashes;
+	unsigned long rehash_ns;	/* starting rebuilds; incremental moves are not timed */
+	long entries;
+	long slots;
+} hashmap_counters;
+
+extern __thread hashmap_counters *hashmap_thread_counters;
+extern hashmap_counters hashmap_shared_counters;
+
+/*
+ * Hash a key the way the map does. The backend is picked on first use:
+ * hardware CRC32C where the CPU has SSE4.2, a portable word-at-a-time
+ * hash otherwise, or the original table CRC32 when built with
+ * -DHASHMAP_LEGACY_HASH. The backends are exported for benchmarking;
+ * hashmap_hash_crc32c exists on x86-64 only.
+ */
+extern unsigned long hashmap_hash_string(const char* key);
+extern unsigned long hashmap_hash_legacy(const char* key);
+extern unsigned long hashmap_hash_word(const char* key);
+extern unsigned long hashmap_hash_crc32c(const char* key);
+
 #endif //__HASHMAP_H__
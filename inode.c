@@ -0,0 +1,112 @@
+/*
+ * Inode table.
+ *
+ * A two-level array indexed by inode number, so resolving a number the
+ * kernel hands back is two loads. Pages are never moved or freed once
+ * published, which lets inode_get run without taking any lock; only
+ * allocation and freeing serialize on table_lock. Freed numbers go on a
+ * stack and are reused; each slot keeps a generation that is bumped on
+ * reuse so the kernel can tell a recycled number from the node it used
+ * to name.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "hashmap.h"
+#include "xyfs.h"
+#include "inode.h"
+
+#define INODE_PAGE_SHIFT 12
+#define INODE_PAGE_SIZE (1UL << INODE_PAGE_SHIFT)
+#define MAX_INODE_PAGES (1UL << 16)
+
+typedef struct inode_slot
+{
+    Node *node;
+    unsigned long generation;
+} InodeSlot;
+
+static InodeSlot *pages[MAX_INODE_PAGES];
+static unsigned long next_ino;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long *free_inos;
+static unsigned long num_free;
+static unsigned long free_capacity;
+
+static InodeSlot *slot_of(unsigned long ino) {
+    return &pages[ino >> INODE_PAGE_SHIFT][ino & (INODE_PAGE_SIZE - 1)];
+}
+
+void inode_table_init() {
+    next_ino = ROOT_INODE;
+    free_inos = NULL;
+    num_free = 0;
+    free_capacity = 0;
+}
+
+unsigned long inode_alloc(Node *node) {
+    unsigned long ino;
+    pthread_mutex_lock(&table_lock);
+    if (num_free > 0) {
+        ino = free_inos[--num_free];
+        slot_of(ino)->generation++;
+    } else {
+        ino = next_ino;
+        unsigned long page = ino >> INODE_PAGE_SHIFT;
+        if (page >= MAX_INODE_PAGES) {
+            pthread_mutex_unlock(&table_lock);
+            return 0;
+        }
+        if (pages[page] == NULL) {
+            InodeSlot *new_page = (InodeSlot *) calloc(INODE_PAGE_SIZE, sizeof(InodeSlot));
+            if (new_page == NULL) {
+                pthread_mutex_unlock(&table_lock);
+                return 0;
+            }
+            __atomic_store_n(&pages[page], new_page, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&next_ino, ino + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&slot_of(ino)->node, node, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table_lock);
+    return ino;
+}
+
+Node *inode_get(unsigned long ino) {
+    if (ino == 0 || ino >= __atomic_load_n(&next_ino, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    InodeSlot *page = __atomic_load_n(&pages[ino >> INODE_PAGE_SHIFT], __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&page[ino & (INODE_PAGE_SIZE - 1)].node, __ATOMIC_ACQUIRE);
+}
+
+unsigned long inode_generation(unsigned long ino) {
+    return __atomic_load_n(&slot_of(ino)->generation, __ATOMIC_RELAXED);
+}
+
+void inode_free(unsigned long ino) {
+    if (ino == 0) {
+        return;
+    }
+    pthread_mutex_lock(&table_lock);
+    if (ino >= next_ino) {
+        pthread_mutex_unlock(&table_lock);
+        return;
+    }
+    __atomic_store_n(&slot_of(ino)->node, NULL, __ATOMIC_RELEASE);
+    if (num_free == free_capacity) {
+        unsigned long capacity = free_capacity == 0 ? INODE_PAGE_SIZE : 2 * free_capacity;
+        unsigned long *new_free = (unsigned long *) realloc(free_inos, capacity * sizeof(unsigned long));
+        if (new_free == NULL) {
+            /* The number leaks, but it is never handed out twice. */
+            pthread_mutex_unlock(&table_lock);
+            return;
+        }
+        free_inos = new_free;
+        free_capacity = capacity;
+    }
+    free_inos[num_free++] = ino;
+    pthread_mutex_unlock(&table_lock);
+}
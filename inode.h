@@ -0,0 +1,36 @@
+//
+// Inode number table: stable numbers for Nodes, used by the low-level engine.
+//
+
+#ifndef XYFS_INODE_H
+#define XYFS_INODE_H
+
+#define ROOT_INODE 1
+#define STATS_INODE (~0UL - 1)  /* the stats file; never reached by inode_alloc */
+
+/*
+ * Set up the table. Inode 0 is never handed out; ROOT_INODE is the
+ * first number returned by inode_alloc.
+ */
+extern void inode_table_init();
+
+/*
+ * Assign an inode number to node. Numbers of freed nodes are reused
+ * with a bumped generation. Returns 0 when the table is full or out of
+ * memory; 0 is never a valid number.
+ */
+extern unsigned long inode_alloc(Node *node);
+
+/*
+ * Return the node for an inode number, or NULL if it is not live.
+ */
+extern Node *inode_get(unsigned long ino);
+
+extern unsigned long inode_generation(unsigned long ino);
+
+/*
+ * Give the number back once its node has been freed.
+ */
+extern void inode_free(unsigned long ino);
+
+#endif //XYFS_INODE_H
@@ -0,0 +1,512 @@
+/*
+ * Write-ahead journal with group commit.
+ *
+ * Appending copies a record into the pending buffer under journal_lock
+ * and returns; nothing waits on the disk there. A single flusher thread
+ * swaps the pending buffer for an empty one, writes it out and
+ * fdatasyncs, so every record appended while one flush is in progress
+ * goes out together in the next. An operation replies only once
+ * journal_commit has seen its records become durable.
+ *
+ * Positions in the log are counted in bytes of records since the log was
+ * created. The file holds the records from file_base, kept in its header,
+ * to file_end; compaction rewrites it to start later, under file_lock,
+ * which the flusher also holds while it writes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "fileio.h"
+
+#define COPY_BUFFER_SIZE (1 << 20)
+
+static char *journal_path;
+static int journal_fd = -1;
+static uint64_t file_base;
+static uint64_t file_end;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static char *pending;
+static size_t pending_len;
+static size_t pending_capacity;
+static uint64_t appended;
+static uint64_t durable;
+static int failed;
+static int running;
+static int stopping;
+static int checkpoint_wanted;
+static JournalStats stats;
+
+static unsigned int flush_interval_ms;
+static uint64_t checkpoint_limit;
+static int (*checkpoint_fn)();
+static pthread_t flush_thread;
+static pthread_t checkpoint_thread;
+static int checkpoint_thread_running;
+
+/* End of the last record this thread appended. */
+static __thread uint64_t last_appended;
+
+static size_t align_up(size_t size) {
+    return (size + JOURNAL_ALIGN - 1) & ~((size_t) JOURNAL_ALIGN - 1);
+}
+
+/*
+ * Not a CRC: it only has to catch a record that was torn by a crash or
+ * never fully written. len is a multiple of JOURNAL_ALIGN.
+ */
+static uint32_t checksum(const char *p, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static int write_header(int fd, uint64_t base) {
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.base = base;
+    return write_all(fd, &header, sizeof(header), 0);
+}
+
+/*
+ * Length of the intact record at p, or 0.
+ */
+static size_t check_record(const char *p, size_t left) {
+    const JournalRecord *rec = (const JournalRecord *) p;
+    if (left < sizeof(JournalRecord) || rec->size > left || rec->size % JOURNAL_ALIGN != 0 ||
+        rec->path_len >= rec->size || rec->length > rec->size ||
+        sizeof(JournalRecord) + rec->path_len + 1 + rec->length > rec->size) {
+        return 0;
+    }
+    if (checksum(p + 8, rec->size - 8) != rec->checksum || p[sizeof(JournalRecord) + rec->path_len] != '\0') {
+        return 0;
+    }
+    return rec->size;
+}
+
+int journal_open(const char *path, uint64_t from,
+                 int (*apply)(const JournalRecord *rec, const char *path, const char *data)) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) != 0) {
+        int rc = -errno;
+        close(fd);
+        return rc;
+    }
+    if (st.st_size == 0) {
+        int rc = write_header(fd, from);
+        if (rc == 0 && fsync(fd) != 0) {
+            rc = -errno;
+        }
+        if (rc == 0) {
+            rc = sync_parent(path);
+        }
+        if (rc != 0) {
+            close(fd);
+            return rc;
+        }
+        st.st_size = sizeof(JournalHeader);
+    }
+
+    const JournalHeader *header = NULL;
+    void *map = MAP_FAILED;
+    if ((size_t) st.st_size >= sizeof(JournalHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        header = (const JournalHeader *) map;
+    }
+    if (map == MAP_FAILED || memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != JOURNAL_VERSION) {
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        close(fd);
+        return -EINVAL;
+    }
+
+    const char *records = (const char *) map + sizeof(JournalHeader);
+    size_t left = st.st_size - sizeof(JournalHeader);
+    uint64_t base = header->base;
+    size_t end = 0;
+    unsigned long replayed = 0, rejected = 0;
+    for (;;) {
+        size_t size = check_record(records + end, left - end);
+        if (size == 0) {
+            break;
+        }
+        end += size;
+        if (base + end <= from || apply == NULL) {
+            continue;
+        }
+        const JournalRecord *rec = (const JournalRecord *) (records + end - size);
+        const char *rec_path = (const char *) (rec + 1);
+        if (apply(rec, rec_path, rec_path + rec->path_len + 1) != 0) {
+            rejected++;
+        }
+        replayed++;
+    }
+    munmap(map, st.st_size);
+    if (base > from) {
+        fprintf(stderr, "journal: %s starts after the image, the changes in between are lost\n", path);
+    }
+
+    if (end < left) {
+        fprintf(stderr, "journal: dropping %lu bytes of torn or corrupt records\n",
+                (unsigned long) (left - end));
+        if (ftruncate(fd, sizeof(JournalHeader) + end) != 0 || fsync(fd) != 0) {
+            int rc = -errno;
+            close(fd);
+            return rc;
+        }
+    }
+    if (base + end < from) {
+        /* The image holds all of it; positions must not go back past its mark. */
+        int rc = ftruncate(fd, sizeof(JournalHeader)) != 0 ? -errno : write_header(fd, from);
+        if (rc == 0 && fsync(fd) != 0) {
+            rc = -errno;
+        }
+        if (rc != 0) {
+            close(fd);
+            return rc;
+        }
+        base = from;
+        end = 0;
+    }
+    if (replayed > 0) {
+        fprintf(stderr, "journal: replayed %lu records, %lu did not apply\n", replayed, rejected);
+    }
+
+    journal_path = strdup(path);
+    journal_fd = fd;
+    file_base = base;
+    file_end = base + end;
+    appended = file_end;
+    durable = file_end;
+    return 0;
+}
+
+/*
+ * Write len bytes of records at the end of the file and make them durable.
+ */
+static int write_batch(const char *buf, size_t len, uint64_t *logged) {
+    pthread_mutex_lock(&file_lock);
+    int rc = write_all(journal_fd, buf, len, sizeof(JournalHeader) + (file_end - file_base));
+    if (rc == 0 && fdatasync(journal_fd) != 0) {
+        rc = -errno;
+    }
+    if (rc == 0) {
+        file_end += len;
+    }
+    *logged = file_end - file_base;
+    pthread_mutex_unlock(&file_lock);
+    return rc;
+}
+
+static void *flush_loop(void *arg) {
+    char *batch = NULL;
+    size_t batch_capacity = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        while (pending_len == 0 && !stopping) {
+            pthread_cond_wait(&pending_cond, &journal_lock);
+        }
+        if (pending_len == 0) {
+            break;
+        }
+        if (flush_interval_ms > 0 && !stopping) {
+            /* Give more records the chance to join this group. */
+            struct timespec delay = {flush_interval_ms / 1000, (flush_interval_ms % 1000) * 1000000L};
+            pthread_mutex_unlock(&journal_lock);
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&journal_lock);
+        }
+
+        char *full = pending;
+        size_t len = pending_len;
+        size_t capacity = pending_capacity;
+        pending = batch;
+        pending_capacity = batch_capacity;
+        pending_len = 0;
+        batch = full;
+        batch_capacity = capacity;
+        uint64_t target = appended;
+        pthread_mutex_unlock(&journal_lock);
+
+        uint64_t logged;
+        int rc = write_batch(batch, len, &logged);
+
+        pthread_mutex_lock(&journal_lock);
+        if (rc != 0) {
+            if (!failed) {
+                fprintf(stderr, "journal: writing %s failed: %s\n", journal_path, strerror(-rc));
+            }
+            __atomic_store_n(&failed, 1, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&durable, target, __ATOMIC_RELEASE);
+            stats.flushes++;
+        }
+        if (checkpoint_fn != NULL && logged > checkpoint_limit) {
+            checkpoint_wanted = 1;
+            pthread_cond_signal(&checkpoint_cond);
+        }
+        pthread_cond_broadcast(&durable_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    free(batch);
+    return NULL;
+}
+
+static void *checkpoint_loop(void *arg) {
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        while (!checkpoint_wanted && !stopping) {
+            pthread_cond_wait(&checkpoint_cond, &journal_lock);
+        }
+        if (stopping) {
+            break;
+        }
+        checkpoint_wanted = 0;
+        pthread_mutex_unlock(&journal_lock);
+        checkpoint_fn();
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+void journal_start(unsigned int interval_ms, uint64_t checkpoint_bytes, int (*checkpoint)()) {
+    if (journal_fd < 0) {
+        return;
+    }
+    flush_interval_ms = interval_ms;
+    checkpoint_limit = checkpoint_bytes;
+    checkpoint_fn = checkpoint;
+    stopping = 0;
+    if (pthread_create(&flush_thread, NULL, flush_loop, NULL) != 0) {
+        fprintf(stderr, "journal: cannot start the flusher, not journaling\n");
+        return;
+    }
+    if (checkpoint != NULL && pthread_create(&checkpoint_thread, NULL, checkpoint_loop, NULL) == 0) {
+        checkpoint_thread_running = 1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+}
+
+void journal_stop() {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&pending_cond);
+    pthread_cond_broadcast(&checkpoint_cond);
+    pthread_mutex_unlock(&journal_lock);
+
+    pthread_join(flush_thread, NULL);
+    if (checkpoint_thread_running) {
+        pthread_join(checkpoint_thread, NULL);
+        checkpoint_thread_running = 0;
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+}
+
+void journal_close() {
+    journal_stop();
+    if (journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    free(journal_path);
+    journal_path = NULL;
+    free(pending);
+    pending = NULL;
+    pending_len = 0;
+    pending_capacity = 0;
+}
+
+int journal_running() {
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+void journal_append(JournalRecord *rec, const char *path, const struct iovec *data, int count) {
+    if (!journal_running()) {
+        return;
+    }
+    size_t path_len = strlen(path);
+    size_t length = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        length += data[i].iov_len;
+    }
+    size_t size = align_up(sizeof(JournalRecord) + path_len + 1 + length);
+    rec->size = size;
+    rec->path_len = path_len;
+    rec->length = length;
+
+    pthread_mutex_lock(&journal_lock);
+    if (pending_len + size > pending_capacity) {
+        size_t capacity = pending_capacity > 0 ? pending_capacity : 64 * 1024;
+        while (pending_len + size > capacity) {
+            capacity *= 2;
+        }
+        char *grown = (char *) realloc(pending, capacity);
+        if (grown == NULL) {
+            /* The change is made but cannot be logged: fail its commit. */
+            __atomic_store_n(&failed, 1, __ATOMIC_RELEASE);
+            last_appended = appended + 1;
+            pthread_mutex_unlock(&journal_lock);
+            return;
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+
+    char *p = pending + pending_len;
+    char *q = p + sizeof(JournalRecord);
+    memcpy(q, path, path_len + 1);
+    q += path_len + 1;
+    for (i = 0; i < count; i++) {
+        memcpy(q, data[i].iov_base, data[i].iov_len);
+        q += data[i].iov_len;
+    }
+    memset(q, 0, p + size - q);
+    rec->checksum = 0;
+    memcpy(p, rec, sizeof(JournalRecord));
+    rec->checksum = checksum(p + 8, size - 8);
+    memcpy(p, rec, 8);
+
+    pending_len += size;
+    appended += size;
+    last_appended = appended;
+    stats.records++;
+    stats.bytes += size;
+    pthread_cond_signal(&pending_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_commit() {
+    uint64_t target = last_appended;
+    if (target <= __atomic_load_n(&durable, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    pthread_mutex_lock(&journal_lock);
+    while (durable < target && !failed) {
+        pthread_cond_wait(&durable_cond, &journal_lock);
+    }
+    int rc = durable >= target ? 0 : -EIO;
+    pthread_mutex_unlock(&journal_lock);
+    return rc;
+}
+
+int journal_failed() {
+    return __atomic_load_n(&failed, __ATOMIC_ACQUIRE);
+}
+
+uint64_t journal_mark() {
+    pthread_mutex_lock(&journal_lock);
+    uint64_t mark = appended;
+    pthread_mutex_unlock(&journal_lock);
+    return mark;
+}
+
+int journal_compact(uint64_t mark) {
+    pthread_mutex_lock(&file_lock);
+    if (journal_fd < 0) {
+        pthread_mutex_unlock(&file_lock);
+        return 0;
+    }
+    /* Records past file_end are still pending; they go to the new file. */
+    uint64_t start = mark < file_end ? mark : file_end;
+    if (start <= file_base) {
+        pthread_mutex_unlock(&file_lock);
+        return 0;
+    }
+
+    size_t path_len = strlen(journal_path);
+    char *tmp_path = (char *) malloc(path_len + 5);
+    char *buf = (char *) malloc(COPY_BUFFER_SIZE);
+    int fd = -1, rc = 0;
+    if (tmp_path == NULL || buf == NULL) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    memcpy(tmp_path, journal_path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        rc = -errno;
+        goto out;
+    }
+
+    rc = write_header(fd, start);
+    off_t from = sizeof(JournalHeader) + (start - file_base);
+    off_t to = sizeof(JournalHeader);
+    uint64_t left = file_end - start;
+    while (rc == 0 && left > 0) {
+        size_t n = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        ssize_t got = pread(journal_fd, buf, n, from);
+        if (got <= 0) {
+            rc = got < 0 ? -errno : -EIO;
+            break;
+        }
+        rc = write_all(fd, buf, got, to);
+        from += got;
+        to += got;
+        left -= got;
+    }
+    if (rc == 0 && fdatasync(fd) != 0) {
+        rc = -errno;
+    }
+    if (rc == 0 && rename(tmp_path, journal_path) != 0) {
+        rc = -errno;
+    }
+    if (rc == 0) {
+        close(journal_fd);
+        journal_fd = fd;
+        file_base = start;
+        fd = -1;
+        rc = sync_parent(journal_path);
+    } else {
+        unlink(tmp_path);
+    }
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    pthread_mutex_unlock(&file_lock);
+    free(tmp_path);
+    free(buf);
+    return rc;
+}
+
+void journal_get_stats(JournalStats *out) {
+    pthread_mutex_lock(&journal_lock);
+    *out = stats;
+    pthread_mutex_unlock(&journal_lock);
+}
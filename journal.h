@@ -0,0 +1,127 @@
+//
+// Write-ahead journal: crash durability for the in-memory tree.
+//
+
+#ifndef XYFS_JOURNAL_H
+#define XYFS_JOURNAL_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define JOURNAL_MAGIC "XYFSLOG1"
+#define JOURNAL_VERSION 2
+#define JOURNAL_ALIGN 8
+
+#define JOURNAL_CREATE 1
+#define JOURNAL_MKDIR 2
+#define JOURNAL_UNLINK 3
+#define JOURNAL_RMDIR 4
+#define JOURNAL_WRITE 5
+#define JOURNAL_TRUNCATE 6
+#define JOURNAL_PUNCH 7
+#define JOURNAL_RENAME 8
+
+/*
+ * The file is a header followed by records, each padded to JOURNAL_ALIGN.
+ * A record is this struct, the path with a terminating NUL, then length
+ * bytes of data. Records name nodes by path.
+ *
+ * Positions in the log count bytes of records since it was created and
+ * survive compaction, which only moves base. An image records the
+ * position it holds every change up to, and replay skips the records
+ * before it: replaying a rename twice, or a create whose directory was
+ * later renamed away, would not leave the tree as it was.
+ */
+typedef struct journal_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t base;              /* position of the first record */
+} JournalHeader;
+
+typedef struct journal_record
+{
+    uint32_t size;              /* whole record, padding included */
+    uint32_t checksum;          /* of everything after this field */
+    uint32_t op;
+    uint32_t mode;              /* rename flags for _RENAME */
+    uint32_t path_len;          /* without the NUL */
+    uint32_t reserved;
+    uint64_t offset;            /* JOURNAL_WRITE, _PUNCH; new size for _TRUNCATE */
+    uint64_t length;            /* bytes of data after the path; for _PUNCH the
+                                 * data is the hole's length as a uint64_t, for
+                                 * _RENAME the new path with its NUL */
+} JournalRecord;
+
+typedef struct journal_stats
+{
+    unsigned long records;
+    unsigned long bytes;
+    unsigned long flushes;      /* group commits, one fdatasync each */
+} JournalStats;
+
+/*
+ * Open the journal at path, creating it if missing, and hand every intact
+ * record that ends after position from to apply, in order; the tree
+ * already holds the ones before. A torn or corrupt tail is cut off, and
+ * a log that ends before from is restarted there. Records are not taken
+ * until journal_start. Returns 0 or -errno.
+ */
+extern int journal_open(const char *path, uint64_t from,
+                        int (*apply)(const JournalRecord *rec, const char *path, const char *data));
+
+/*
+ * Start taking records. A flusher thread writes whatever has been appended
+ * and fdatasyncs it, one group at a time; with interval_ms it first waits
+ * that long for more records to join the group. Once the log holds more
+ * than checkpoint_bytes, checkpoint is called from a thread of its own.
+ */
+extern void journal_start(unsigned int interval_ms, uint64_t checkpoint_bytes, int (*checkpoint)());
+
+/*
+ * Flush what is pending, stop the threads and stop taking records.
+ */
+extern void journal_stop();
+
+extern void journal_close();
+
+/*
+ * Whether journal_append currently takes records.
+ */
+extern int journal_running();
+
+/*
+ * Append a record; size, checksum, path_len and length are filled in.
+ * Callers append under the lock that orders the change they describe,
+ * right after making it.
+ */
+extern void journal_append(JournalRecord *rec, const char *path, const struct iovec *data, int count);
+
+/*
+ * Wait until every record this thread appended is on disk. Call with no
+ * node locks held. Returns 0, or -EIO once a flush has failed.
+ */
+extern int journal_commit();
+
+/*
+ * Whether a flush has failed. It stays failed: nothing appended after
+ * that can be made durable, so changes check this before they are made
+ * and fail with -EIO without touching the tree. Only a change already
+ * made when the flush failed is ambiguous; journal_commit reports -EIO
+ * for it, but the tree holds it and the log may or may not.
+ */
+extern int journal_failed();
+
+/*
+ * Compaction. journal_mark returns the position after the last appended
+ * record; once an image holding every change up to it has been saved,
+ * and renamed into place durably, journal_compact drops the records
+ * before it from the file.
+ */
+extern uint64_t journal_mark();
+extern int journal_compact(uint64_t mark);
+
+extern void journal_get_stats(JournalStats *stats);
+
+#endif //XYFS_JOURNAL_H
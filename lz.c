@@ -0,0 +1,241 @@
+/*
+ * LZ77 block codec.
+ *
+ * The output is the LZ4 block format: a run of sequences, each a token
+ * byte (literal count in the high nibble, match length minus 4 in the
+ * low one, 15 meaning more length bytes follow), the literals, and a
+ * little-endian 16-bit match offset. The last sequence has literals
+ * only. As in LZ4, the last 5 bytes are always literals and no match
+ * starts in the last 12, which lets a decoder copy in whole words.
+ *
+ * The compressor is greedy with a single-entry hash table of 4-byte
+ * sequences, and skips ahead faster the longer it goes without a match,
+ * so incompressible data costs little time.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static unsigned int hash4(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, int length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char) length;
+    return op;
+}
+
+/*
+ * Emit one sequence; match_length 0 means the literals-only last one.
+ * Returns the new output position, or NULL if it does not fit.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, const char *literals,
+                                   int literal_length, int offset, int match_length) {
+    int worst = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+    if (worst > oend - op) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (literal_length >= 15 ? 15 : literal_length) << 4;
+    if (literal_length >= 15) {
+        op = put_length(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_length -= MIN_MATCH;
+    *token |= match_length >= 15 ? 15 : match_length;
+    if (match_length >= 15) {
+        op = put_length(op, match_length - 15);
+    }
+    return op;
+}
+
+/*
+ * Length of the match between pos and candidate, which share at least
+ * their first MIN_MATCH bytes, up to max. Compares a word at a time.
+ */
+static int match_length(const char *src, int pos, int candidate, int max) {
+    int length = MIN_MATCH;
+    while (length + 8 <= max) {
+        uint64_t diff = read64(src + pos + length) ^ read64(src + candidate + length);
+        if (diff != 0) {
+            return length + (__builtin_ctzll(diff) >> 3);
+        }
+        length += 8;
+    }
+    while (length < max && src[pos + length] == src[candidate + length]) {
+        length++;
+    }
+    return length;
+}
+
+int lz_compress(const char *src, int size, char *dst, int capacity) {
+    int table[1 << LZ_HASH_BITS];
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + capacity;
+    int anchor = 0;
+
+    if (size > MATCH_LIMIT) {
+        int limit = size - MATCH_LIMIT;
+        int pos = 0;
+        memset(table, 0, sizeof(table));
+        while (pos < limit) {
+            uint32_t sequence = read32(src + pos);
+            unsigned int h = hash4(sequence);
+            int candidate = table[h];
+            table[h] = pos;
+            if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+                pos--;
+                candidate--;
+            }
+            int length = match_length(src, pos, candidate, size - LAST_LITERALS - pos);
+
+            op = put_sequence(op, oend, src + anchor, pos - anchor, pos - candidate, length);
+            if (op == NULL) {
+                return 0;
+            }
+            pos += length;
+            anchor = pos;
+            if (pos < limit) {
+                table[hash4(read32(src + pos - 2))] = pos - 2;
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, src + anchor, size - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return (int) (op - (unsigned char *) dst);
+}
+
+/*
+ * Read an extended length. Returns -1 if the input ends first.
+ */
+static long get_length(const unsigned char **ip, const unsigned char *iend) {
+    long length = 0;
+    unsigned int b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+/*
+ * Copy n bytes in 16-byte steps, writing up to 15 bytes past the end.
+ * The caller makes sure both buffers have that much slack and that a
+ * step never reads what the same step writes.
+ */
+static void wild_copy(char *to, const char *from, long n) {
+    char *end = to + n;
+    do {
+        memcpy(to, from, 16);
+        to += 16;
+        from += 16;
+    } while (to < end);
+}
+
+int lz_decompress(const char *src, int length, char *dst, int size) {
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + length;
+    char *op = dst;
+    char *oend = dst + size;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        long literals = token >> 4;
+        if (literals == 15) {
+            long more = get_length(&ip, iend);
+            if (more < 0) {
+                return -1;
+            }
+            literals += more;
+        }
+        if (literals > iend - ip || literals > oend - op) {
+            return -1;
+        }
+        if (literals + 16 <= iend - ip && literals + 16 <= oend - op) {
+            wild_copy(op, (const char *) ip, literals);
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        long offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst) {
+            return -1;
+        }
+        long match = token & 15;
+        if (match == 15) {
+            long more = get_length(&ip, iend);
+            if (more < 0) {
+                return -1;
+            }
+            match += more;
+        }
+        match += MIN_MATCH;
+        if (match > oend - op) {
+            return -1;
+        }
+
+        const char *from = op - offset;
+        if (offset >= 16 && match + 16 <= oend - op) {
+            wild_copy(op, from, match);
+        } else if (offset >= match) {
+            memcpy(op, from, match);
+        } else if (offset == 1) {
+            memset(op, *from, match);
+        } else {
+            long i;
+            for (i = 0; i < match; i++) {
+                op[i] = from[i];
+            }
+        }
+        op += match;
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+//
+// Fast LZ77 block codec, in the LZ4 block format.
+//
+
+#ifndef XYFS_LZ_H
+#define XYFS_LZ_H
+
+#define LZ_HASH_BITS 12
+
+/*
+ * Compress size bytes at src into at most capacity bytes at dst. Returns
+ * the compressed length, or 0 if it would not fit.
+ */
+extern int lz_compress(const char *src, int size, char *dst, int capacity);
+
+/*
+ * Decompress length bytes at src into exactly size bytes at dst. Returns
+ * 0, or -1 if the input is corrupt or does not decode to size bytes.
+ * Never reads or writes outside the given buffers.
+ */
+extern int lz_decompress(const char *src, int length, char *dst, int size);
+
+#endif //XYFS_LZ_H
@@ -0,0 +1,114 @@
+/*
+ * Command line entry point. Parses xyfs' own switches into xyfs_config,
+ * builds the tree and hands the remaining arguments to the chosen engine;
+ * everything else lives in the library the benchmarks link too.
+ */
+#define FUSE_USE_VERSION 30
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include <fuse.h>
+
+#include "xyfs.h"
+#include "ramdisk.h"
+#include "cold.h"
+
+static struct fuse_opt xyfs_opts[] = {
+        {"--lowlevel", offsetof(XyfsConfig, lowlevel), 1},
+        {"--copy-io", offsetof(XyfsConfig, copy_io), 1},
+        {"--snapshot=%s", offsetof(XyfsConfig, snapshot_path), 0},
+        {"--snapshot-interval=%u", offsetof(XyfsConfig, snapshot_interval), 0},
+        {"--journal=%s", offsetof(XyfsConfig, journal_path), 0},
+        {"--journal-interval=%u", offsetof(XyfsConfig, journal_interval), 0},
+        {"--journal-checkpoint=%u", offsetof(XyfsConfig, journal_checkpoint), 0},
+        {"--dedup", offsetof(XyfsConfig, dedup), 1},
+        {"--cold-after=%u", offsetof(XyfsConfig, cold_after), 0},
+        {"--cold-cache=%u", offsetof(XyfsConfig, cold_cache), 0},
+        {"--entry-timeout=%lf", offsetof(XyfsConfig, entry_timeout), 0},
+        {"--attr-timeout=%lf", offsetof(XyfsConfig, attr_timeout), 0},
+        {"--negative-timeout=%lf", offsetof(XyfsConfig, negative_timeout), 0},
+        {"--keep-cache", offsetof(XyfsConfig, keep_cache), 1},
+        {"--no-keep-cache", offsetof(XyfsConfig, keep_cache), 0},
+        {"--trace=%u", offsetof(XyfsConfig, trace), 0},
+        {"--trace-file=%s", offsetof(XyfsConfig, trace_path), 0},
+        FUSE_OPT_END
+};
+
+/*
+ * FUSE changes to / when it daemonizes, so relative paths given on the
+ * command line are resolved up front. Takes ownership of path.
+ */
+static char *absolute_path(char *path) {
+    if (path == NULL || path[0] == '/') {
+        return path;
+    }
+    char *cwd = realpath(".", NULL);
+    char *absolute = cwd == NULL ? NULL : malloc(strlen(cwd) + strlen(path) + 2);
+    if (absolute == NULL) {
+        free(cwd);
+        return path;
+    }
+    sprintf(absolute, "%s/%s", cwd, path);
+    free(cwd);
+    free(path);
+    return absolute;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2) {
+        printf("Starting new filesystem.\n");
+    }
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    xyfs_config.journal_checkpoint = 64;
+    xyfs_config.cold_cache = COLD_DEFAULT_CACHE;
+    xyfs_config.entry_timeout = 10.0;
+    xyfs_config.attr_timeout = 10.0;
+    xyfs_config.negative_timeout = 1.0;
+    xyfs_config.keep_cache = 1;
+    if (fuse_opt_parse(&args, &xyfs_config, xyfs_opts, NULL) == -1) {
+        return 1;
+    }
+    if (xyfs_config.journal_path != NULL && xyfs_config.snapshot_path == NULL) {
+        /* Checkpoints need an image to go to. */
+        xyfs_config.snapshot_path = malloc(strlen(xyfs_config.journal_path) + 6);
+        sprintf(xyfs_config.snapshot_path, "%s.ckpt", xyfs_config.journal_path);
+    }
+    xyfs_config.snapshot_path = absolute_path(xyfs_config.snapshot_path);
+    xyfs_config.journal_path = absolute_path(xyfs_config.journal_path);
+    xyfs_config.trace_path = absolute_path(xyfs_config.trace_path);
+    if (init_root() != 0) {
+        fprintf(stderr, "xyfs: cannot create the root directory\n");
+        return 1;
+    }
+    if (xyfs_config.journal_path != NULL) {
+        int rc = open_journal(xyfs_config.journal_path);
+        if (rc != 0) {
+            fprintf(stderr, "journal: cannot open %s: %s\n", xyfs_config.journal_path, strerror(-rc));
+            return 1;
+        }
+    }
+
+    int ret;
+    if (xyfs_config.copy_io) {
+        /* Plain memcpy data path, kept for comparison. */
+        ramdisk_operations.read_buf = NULL;
+        ramdisk_operations.write_buf = NULL;
+    }
+    if (xyfs_config.lowlevel) {
+        ret = xyfs_ll_main(&args);
+    } else {
+        /* Unlink open files directly instead of renaming them to
+         * .fuse_hidden; the handle keeps the Node alive until release. */
+        fuse_opt_add_arg(&args, "-ohard_remove");
+        char timeouts[128];
+        snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+                 xyfs_config.entry_timeout, xyfs_config.attr_timeout, xyfs_config.negative_timeout);
+        fuse_opt_add_arg(&args, timeouts);
+        ret = fuse_main(args.argc, args.argv, &ramdisk_operations, NULL);
+    }
+    fuse_opt_free_args(&args);
+    return ret;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+//
+// Path-based engine: the FUSE high-level callbacks in xyfs.c. They can
+// also be called directly, as the in-process benchmarks do, once
+// init_root has built the tree. ramdisk_operations calls them through
+// timers that feed the stats file; called directly they are untimed.
+//
+
+#ifndef XYFS_RAMDISK_H
+#define XYFS_RAMDISK_H
+
+#include <fuse.h>
+
+extern struct fuse_operations ramdisk_operations;
+
+extern int ramdisk_open(const char *path, struct fuse_file_info *fi);
+extern int ramdisk_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+extern int ramdisk_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+extern int ramdisk_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                            struct fuse_file_info *fi);
+extern int ramdisk_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
+extern int ramdisk_unlink(const char *path);
+extern int ramdisk_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+extern int ramdisk_mkdir(const char *path, mode_t mode);
+extern int ramdisk_rmdir(const char *path);
+extern int ramdisk_rename(const char *from, const char *to, unsigned int flags);
+extern int ramdisk_opendir(const char *path, struct fuse_file_info *fi);
+extern int ramdisk_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                           struct fuse_file_info *fi);
+extern int ramdisk_releasedir(const char *path, struct fuse_file_info *fi);
+extern int ramdisk_getattr(const char *path, struct stat *stbuf);
+extern int ramdisk_release(const char *path, struct fuse_file_info *fi);
+extern int ramdisk_utime(const char *path, struct utimbuf *ubuf);
+extern int ramdisk_truncate(const char *path, off_t offset);
+extern int ramdisk_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
+extern int ramdisk_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+extern void *ramdisk_init(struct fuse_conn_info *conn);
+extern void ramdisk_destroy(void *private_data);
+
+#endif //XYFS_RAMDISK_H
@@ -0,0 +1,113 @@
+/*
+ * Slab allocator.
+ *
+ * Every SLAB_GRANULE-sized class up to SLAB_MAX_OBJECT has its own list of
+ * SLAB_PAGE_SIZE pages. New objects are carved off the newest page; freed
+ * objects go on the class's free list, with the link stored in the object
+ * itself, and are reused first. Objects of one class sit next to each
+ * other, so creating and deleting many files neither fragments the heap
+ * nor goes through malloc.
+ *
+ * Pages are never given back; an emptied filesystem keeps its slabs for
+ * the next wave of creates.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+
+#define NUM_CLASSES (SLAB_MAX_OBJECT / SLAB_GRANULE)
+
+typedef struct free_object
+{
+    struct free_object *next;
+} FreeObject;
+
+typedef struct size_class
+{
+    pthread_mutex_t lock;
+    FreeObject *free_list;
+    char *bump;         /* next uncarved object in the newest page */
+    char *bump_end;
+    size_t in_use;
+} __attribute__((aligned(64))) SizeClass;
+
+static SizeClass classes[NUM_CLASSES];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+static size_t reserved_bytes;
+
+static void init_classes() {
+    int i;
+    for (i = 0; i < NUM_CLASSES; i++) {
+        pthread_mutex_init(&classes[i].lock, NULL);
+    }
+}
+
+static int class_index(size_t size) {
+    return size == 0 ? 0 : (int) ((size - 1) / SLAB_GRANULE);
+}
+
+void *slab_alloc(size_t size) {
+    SizeClass *cls;
+    size_t object_size;
+    void *ptr;
+
+    if (size > SLAB_MAX_OBJECT) {
+        return malloc(size);
+    }
+    pthread_once(&classes_once, init_classes);
+    cls = &classes[class_index(size)];
+    object_size = (size_t) (class_index(size) + 1) * SLAB_GRANULE;
+
+    pthread_mutex_lock(&cls->lock);
+    if (cls->free_list != NULL) {
+        ptr = cls->free_list;
+        cls->free_list = cls->free_list->next;
+    } else {
+        if (cls->bump == NULL || cls->bump + object_size > cls->bump_end) {
+            char *page = (char *) malloc(SLAB_PAGE_SIZE);
+            if (page == NULL) {
+                pthread_mutex_unlock(&cls->lock);
+                return NULL;
+            }
+            __atomic_add_fetch(&reserved_bytes, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+            cls->bump = page;
+            cls->bump_end = page + SLAB_PAGE_SIZE;
+        }
+        ptr = cls->bump;
+        cls->bump += object_size;
+    }
+    cls->in_use += object_size;
+    pthread_mutex_unlock(&cls->lock);
+    return ptr;
+}
+
+void slab_free(void *ptr, size_t size) {
+    SizeClass *cls;
+    FreeObject *object = (FreeObject *) ptr;
+
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX_OBJECT) {
+        free(ptr);
+        return;
+    }
+    cls = &classes[class_index(size)];
+
+    pthread_mutex_lock(&cls->lock);
+    object->next = cls->free_list;
+    cls->free_list = object;
+    cls->in_use -= (size_t) (class_index(size) + 1) * SLAB_GRANULE;
+    pthread_mutex_unlock(&cls->lock);
+}
+
+void slab_get_stats(size_t *reserved, size_t *in_use) {
+    int i;
+    *reserved = __atomic_load_n(&reserved_bytes, __ATOMIC_RELAXED);
+    *in_use = 0;
+    for (i = 0; i < NUM_CLASSES; i++) {
+        pthread_mutex_lock(&classes[i].lock);
+        *in_use += classes[i].in_use;
+        pthread_mutex_unlock(&classes[i].lock);
+    }
+}
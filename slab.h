@@ -0,0 +1,32 @@
+//
+// Size-class slab allocator for small fixed-size metadata objects.
+//
+
+#ifndef XYFS_SLAB_H
+#define XYFS_SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_GRANULE 16
+#define SLAB_MAX_OBJECT 1024
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+/*
+ * Allocate size bytes from the slab of its size class, rounded up to
+ * SLAB_GRANULE. Larger requests fall through to malloc. Returns NULL when
+ * out of memory. The memory is not zeroed.
+ */
+extern void *slab_alloc(size_t size);
+
+/*
+ * Give an object back to its size class. size must be the size it was
+ * allocated with.
+ */
+extern void slab_free(void *ptr, size_t size);
+
+/*
+ * Bytes held in slab pages, and bytes of those handed out as objects.
+ */
+extern void slab_get_stats(size_t *reserved, size_t *in_use);
+
+#endif //XYFS_SLAB_H
@@ -0,0 +1,406 @@
+/*
+ * Snapshot images.
+ *
+ * snapshot_save walks the tree breadth first, so that every directory's
+ * children end up next to each other in the node table, then writes the
+ * names and file data behind the table. Loading only maps the file and
+ * checks the header: xyfs.c turns records into Nodes one directory at a
+ * time as they are first looked at, and file data is read straight from
+ * the mapping until the file is first written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "hashmap.h"
+#include "xyfs.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "fileio.h"
+
+/* One node queued for writing, with the name it had when it was found. */
+typedef struct save_entry
+{
+    Node *node;
+    char *name;
+    uint64_t first_child;
+    uint64_t child_count;
+} SaveEntry;
+
+static const char *image;
+static uint64_t image_size;
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t align_up(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) & ~((uint64_t) SNAPSHOT_ALIGN - 1);
+}
+
+static void free_entries(SaveEntry *entries, uint64_t count) {
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        put_node(entries[i].node);
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/*
+ * Collect every node, breadth first, each with a reference taken.
+ */
+static int collect(SaveEntry **out, uint64_t *out_count) {
+    uint64_t count = 1, capacity = 1024, i;
+    SaveEntry *entries = (SaveEntry *) malloc(capacity * sizeof(SaveEntry));
+    if (entries == NULL) {
+        return -ENOMEM;
+    }
+    get_node(root);
+    entries[0].node = root;
+    entries[0].name = strdup("/");
+
+    for (i = 0; i < count; i++) {
+        Node *dir = entries[i].node;
+        entries[i].first_child = count;
+        entries[i].child_count = 0;
+        if (dir->type != DERICTORY_NODE) {
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&dir->lock);
+        Children *children = get_children(dir);
+        int n = children_count(children);
+        char **names = (char **) malloc((n + 1) * sizeof(char *));
+        SaveEntry *grown = entries;
+        if (names != NULL && count + n > capacity) {
+            while (count + n > capacity) {
+                capacity *= 2;
+            }
+            grown = (SaveEntry *) realloc(entries, capacity * sizeof(SaveEntry));
+        }
+        if (names == NULL || grown == NULL) {
+            pthread_rwlock_unlock(&dir->lock);
+            free(names);
+            free_entries(entries, count);
+            return -ENOMEM;
+        }
+        entries = grown;
+        n = children_names(children, names);
+        int j;
+        for (j = 0; j < n; j++) {
+            Node *child = get_child(dir, names[j]);
+            get_node(child);
+            entries[count].node = child;
+            entries[count].name = strdup(names[j]);
+            count++;
+        }
+        entries[i].child_count = n;
+        pthread_rwlock_unlock(&dir->lock);
+        free(names);
+    }
+
+    *out = entries;
+    *out_count = count;
+    return 0;
+}
+
+static void fill_record(SnapshotNode *rec, struct stat *st) {
+    rec->mode = st->st_mode;
+    rec->nlink = st->st_nlink;
+    rec->uid = st->st_uid;
+    rec->gid = st->st_gid;
+    rec->size = st->st_size;
+    rec->atime = __atomic_load_n(&st->st_atime, __ATOMIC_RELAXED);
+    rec->mtime = st->st_mtime;
+    rec->ctime = st->st_ctime;
+}
+
+/*
+ * Append a file's data at *offset and fill in its record. Compressed
+ * chunks are decompressed through a buffer, allocated on first need.
+ */
+static int write_file(int fd, Node *node, SnapshotNode *rec, uint64_t *offset) {
+    struct iovec iov[16];
+    char *cold = NULL;
+    int rc = 0;
+
+    pthread_rwlock_rdlock(&node->lock);
+    fill_record(rec, node->st);
+    rec->data_offset = *offset;
+    rec->data_size = node->st->st_size;
+
+    size_t left = node->st->st_size;
+    off_t pos = 0;
+    while (left > 0 && rc == 0) {
+        int count = content_map_read(&node->content, left, pos, iov, 16);
+        int i;
+        for (i = 0; i < count && rc == 0; i++) {
+            if (iov[i].iov_base == NULL) {
+                if (cold == NULL && (cold = (char *) malloc(CHUNK_SIZE)) == NULL) {
+                    rc = -ENOMEM;
+                    break;
+                }
+                content_read(&node->content, cold, iov[i].iov_len, pos);
+                iov[i].iov_base = cold;
+            }
+            rc = write_all(fd, iov[i].iov_base, iov[i].iov_len, *offset + pos);
+            pos += iov[i].iov_len;
+            left -= iov[i].iov_len;
+        }
+    }
+    pthread_rwlock_unlock(&node->lock);
+    free(cold);
+
+    *offset = align_up(*offset + rec->data_size);
+    return rc;
+}
+
+int snapshot_save(const char *path, uint64_t *mark) {
+    SaveEntry *entries;
+    uint64_t count, i, logged;
+    int rc;
+
+    pthread_mutex_lock(&save_lock);
+    pthread_rwlock_wrlock(&rename_lock);
+    logged = journal_mark();
+    rc = collect(&entries, &count);
+    pthread_rwlock_unlock(&rename_lock);
+    if (rc != 0) {
+        pthread_mutex_unlock(&save_lock);
+        return rc;
+    }
+    if (mark != NULL) {
+        *mark = logged;
+    }
+
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *) malloc(path_len + 5);
+    SnapshotNode *nodes = (SnapshotNode *) calloc(count, sizeof(SnapshotNode));
+    int fd = -1;
+    if (tmp_path == NULL || nodes == NULL) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        rc = -errno;
+        goto out;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.node_size = sizeof(SnapshotNode);
+    header.node_count = count;
+    header.nodes_offset = align_up(sizeof(SnapshotHeader));
+    header.journal_mark = logged;
+
+    /* Names, then data, behind the node table. */
+    uint64_t offset = header.nodes_offset + count * sizeof(SnapshotNode);
+    for (i = 0; i < count && rc == 0; i++) {
+        if (entries[i].name == NULL) {
+            rc = -ENOMEM;
+            break;
+        }
+        size_t len = strlen(entries[i].name);
+        nodes[i].name_offset = offset;
+        nodes[i].name_len = len;
+        nodes[i].type = entries[i].node->type;
+        nodes[i].first_child = entries[i].first_child;
+        nodes[i].child_count = entries[i].child_count;
+        rc = write_all(fd, entries[i].name, len + 1, offset);
+        offset += len + 1;
+    }
+    offset = align_up(offset);
+
+    for (i = 0; i < count && rc == 0; i++) {
+        Node *node = entries[i].node;
+        if (node->type == FILE_NODE) {
+            rc = write_file(fd, node, &nodes[i], &offset);
+        } else {
+            pthread_rwlock_rdlock(&node->lock);
+            fill_record(&nodes[i], node->st);
+            pthread_rwlock_unlock(&node->lock);
+        }
+    }
+
+    header.image_size = offset;
+    if (rc == 0) {
+        rc = write_all(fd, nodes, count * sizeof(SnapshotNode), header.nodes_offset);
+    }
+    if (rc == 0) {
+        rc = write_all(fd, &header, sizeof(header), 0);
+    }
+    if (rc == 0 && (ftruncate(fd, offset) != 0 || fsync(fd) != 0)) {
+        rc = -errno;
+    }
+    if (close(fd) != 0 && rc == 0) {
+        rc = -errno;
+    }
+    fd = -1;
+    if (rc == 0 && rename(tmp_path, path) != 0) {
+        rc = -errno;
+        unlink(tmp_path);
+    } else if (rc == 0) {
+        rc = sync_parent(path);
+    } else {
+        unlink(tmp_path);
+    }
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(nodes);
+    free_entries(entries, count);
+    pthread_mutex_unlock(&save_lock);
+    return rc;
+}
+
+const SnapshotNode *snapshot_load(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *) map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->node_size != sizeof(SnapshotNode) ||
+        header->image_size != (uint64_t) st.st_size ||
+        header->node_count == 0 ||
+        header->nodes_offset > header->image_size ||
+        header->node_count > (header->image_size - header->nodes_offset) / sizeof(SnapshotNode)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    image = (const char *) map;
+    image_size = st.st_size;
+    return (const SnapshotNode *) (image + header->nodes_offset);
+}
+
+uint64_t snapshot_journal_mark() {
+    if (image == NULL) {
+        return 0;
+    }
+    return ((const SnapshotHeader *) image)->journal_mark;
+}
+
+const SnapshotNode *snapshot_child(const SnapshotNode *dir, uint64_t i) {
+    const SnapshotHeader *header = (const SnapshotHeader *) image;
+    uint64_t index = dir->first_child + i;
+    if (i >= dir->child_count || index >= header->node_count) {
+        return NULL;
+    }
+    return (const SnapshotNode *) (image + header->nodes_offset) + index;
+}
+
+const char *snapshot_name(const SnapshotNode *node) {
+    if (node->name_offset >= image_size || node->name_len >= image_size - node->name_offset ||
+        image[node->name_offset + node->name_len] != '\0') {
+        return NULL;
+    }
+    return image + node->name_offset;
+}
+
+const char *snapshot_data(const SnapshotNode *node) {
+    if (node->data_offset > image_size || node->data_size > image_size - node->data_offset) {
+        return NULL;
+    }
+    return image + node->data_offset;
+}
+
+/*
+ * Background saves: a timer, and SIGUSR1 for saving on demand. The signal
+ * handler only posts the semaphore the thread sleeps on.
+ */
+static pthread_t save_thread;
+static int save_thread_running;
+static int save_thread_stop;
+static sem_t save_wakeup;
+static const char *save_path;
+static unsigned int save_interval;
+
+static void on_sigusr1(int sig) {
+    sem_post(&save_wakeup);
+}
+
+static void *save_loop(void *arg) {
+    for (;;) {
+        int rc;
+        if (save_interval > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += save_interval;
+            rc = sem_timedwait(&save_wakeup, &deadline);
+        } else {
+            rc = sem_wait(&save_wakeup);
+        }
+        if (rc != 0 && errno == EINTR) {
+            continue;
+        }
+        if (__atomic_load_n(&save_thread_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        rc = snapshot_save(save_path, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "snapshot: saving %s failed: %s\n", save_path, strerror(-rc));
+        }
+    }
+    return NULL;
+}
+
+void snapshot_start(const char *path, unsigned int interval) {
+    struct sigaction sa;
+
+    save_path = path;
+    save_interval = interval;
+    sem_init(&save_wakeup, 0, 0);
+    save_thread_stop = 0;
+    if (pthread_create(&save_thread, NULL, save_loop, NULL) != 0) {
+        return;
+    }
+    save_thread_running = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+void snapshot_stop() {
+    if (!save_thread_running) {
+        return;
+    }
+    signal(SIGUSR1, SIG_IGN);
+    __atomic_store_n(&save_thread_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&save_wakeup);
+    pthread_join(save_thread, NULL);
+    save_thread_running = 0;
+    sem_destroy(&save_wakeup);
+}
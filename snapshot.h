@@ -0,0 +1,91 @@
+//
+// Snapshot images: the whole tree in one flat, memory-mappable file.
+//
+
+#ifndef XYFS_SNAPSHOT_H
+#define XYFS_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "XYFSIMG1"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 64
+
+/*
+ * Layout: header, node table, NUL-terminated names, file data. Every
+ * reference is an offset from the start of the image or an index into
+ * the node table, so the image works wherever it is mapped. Node 0 is
+ * the root, and a directory's children are contiguous in the table.
+ */
+typedef struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;         /* sizeof(SnapshotNode) */
+    uint64_t node_count;
+    uint64_t nodes_offset;
+    uint64_t image_size;
+    uint64_t journal_mark;      /* every change logged before it is in the image */
+} SnapshotHeader;
+
+typedef struct snapshot_node
+{
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t type;
+    uint64_t first_child;       /* directories */
+    uint64_t child_count;
+    uint64_t data_offset;       /* files */
+    uint64_t data_size;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+} SnapshotNode;
+
+/*
+ * Write the current tree to path, through a temporary file renamed into
+ * place; the rename is durable when this returns. Each node is copied
+ * under its own lock, so the image is consistent per node, not across the
+ * tree; renames are held off while the tree is walked, so every node is in
+ * it once. The header records journal_mark() taken with renames held off:
+ * the image holds every change logged before it and no rename logged
+ * after. If mark is not NULL it gets the same value. Returns 0 or -errno.
+ */
+extern int snapshot_save(const char *path, uint64_t *mark);
+
+/*
+ * Map the image at path read-only and return its root record, or NULL if
+ * there is no valid image. The mapping lives until the process exits.
+ */
+extern const SnapshotNode *snapshot_load(const char *path);
+
+/*
+ * The journal mark of the loaded image, or 0 if none is loaded.
+ */
+extern uint64_t snapshot_journal_mark();
+
+/*
+ * Accessors for records of the loaded image. They return NULL for a
+ * record whose offsets fall outside the image.
+ */
+extern const SnapshotNode *snapshot_child(const SnapshotNode *dir, uint64_t i);
+extern const char *snapshot_name(const SnapshotNode *node);
+extern const char *snapshot_data(const SnapshotNode *node);
+
+/*
+ * Run a background thread that saves to path every interval seconds (0:
+ * never on a timer) and whenever the process gets SIGUSR1.
+ */
+extern void snapshot_start(const char *path, unsigned int interval);
+
+/*
+ * Stop the background thread, if any.
+ */
+extern void snapshot_stop();
+
+#endif //XYFS_SNAPSHOT_H
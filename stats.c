@@ -0,0 +1,240 @@
+/*
+ * Operation counters and latency histograms.
+ *
+ * Each thread that times an operation gets a ThreadStats block, which
+ * only it writes, with relaxed atomic stores so a reader summing the
+ * blocks never sees a torn value. The block also takes the thread's
+ * hashmap counters. Blocks are listed under a mutex that only thread
+ * start and exit and readers take; when a thread exits its totals are
+ * folded into retired, so nothing counted is ever lost.
+ *
+ * Histogram bucket i counts latencies in (2^(i-1), 2^i] nanoseconds, and
+ * the last bucket everything longer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "hashmap.h"
+#include "stats.h"
+
+typedef struct op_counters
+{
+    unsigned long count;
+    unsigned long errors;
+    uint64_t total_ns;
+    unsigned long buckets[STATS_BUCKETS];
+} OpCounters;
+
+typedef struct thread_stats
+{
+    struct thread_stats *next;
+    OpCounters ops[STATS_OPS];
+    hashmap_counters map;
+} ThreadStats;
+
+static const char *op_names[STATS_OPS] = {
+        "getattr", "setattr", "lookup", "forget", "open", "release", "read", "write", "create", "mkdir",
+        "unlink", "rmdir", "rename", "opendir", "readdir", "releasedir", "truncate",
+        "fallocate", "utime"
+};
+
+static __thread ThreadStats *current;
+static ThreadStats *threads;
+static ThreadStats retired;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+#define ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/*
+ * Add every counter of from into to. from may still be written by its
+ * thread; to must be private or guarded by threads_lock.
+ */
+static void add_map_counters(hashmap_counters *to, hashmap_counters *from) {
+    to->lookups += LOAD(from->lookups);
+    to->probes += LOAD(from->probes);
+    to->rehashes += LOAD(from->rehashes);
+    to->rehash_ns += LOAD(from->rehash_ns);
+    to->entries += LOAD(from->entries);
+    to->slots += LOAD(from->slots);
+}
+
+static void add_stats(ThreadStats *to, ThreadStats *from) {
+    int op, i;
+    for (op = 0; op < STATS_OPS; op++) {
+        to->ops[op].count += LOAD(from->ops[op].count);
+        to->ops[op].errors += LOAD(from->ops[op].errors);
+        to->ops[op].total_ns += LOAD(from->ops[op].total_ns);
+        for (i = 0; i < STATS_BUCKETS; i++) {
+            to->ops[op].buckets[i] += LOAD(from->ops[op].buckets[i]);
+        }
+    }
+    add_map_counters(&to->map, &from->map);
+}
+
+static void thread_exit(void *arg) {
+    ThreadStats *stats = arg;
+    ThreadStats **link;
+
+    hashmap_thread_counters = NULL;
+    current = NULL;
+    pthread_mutex_lock(&threads_lock);
+    add_stats(&retired, stats);
+    for (link = &threads; *link != stats; link = &(*link)->next) {
+    }
+    *link = stats->next;
+    pthread_mutex_unlock(&threads_lock);
+    free(stats);
+}
+
+static void create_exit_key() {
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+/*
+ * Give the calling thread its block. If memory runs out the thread just
+ * goes uncounted.
+ */
+static void register_thread() {
+    ThreadStats *stats = calloc(1, sizeof(ThreadStats));
+    if (stats == NULL) {
+        return;
+    }
+    pthread_once(&exit_once, create_exit_key);
+    pthread_mutex_lock(&threads_lock);
+    stats->next = threads;
+    threads = stats;
+    pthread_mutex_unlock(&threads_lock);
+    pthread_setspecific(exit_key, stats);
+    hashmap_thread_counters = &stats->map;
+    current = stats;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t stats_start() {
+    if (current == NULL) {
+        register_thread();
+    }
+    return now_ns();
+}
+
+uint64_t stats_end(StatsOp op, uint64_t start, int result) {
+    ThreadStats *stats = current;
+    uint64_t ns = now_ns() - start;
+    if (stats == NULL) {
+        return ns;
+    }
+    int bucket = ns <= 1 ? 0 : 64 - __builtin_clzll(ns - 1);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    OpCounters *counters = &stats->ops[op];
+    ADD(counters->count, 1);
+    ADD(counters->errors, result < 0);
+    ADD(counters->total_ns, ns);
+    ADD(counters->buckets[bucket], 1);
+    return ns;
+}
+
+const char *stats_op_name(StatsOp op) {
+    return op < STATS_OPS ? op_names[op] : "unknown";
+}
+
+void stats_printf(StatsText *text, const char *format, ...) {
+    va_list ap;
+    int n;
+
+    if (text->data == NULL && text->capacity != 0) {
+        return;
+    }
+    for (;;) {
+        size_t room = text->capacity - text->length;
+        va_start(ap, format);
+        n = vsnprintf(text->data == NULL ? NULL : text->data + text->length, room, format, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t) n < room) {
+            text->length += n;
+            return;
+        }
+        size_t capacity = text->capacity == 0 ? 4096 : text->capacity;
+        while (capacity <= text->length + n) {
+            capacity *= 2;
+        }
+        char *data = realloc(text->data, capacity);
+        if (data == NULL) {
+            free(text->data);
+            text->data = NULL;
+            text->length = 0;
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+void stats_metric(StatsText *text, const char *type, const char *name, unsigned long value) {
+    stats_printf(text, "# TYPE %s %s\n%s %lu\n", name, type, name, value);
+}
+
+void stats_render(StatsText *text) {
+    ThreadStats sum, *total = &sum, *stats;
+    int op, i;
+
+    memset(total, 0, sizeof(ThreadStats));
+    pthread_mutex_lock(&threads_lock);
+    add_stats(total, &retired);
+    for (stats = threads; stats != NULL; stats = stats->next) {
+        add_stats(total, stats);
+    }
+    pthread_mutex_unlock(&threads_lock);
+    add_map_counters(&total->map, &hashmap_shared_counters);
+
+    stats_printf(text, "# TYPE xyfs_op_latency_ns histogram\n");
+    for (op = 0; op < STATS_OPS; op++) {
+        OpCounters *counters = &total->ops[op];
+        unsigned long cumulative = 0;
+        if (counters->count == 0) {
+            continue;
+        }
+        for (i = 0; i < STATS_BUCKETS - 1; i++) {
+            cumulative += counters->buckets[i];
+            stats_printf(text, "xyfs_op_latency_ns_bucket{op=\"%s\",le=\"%llu\"} %lu\n", op_names[op],
+                         1ULL << i, cumulative);
+        }
+        stats_printf(text, "xyfs_op_latency_ns_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", op_names[op], counters->count);
+        stats_printf(text, "xyfs_op_latency_ns_sum{op=\"%s\"} %llu\n", op_names[op],
+                     (unsigned long long) counters->total_ns);
+        stats_printf(text, "xyfs_op_latency_ns_count{op=\"%s\"} %lu\n", op_names[op], counters->count);
+    }
+    stats_printf(text, "# TYPE xyfs_op_errors_total counter\n");
+    for (op = 0; op < STATS_OPS; op++) {
+        if (total->ops[op].count != 0) {
+            stats_printf(text, "xyfs_op_errors_total{op=\"%s\"} %lu\n", op_names[op], total->ops[op].errors);
+        }
+    }
+
+    hashmap_counters *map = &total->map;
+    stats_metric(text, "counter", "xyfs_hashmap_lookups_total", map->lookups);
+    stats_metric(text, "counter", "xyfs_hashmap_probes_total", map->probes);
+    stats_metric(text, "counter", "xyfs_hashmap_rehashes_total", map->rehashes);
+    stats_metric(text, "counter", "xyfs_hashmap_rehash_ns_total", map->rehash_ns);
+    /* Blocks are read one at a time, so a sum can be a little behind or
+     * ahead of itself; never let it go below zero. */
+    stats_metric(text, "gauge", "xyfs_hashmap_entries", map->entries > 0 ? map->entries : 0);
+    stats_metric(text, "gauge", "xyfs_hashmap_slots", map->slots > 0 ? map->slots : 0);
+    stats_printf(text, "# TYPE xyfs_hashmap_load gauge\nxyfs_hashmap_load %.4f\n",
+                 map->slots > 0 && map->entries > 0 ? (double) map->entries / map->slots : 0.0);
+}
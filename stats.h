@@ -0,0 +1,83 @@
+//
+// Per-operation counters and latency histograms, and the text they are
+// read out as.
+//
+
+#ifndef XYFS_STATS_H
+#define XYFS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_BUCKETS 40
+#define STATS_FILE_NAME ".xyfs-stats"
+
+/*
+ * Operations timed by either engine. Each engine counts its own
+ * callbacks, so an operation only one of them has stays at zero under
+ * the other.
+ */
+typedef enum stats_op
+{
+    STATS_GETATTR,
+    STATS_SETATTR,
+    STATS_LOOKUP,
+    STATS_FORGET,
+    STATS_OPEN,
+    STATS_RELEASE,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_CREATE,
+    STATS_MKDIR,
+    STATS_UNLINK,
+    STATS_RMDIR,
+    STATS_RENAME,
+    STATS_OPENDIR,
+    STATS_READDIR,
+    STATS_RELEASEDIR,
+    STATS_TRUNCATE,
+    STATS_FALLOCATE,
+    STATS_UTIME,
+    STATS_OPS
+} StatsOp;
+
+/*
+ * A growing text buffer. data is NUL-terminated and malloc'd, or NULL if
+ * memory ran out along the way.
+ */
+typedef struct stats_text
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} StatsText;
+
+/*
+ * Time an operation: stats_end(op, stats_start(), result) counts one op
+ * with result < 0 as an error, adds its latency to op's histogram and
+ * returns the latency.
+ * Counters live in a block of the calling thread's own, made on its
+ * first call, so neither takes a lock or contends with other threads.
+ */
+extern uint64_t stats_start();
+extern uint64_t stats_end(StatsOp op, uint64_t start, int result);
+
+extern const char *stats_op_name(StatsOp op);
+
+extern void stats_printf(StatsText *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Append one sample of a metric with no labels, with its TYPE line; type
+ * is "counter" or "gauge".
+ */
+extern void stats_metric(StatsText *text, const char *type, const char *name, unsigned long value);
+
+/*
+ * Append every op's count, errors and histogram and the hashmap totals in
+ * the Prometheus text format: one "name{labels} value" sample per line,
+ * histogram buckets cumulative with le in nanoseconds. Ops never called
+ * are left out.
+ */
+extern void stats_render(StatsText *text);
+
+#endif //XYFS_STATS_H
@@ -0,0 +1,283 @@
+/*
+ * Read a trace dump (see trace.c) and report where the time went.
+ *
+ * Prints the operations that were still running when the dump was
+ * taken, longest first; the paths that took the most time across all
+ * recorded operations, with counts, errors, bytes and the slowest one;
+ * and a per-operation summary. With --timeline it also lists every
+ * recorded operation from all threads in start order, relative to the
+ * first one.
+ *
+ * usage: xyfs_trace [--top N] [--timeline] DUMP
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct record
+{
+    int active;
+    unsigned int thread;
+    unsigned long long start;
+    unsigned long long ns;
+    char op[16];
+    unsigned long ino;
+    unsigned long long offset;
+    unsigned int size;
+    int result;
+} Record;
+
+typedef struct path_entry
+{
+    unsigned long ino;
+    char *path;
+} PathEntry;
+
+/* Totals for one inode or one operation. */
+typedef struct total
+{
+    const char *key;
+    unsigned long ino;
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long ns;
+    unsigned long long max_ns;
+    unsigned long long bytes;
+} Total;
+
+static Record *records;
+static size_t record_count, record_capacity;
+static PathEntry *paths;
+static size_t path_count, path_capacity;
+static unsigned long long dump_time;
+
+static void *grow(void *array, size_t *capacity, size_t size) {
+    *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+    void *grown = realloc(array, *capacity * size);
+    if (grown == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return grown;
+}
+
+static int read_dump(FILE *in) {
+    char line[8192];
+    int version;
+    if (fgets(line, sizeof(line), in) == NULL || sscanf(line, "xyfs-trace %d %llu", &version, &dump_time) != 2) {
+        return -1;
+    }
+    if (version != 1) {
+        fprintf(stderr, "unknown dump version %d\n", version);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (record_count == record_capacity) {
+            records = grow(records, &record_capacity, sizeof(Record));
+        }
+        Record *r = &records[record_count];
+        memset(r, 0, sizeof(*r));
+        if (sscanf(line, "op %u %llu %llu %15s %lu %llu %u %d", &r->thread, &r->start, &r->ns, r->op, &r->ino,
+                   &r->offset, &r->size, &r->result) == 8) {
+            record_count++;
+        } else if (sscanf(line, "active %u %llu %15s %lu %llu %u", &r->thread, &r->start, r->op, &r->ino,
+                          &r->offset, &r->size) == 6) {
+            r->active = 1;
+            r->ns = dump_time > r->start ? dump_time - r->start : 0;
+            record_count++;
+        } else if (strncmp(line, "path ", 5) == 0) {
+            char *end;
+            unsigned long ino = strtoul(line + 5, &end, 10);
+            if (*end != ' ') {
+                continue;
+            }
+            end[strcspn(end, "\n")] = '\0';
+            if (path_count == path_capacity) {
+                paths = grow(paths, &path_capacity, sizeof(PathEntry));
+            }
+            paths[path_count].ino = ino;
+            paths[path_count++].path = strdup(end + 1);
+        }
+    }
+    return 0;
+}
+
+static int compare_path(const void *a, const void *b) {
+    unsigned long x = ((const PathEntry *) a)->ino, y = ((const PathEntry *) b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+static const char *path_of(unsigned long ino) {
+    static char unnamed[32];
+    PathEntry key = {ino, NULL};
+    PathEntry *found = bsearch(&key, paths, path_count, sizeof(PathEntry), compare_path);
+    if (found != NULL) {
+        return found->path;
+    }
+    snprintf(unnamed, sizeof(unnamed), ino == 0 ? "-" : "<inode %lu>", ino);
+    return unnamed;
+}
+
+static int compare_start(const void *a, const void *b) {
+    unsigned long long x = ((const Record *) a)->start, y = ((const Record *) b)->start;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_longest(const void *a, const void *b) {
+    unsigned long long x = ((const Record *) a)->ns, y = ((const Record *) b)->ns;
+    return x > y ? -1 : x < y;
+}
+
+static int compare_total(const void *a, const void *b) {
+    unsigned long long x = ((const Total *) a)->ns, y = ((const Total *) b)->ns;
+    return x > y ? -1 : x < y;
+}
+
+static int compare_ino(const void *a, const void *b) {
+    unsigned long x = ((const Record *) a)->ino, y = ((const Record *) b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+static void add(Total *total, const Record *r) {
+    total->count++;
+    total->errors += r->result < 0;
+    total->ns += r->ns;
+    total->bytes += r->size;
+    if (r->ns > total->max_ns) {
+        total->max_ns = r->ns;
+    }
+}
+
+static void report_active(Record *active, size_t count) {
+    size_t i;
+    printf("in flight at the dump: %zu\n", count);
+    qsort(active, count, sizeof(Record), compare_longest);
+    for (i = 0; i < count; i++) {
+        Record *r = &active[i];
+        printf("  %10.3f ms  thread %u  %-11s %s", r->ns / 1e6, r->thread, r->op, path_of(r->ino));
+        if (r->size > 0 || r->offset > 0) {
+            printf("  offset %llu size %u", r->offset, r->size);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Group the finished records (which this sorts) by inode.
+ */
+static void report_paths(Record *done, size_t count, size_t top) {
+    Total *totals = calloc(count + 1, sizeof(Total));
+    size_t n = 0, i;
+    qsort(done, count, sizeof(Record), compare_ino);
+    for (i = 0; i < count; i++) {
+        if (i == 0 || done[i].ino != done[i - 1].ino) {
+            totals[n++].ino = done[i].ino;
+        }
+        add(&totals[n - 1], &done[i]);
+    }
+    qsort(totals, n, sizeof(Total), compare_total);
+    printf("\nhot paths by total time (%zu of %zu):\n", n < top ? n : top, n);
+    printf("  %12s %8s %7s %12s %12s  %s\n", "total ms", "ops", "errors", "max ms", "bytes", "path");
+    for (i = 0; i < n && i < top; i++) {
+        printf("  %12.3f %8lu %7lu %12.3f %12llu  %s\n", totals[i].ns / 1e6, totals[i].count, totals[i].errors,
+               totals[i].max_ns / 1e6, totals[i].bytes, path_of(totals[i].ino));
+    }
+    free(totals);
+}
+
+static void report_ops(const Record *done, size_t count) {
+    Total totals[64];
+    size_t n = 0, i, j;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < n && strcmp(totals[j].key, done[i].op) != 0; j++) {
+        }
+        if (j == n) {
+            if (n == sizeof(totals) / sizeof(totals[0])) {
+                continue;
+            }
+            memset(&totals[n], 0, sizeof(Total));
+            totals[n++].key = done[i].op;
+        }
+        add(&totals[j], &done[i]);
+    }
+    qsort(totals, n, sizeof(Total), compare_total);
+    printf("\noperations:\n");
+    printf("  %-12s %8s %7s %12s %12s %12s\n", "op", "ops", "errors", "total ms", "mean us", "max ms");
+    for (i = 0; i < n; i++) {
+        printf("  %-12s %8lu %7lu %12.3f %12.2f %12.3f\n", totals[i].key, totals[i].count, totals[i].errors,
+               totals[i].ns / 1e6, totals[i].ns / 1e3 / totals[i].count, totals[i].max_ns / 1e6);
+    }
+}
+
+static void report_timeline(Record *done, size_t count) {
+    size_t i;
+    qsort(done, count, sizeof(Record), compare_start);
+    printf("\ntimeline:\n");
+    for (i = 0; i < count; i++) {
+        Record *r = &done[i];
+        printf("  %12.3f ms  thread %-7u %-11s %10.2f us  %s", (r->start - done[0].start) / 1e6, r->thread, r->op,
+               r->ns / 1e3, path_of(r->ino));
+        if (r->size > 0 || r->offset > 0) {
+            printf("  offset %llu size %u", r->offset, r->size);
+        }
+        if (r->result < 0) {
+            printf("  error %d", -r->result);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t top = 20;
+    int timeline = 0, i;
+    const char *file = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--timeline") == 0) {
+            timeline = 1;
+        } else if (file == NULL && argv[i][0] != '-') {
+            file = argv[i];
+        } else {
+            file = NULL;
+            break;
+        }
+    }
+    if (file == NULL) {
+        fprintf(stderr, "usage: %s [--top N] [--timeline] DUMP\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(file, "r");
+    if (in == NULL) {
+        perror(file);
+        return 1;
+    }
+    if (read_dump(in) != 0) {
+        fprintf(stderr, "%s: not a trace dump\n", file);
+        return 1;
+    }
+    fclose(in);
+    qsort(paths, path_count, sizeof(PathEntry), compare_path);
+
+    /* Running operations first, then the finished ones. */
+    size_t done = 0;
+    Record *active = malloc((record_count + 1) * sizeof(Record));
+    size_t active_count = 0, j;
+    for (j = 0; j < record_count; j++) {
+        if (records[j].active) {
+            active[active_count++] = records[j];
+        } else {
+            records[done++] = records[j];
+        }
+    }
+
+    report_active(active, active_count);
+    report_paths(records, done, top);
+    report_ops(records, done);
+    if (timeline) {
+        report_timeline(records, done);
+    }
+    free(active);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * Operation trace.
+ *
+ * Every thread that runs operations writes them into a ring of its own,
+ * so recording one is a handful of stores with no lock and no shared
+ * cache line. When a thread exits its ring is kept, records and all, for
+ * the next thread to take over, so the number of rings stays at the
+ * number of threads ever running at once.
+ *
+ * The dump is text, one item per line:
+ *
+ *   xyfs-trace <version> <now>
+ *   op <thread> <start> <ns> <op> <ino> <offset> <size> <result>
+ *   active <thread> <start> <op> <ino> <offset> <size>
+ *   path <ino> <path>
+ *
+ * with times in CLOCK_MONOTONIC nanoseconds. op lines are the finished
+ * operations still in the rings, active lines those running when the
+ * dump was taken, and path lines name every node they mention that is
+ * still in the tree.
+ */
+#ifdef XYFS_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+__thread TraceRing *trace_ring;
+static __thread uint32_t thread_id;
+
+static TraceRing *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exit_key;
+static unsigned long capacity;     /* records per ring, 0 until trace_start */
+
+static char *dump_path;
+static int (*dump_path_of)(unsigned long ino, char *buf, size_t size);
+static sem_t dump_wakeup;
+static pthread_t dump_thread;
+static int dump_stop;
+
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void give_back_ring(void *arg) {
+    TraceRing *ring = arg;
+    trace_ring = NULL;
+    pthread_mutex_lock(&rings_lock);
+    ring->in_use = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+/*
+ * Take over a ring a thread left behind, or make one. Returns NULL when
+ * out of memory; the thread then goes untraced.
+ */
+static TraceRing *take_ring() {
+    TraceRing *ring;
+    pthread_mutex_lock(&rings_lock);
+    for (ring = rings; ring != NULL && ring->in_use; ring = ring->next) {
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(TraceRing) + capacity * sizeof(TraceRecord));
+        if (ring == NULL) {
+            pthread_mutex_unlock(&rings_lock);
+            return NULL;
+        }
+        ring->mask = capacity - 1;
+        ring->next = rings;
+        rings = ring;
+    }
+    ring->in_use = 1;
+    pthread_mutex_unlock(&rings_lock);
+
+    thread_id = (uint32_t) syscall(SYS_gettid);
+    pthread_setspecific(exit_key, ring);
+    trace_ring = ring;
+    return ring;
+}
+
+void trace_begin(StatsOp op, uint64_t start, uint64_t offset, size_t size) {
+    TraceRing *ring = trace_ring;
+    if (ring == NULL) {
+        if (__atomic_load_n(&capacity, __ATOMIC_ACQUIRE) == 0 || (ring = take_ring()) == NULL) {
+            return;
+        }
+    }
+    STORE(ring->active.op, op);
+    STORE(ring->active.offset, offset);
+    STORE(ring->active.size, size > UINT32_MAX ? UINT32_MAX : (uint32_t) size);
+    STORE(ring->active.ino, 0);
+    STORE(ring->active.thread, thread_id);
+    __atomic_store_n(&ring->active.start, start, __ATOMIC_RELEASE);
+}
+
+void trace_end(uint64_t ns, int result) {
+    TraceRing *ring = trace_ring;
+    if (ring == NULL) {
+        return;
+    }
+    unsigned long head = ring->head;
+    TraceRecord *record = &ring->records[head & ring->mask];
+    STORE(record->start, ring->active.start);
+    STORE(record->ns, ns);
+    STORE(record->offset, ring->active.offset);
+    STORE(record->ino, ring->active.ino);
+    STORE(record->size, ring->active.size);
+    STORE(record->thread, thread_id);
+    STORE(record->op, ring->active.op);
+    STORE(record->result, (int16_t) result);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    STORE(ring->active.start, 0);
+}
+
+static void copy_record(TraceRecord *to, TraceRecord *from) {
+    to->start = LOAD(from->start);
+    to->ns = LOAD(from->ns);
+    to->offset = LOAD(from->offset);
+    to->ino = LOAD(from->ino);
+    to->size = LOAD(from->size);
+    to->thread = LOAD(from->thread);
+    to->op = LOAD(from->op);
+    to->result = LOAD(from->result);
+}
+
+/*
+ * Copy ring's records oldest first to out, which has room for capacity
+ * of them, and return how many are left once those overwritten during
+ * the copy are dropped.
+ */
+static unsigned long copy_ring(TraceRing *ring, TraceRecord *out) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > capacity ? head - capacity : 0;
+    unsigned long i;
+    for (i = first; i < head; i++) {
+        copy_record(&out[i - first], &ring->records[i & ring->mask]);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    /* The writer may be filling in record after by now, and has
+     * overwritten every one up to after - capacity. */
+    unsigned long after = LOAD(ring->head);
+    unsigned long valid = after >= capacity ? after - capacity + 1 : 0;
+    if (valid > first) {
+        unsigned long lost = valid > head ? head - first : valid - first;
+        memmove(out, out + lost, (head - first - lost) * sizeof(TraceRecord));
+        first += lost;
+    }
+    return head - first;
+}
+
+static int compare_ino(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Copy every ring, then write them out with the lock dropped, so threads
+ * starting meanwhile are not held up by the file.
+ */
+static void dump() {
+    TraceRing *ring;
+    unsigned long count = 0, rings_count = 0, n, i;
+
+    pthread_mutex_lock(&rings_lock);
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        rings_count++;
+    }
+    TraceRecord *records = malloc(rings_count * (capacity + 1) * sizeof(TraceRecord));
+    if (records == NULL) {
+        pthread_mutex_unlock(&rings_lock);
+        fprintf(stderr, "trace: out of memory for the dump\n");
+        return;
+    }
+    unsigned long active = rings_count * capacity;
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        count += copy_ring(ring, records + count);
+    }
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t start = __atomic_load_n(&ring->active.start, __ATOMIC_ACQUIRE);
+        if (start != 0) {
+            copy_record(&records[active], &ring->active);
+            /* Keep it only if the operation did not end while copied. */
+            active += records[active].start == start;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    unsigned long active_first = rings_count * capacity;
+
+    FILE *out = fopen(dump_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "trace: cannot write %s: %s\n", dump_path, strerror(errno));
+        free(records);
+        return;
+    }
+    fprintf(out, "xyfs-trace %d %llu\n", TRACE_VERSION, (unsigned long long) now_ns());
+    for (i = 0; i < count; i++) {
+        TraceRecord *r = &records[i];
+        fprintf(out, "op %u %llu %llu %s %lu %llu %u %d\n", r->thread, (unsigned long long) r->start,
+                (unsigned long long) r->ns, stats_op_name(r->op), r->ino, (unsigned long long) r->offset, r->size,
+                r->result);
+    }
+    for (i = active_first; i < active; i++) {
+        TraceRecord *r = &records[i];
+        fprintf(out, "active %u %llu %s %lu %llu %u\n", r->thread, (unsigned long long) r->start,
+                stats_op_name(r->op), r->ino, (unsigned long long) r->offset, r->size);
+    }
+
+    /* Name each node once. */
+    unsigned long *inos = malloc((count + active - active_first + 1) * sizeof(unsigned long));
+    n = 0;
+    for (i = 0; inos != NULL && i < count; i++) {
+        inos[n++] = records[i].ino;
+    }
+    for (i = active_first; inos != NULL && i < active; i++) {
+        inos[n++] = records[i].ino;
+    }
+    qsort(inos, n, sizeof(unsigned long), compare_ino);
+    char path[4096];
+    for (i = 0; inos != NULL && i < n; i++) {
+        if (inos[i] != 0 && (i == 0 || inos[i] != inos[i - 1]) && dump_path_of(inos[i], path, sizeof(path)) >= 0) {
+            fprintf(out, "path %lu %s\n", inos[i], path);
+        }
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "trace: cannot write %s: %s\n", dump_path, strerror(errno));
+    }
+    free(inos);
+    free(records);
+}
+
+static void *dump_loop(void *arg) {
+    for (;;) {
+        while (sem_wait(&dump_wakeup) != 0 && errno == EINTR) {
+        }
+        if (__atomic_load_n(&dump_stop, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        dump();
+    }
+}
+
+static void on_signal(int sig) {
+    sem_post(&dump_wakeup);
+}
+
+void trace_start(const char *path, unsigned int entries,
+                 int (*path_of)(unsigned long ino, char *buf, size_t size)) {
+    unsigned long size = 1;
+    while (size < entries) {
+        size *= 2;
+    }
+    dump_path = strdup(path);
+    dump_path_of = path_of;
+    pthread_key_create(&exit_key, give_back_ring);
+    sem_init(&dump_wakeup, 0, 0);
+    dump_stop = 0;
+    if (dump_path == NULL || pthread_create(&dump_thread, NULL, dump_loop, NULL) != 0) {
+        fprintf(stderr, "trace: cannot start\n");
+        free(dump_path);
+        return;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+    __atomic_store_n(&capacity, size, __ATOMIC_RELEASE);
+}
+
+/*
+ * Stop answering the signal and take a last dump. Threads keep recording
+ * into the rings they have.
+ */
+void trace_stop() {
+    if (capacity == 0) {
+        return;
+    }
+    signal(SIGUSR2, SIG_IGN);
+    __atomic_store_n(&dump_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&dump_wakeup);
+    pthread_join(dump_thread, NULL);
+    sem_destroy(&dump_wakeup);
+    dump();
+}
+
+#endif
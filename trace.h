@@ -0,0 +1,95 @@
+//
+// Per-thread ring of recent operations, dumped on SIGUSR2 for
+// tools/xyfs_trace.
+//
+
+#ifndef XYFS_TRACE_H
+#define XYFS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+#define TRACE_VERSION 1
+
+#ifdef XYFS_TRACE
+
+/*
+ * One operation. start is CLOCK_MONOTONIC in ns, like stats_start; ino is
+ * the node it acted on, 0 if it never found one.
+ */
+typedef struct trace_record
+{
+    uint64_t start;
+    uint64_t ns;
+    uint64_t offset;
+    unsigned long ino;
+    uint32_t size;
+    uint32_t thread;    /* kernel thread id */
+    uint16_t op;        /* StatsOp */
+    int16_t result;     /* 0 or -errno */
+} TraceRecord;
+
+/*
+ * A thread's ring. Only the owner writes it: a record is filled in, then
+ * head is advanced with a release store, so the dump can copy the ring
+ * without stopping anyone and drop the records that were overwritten
+ * while it did. active is the operation in progress, valid while its
+ * start is not 0.
+ */
+typedef struct trace_ring
+{
+    struct trace_ring *next;
+    int in_use;                 /* by a live thread; guarded by the ring list lock */
+    TraceRecord active;
+    unsigned long head;         /* records ever written */
+    unsigned long mask;
+    TraceRecord records[];
+} TraceRing;
+
+extern __thread TraceRing *trace_ring;
+
+/*
+ * Time an operation into the calling thread's ring, taking one on the
+ * first call. trace_begin is passed stats_start()'s timestamp and
+ * trace_end the latency stats_end measured, so tracing reads no clock of
+ * its own. Neither does anything unless trace_start has been called.
+ */
+extern void trace_begin(StatsOp op, uint64_t start, uint64_t offset, size_t size);
+extern void trace_end(uint64_t ns, int result);
+
+/*
+ * Name the node the operation in progress acts on.
+ */
+#define trace_node(node) trace_ino((node)->ino)
+#define trace_ino(number) do { \
+    TraceRing *ring_ = trace_ring; \
+    if (ring_ != NULL) \
+        __atomic_store_n(&ring_->active.ino, (number), __ATOMIC_RELAXED); \
+} while (0)
+
+/*
+ * Give every thread a ring of entries records, rounded up to a power of
+ * two, and dump them all to path on SIGUSR2 and again at trace_stop.
+ * SIGUSR1 stays with snapshot_start. path_of writes a node's path into
+ * buf, returning its length or -1 when the node is gone; it is called
+ * from the dump thread.
+ */
+extern void trace_start(const char *path, unsigned int entries,
+                        int (*path_of)(unsigned long ino, char *buf, size_t size));
+extern void trace_stop();
+
+#else
+
+/* Compiled out: every hook is empty, though trace_end's latency is still
+ * worked out since it comes from stats_end. */
+#define trace_begin(op, start, offset, size) ((void) 0)
+#define trace_end(ns, result) ((void) (ns))
+#define trace_node(node) ((void) 0)
+#define trace_ino(number) ((void) 0)
+#define trace_start(path, entries, path_of) ((void) 0)
+#define trace_stop() ((void) 0)
+
+#endif
+
+#endif //XYFS_TRACE_H
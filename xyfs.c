@@ -6,380 +6,2147 @@
 #include <time.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <alloca.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/falloc.h>
 #include "hashmap.h"
 
 #include <fuse.h>
 
 #include "xyfs.h"
+#include "ramdisk.h"
+#include "dcache.h"
+#include "inode.h"
+#include "epoch.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "dedup.h"
+#include "cold.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Set in fi->fh of the stats file's handles, see open_stats. */
+#define STATS_HANDLE 1
 
 Node *root;
+pthread_rwlock_t rename_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Take a reference on node. The caller must already know the node is
+ * alive: it holds a reference, or the lock of a directory linking it.
+ */
+void get_node(Node *node) {
+    __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take a reference on a node found without any lock, unless its last
+ * reference is already gone. Returns 0 in that case. The caller must be
+ * in an epoch read section so the node's memory stays valid.
+ */
+int get_node_unless_zero(Node *node) {
+    int count = __atomic_load_n(&node->refcount, __ATOMIC_RELAXED);
+    while (count != 0) {
+        if (__atomic_compare_exchange_n(&node->refcount, &count, count + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
+/*
+ * Resolve path to a referenced node, or NULL. Directories are walked with
+ * lock coupling: a child's lock is taken before its parent's is dropped,
+ * so nothing on the walk can be unlinked underneath it.
+ */
 Node *get_node_by_path(const char *path) {
+    if (strcmp(path, "/") == 0) {
+        get_node(root);
+        trace_node(root);
+        return root;
+    }
+    unsigned long generation = dcache_generation();
+    Node *cached = dcache_lookup(path);
+    if (cached != NULL) {
+        trace_node(cached);
+        return cached;
+    }
+
     char _path[MAX_PATH_LENGTH];
     strcpy(_path, path);
+    char *saveptr;
+    char *splited_path = strtok_r(_path, "/", &saveptr);
     Node *node = root;
-    if (strcmp(path, "/") == 0) {
-        return node;
-    }
-    char *splited_path = strtok(_path, "/");
-    Node *tmp_node;
+    pthread_rwlock_rdlock(&node->lock);
     while (splited_path != NULL) {
-        int msg = hashmap_get(node->_map, splited_path, (void **) (&tmp_node));
-        if (msg == MAP_OK) {
-            node = tmp_node;
-            splited_path = strtok(NULL, "/");
-        } else {
+        Node *tmp_node = get_child(node, splited_path);
+        if (tmp_node == NULL) {
+            pthread_rwlock_unlock(&node->lock);
             return NULL;
         }
+        splited_path = strtok_r(NULL, "/", &saveptr);
+        if (splited_path == NULL) {
+            /* Still under the parent's lock, so an unlink cannot slip in
+             * between resolving and caching. */
+            get_node(tmp_node);
+            dcache_insert(path, tmp_node, generation);
+            pthread_rwlock_unlock(&node->lock);
+            trace_node(tmp_node);
+            return tmp_node;
+        }
+        pthread_rwlock_rdlock(&tmp_node->lock);
+        pthread_rwlock_unlock(&node->lock);
+        node = tmp_node;
     }
-    return node;
+    pthread_rwlock_unlock(&node->lock);
+    return NULL;
 }
 
-int ramdisk_open(const char *path, struct fuse_file_info *fi) {
-    int result = 0;
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
-        result = -ENOENT;
+/*
+ * Open handles carry their Node in fi->fh, so the data path never walks
+ * the path again. Fall back to a lookup for callers without a handle.
+ * Pair with put_node_by_fi.
+ */
+Node *get_node_by_fi(const char *path, struct fuse_file_info *fi) {
+    if (fi != NULL && (fi->fh & STATS_HANDLE)) {
+        return NULL;
     }
-    return result;
+    if (fi != NULL && fi->fh != 0) {
+        Node *node = (Node *) (uintptr_t) fi->fh;
+        trace_node(node);
+        return node;
+    }
+    if (path == NULL) {
+        return NULL;
+    }
+    return get_node_by_path(path);
 }
 
-int ramdisk_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    int result = 0;
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
-        return -ENOENT;
+/*
+ * Drop the reference get_node_by_fi took, if it took one; a handle's
+ * own reference is only dropped by release.
+ */
+void put_node_by_fi(Node *node, struct fuse_file_info *fi) {
+    if (fi == NULL || fi->fh == 0) {
+        put_node(node);
     }
+}
 
-    if (node->type != FILE_NODE) {
-        return -EISDIR;
+/*
+ * A Node, its stat and its name are one slab object. The name is stored
+ * at its exact length, so the object's size class follows the name.
+ */
+typedef struct node_object
+{
+    Node node;
+    struct stat st;
+    char name[];
+} NodeObject;
+
+static size_t node_object_size(size_t name_len) {
+    return sizeof(NodeObject) + name_len + 1;
+}
+
+/*
+ * Allocate a node called name with a zeroed stat. Returns NULL when out
+ * of memory.
+ */
+static Node *alloc_node(const char *name) {
+    size_t len = strlen(name);
+    NodeObject *object = (NodeObject *) slab_alloc(node_object_size(len));
+    if (object == NULL) {
+        return NULL;
     }
+    memset(&object->st, 0, sizeof(struct stat));
+    memcpy(object->name, name, len + 1);
+    object->node.st = &object->st;
+    object->node.name = object->name;
+    object->node.image = NULL;
+    object->node.open_count = 0;
+    return &object->node;
+}
 
-    size_t content_size = node->st->st_size;
-    if (offset < content_size) {
-        if (offset + size > content_size) {
-            size = content_size - offset;
-        }
-        memcpy(buf, node->content + offset, size);
-    } else {
-        size = 0;
+/*
+ * The string to rename node to name with. A name other than the one the
+ * node was made with has a malloc of its own. Returns NULL when out of
+ * memory.
+ */
+static char *alloc_name(Node *node, const char *name) {
+    NodeObject *object = (NodeObject *) node;
+    if (strcmp(name, object->name) == 0) {
+        return object->name;
     }
+    return strdup(name);
+}
 
-    result = size;
-    return result;
+static void free_name(Node *node, char *name) {
+    if (name != ((NodeObject *) node)->name) {
+        free(name);
+    }
 }
 
-int ramdisk_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
-        return -ENOENT;
+static void free_node(void *arg) {
+    Node *node = (Node *) arg;
+    NodeObject *object = (NodeObject *) node;
+    content_free(&node->content);
+    children_free(&node->children);
+    pthread_rwlock_destroy(&node->lock);
+    if (node->name != object->name) {
+        /* Renamed, see alloc_name. */
+        free(node->name);
     }
+    slab_free(object, node_object_size(strlen(object->name)));
+}
 
-    if (node->type != FILE_NODE) {
-        return -EISDIR;
+/*
+ * Drop count references. The node is freed once it is neither linked into
+ * a directory, held open, nor remembered by the kernel, and no lock-free
+ * dcache reader can still be looking at it.
+ */
+void unref_node(Node *node, unsigned long count) {
+    if (__atomic_sub_fetch(&node->refcount, count, __ATOMIC_ACQ_REL) == 0) {
+        inode_free(node->ino);
+        epoch_retire(node, free_node);
     }
+}
 
-    size_t content_size = node->st->st_size;
-    if (content_size == 0) {
-        node->content = (char *) malloc(sizeof(char) * size);
-        offset = 0;
-        memcpy(node->content + offset, buf, size);
-        node->st->st_size = offset + size;
-    } else {
-        if (offset > content_size) {
-            offset = content_size;
+void put_node(Node *node) {
+    unref_node(node, 1);
+}
+
+/*
+ * Count an open handle. The handle's reference is taken separately.
+ */
+void open_node(Node *node) {
+    __atomic_add_fetch(&node->open_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Close a handle and drop its reference. After the last close no read
+ * reply can still point into the file's chunks, so that is when chunks
+ * cut from the file while it was open are freed, and with --dedup when
+ * its chunks go into the block store. A handle opened meanwhile has to
+ * take the node's lock to read, so checking again under it is enough.
+ */
+void release_node(Node *node) {
+    if (__atomic_sub_fetch(&node->open_count, 1, __ATOMIC_ACQ_REL) == 0 && node->type == FILE_NODE) {
+        pthread_rwlock_wrlock(&node->lock);
+        if (__atomic_load_n(&node->open_count, __ATOMIC_ACQUIRE) == 0) {
+            if (xyfs_config.dedup) {
+                content_dedup(&node->content);
+            } else {
+                content_release(&node->content);
+            }
         }
-        long new_size = offset + size;
-        char *new_content = (char *) realloc(node->content, sizeof(char) * new_size);
-        node->content = new_content;
-        memcpy(node->content + offset, buf, size);
-        node->st->st_size = new_size;
+        pthread_rwlock_unlock(&node->lock);
     }
-    time_t current_time;
-    time(&current_time);
-    node->st->st_mtime = current_time;
-
-    return size;
+    put_node(node);
 }
 
-int ramdisk_unlink(const char *path) {
-    int result = SUCCESS;
-    Node *node = get_node_by_path(path);
+/*
+ * Build the node for a snapshot record, linked under parent. Its own
+ * children stay in the image until it is looked at. Returns NULL if the
+ * record is damaged or there is no memory or inode number for it.
+ */
+static Node *node_from_image(Node *parent, const SnapshotNode *rec) {
+    const char *name = snapshot_name(rec);
+    const char *data = snapshot_data(rec);
+    if (name == NULL || data == NULL) {
+        return NULL;
+    }
+    Node *node = alloc_node(name);
     if (node == NULL) {
-        return -ENOENT;
+        return NULL;
     }
-    Node *parent_dir = node->parent_dir;
-    hashmap_remove(parent_dir->_map, node->name);
+    node->st->st_mode = rec->mode;
+    node->st->st_nlink = rec->nlink;
+    node->st->st_uid = rec->uid;
+    node->st->st_gid = rec->gid;
+    node->st->st_size = rec->size;
+    node->st->st_atime = rec->atime;
+    node->st->st_mtime = rec->mtime;
+    node->st->st_ctime = rec->ctime;
+    node->parent_dir = parent;
+    node->type = rec->type == DERICTORY_NODE ? DERICTORY_NODE : FILE_NODE;
+    children_init(&node->children);
+    content_init(&node->content);
+    if (node->type == DERICTORY_NODE) {
+        node->image = rec->child_count > 0 ? rec : NULL;
+    } else if (rec->data_size > 0) {
+        content_init_image(&node->content, data, rec->data_size);
+    }
+    node->refcount = 1;
+    pthread_rwlock_init(&node->lock, NULL);
+    node->ino = inode_alloc(node);
+    if (node->ino == 0) {
+        free_node(node);
+        return NULL;
+    }
+    node->st->st_ino = node->ino;
+    return node;
+}
 
-    size_t old_size = parent_dir->st->st_size;
-    long updated_size = old_size;
-    if (node->st->st_size != 0) {
-        updated_size = updated_size - node->st->st_size;
-        free(node->content);
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Return dir's children, first turning the records of a directory restored
+ * from a snapshot into Nodes. The caller holds dir's lock, for reading or
+ * writing: with a read lock other readers may race to here, so the first
+ * one fills the table under image_lock and publishes it by clearing
+ * dir->image, and nobody reads children before seeing that.
+ */
+Children *get_children(Node *dir) {
+    if (__atomic_load_n(&dir->image, __ATOMIC_ACQUIRE) == NULL) {
+        return &dir->children;
+    }
+    pthread_mutex_lock(&image_lock);
+    const SnapshotNode *rec = dir->image;
+    if (rec != NULL) {
+        uint64_t i;
+        for (i = 0; i < rec->child_count; i++) {
+            const SnapshotNode *child_rec = snapshot_child(rec, i);
+            Node *child = child_rec == NULL ? NULL : node_from_image(dir, child_rec);
+            if (child == NULL) {
+                fprintf(stderr, "snapshot: dropping entry %lu of %s\n", (unsigned long) i, dir->name);
+                continue;
+            }
+            if (children_add(&dir->children, child) != 0) {
+                inode_free(child->ino);
+                free_node(child);
+            }
+        }
+        /* Nobody else reads the table yet, and nothing may write to it
+         * again to finish a rebuild the fill left behind. */
+        children_settle(&dir->children);
+        __atomic_store_n(&dir->image, NULL, __ATOMIC_RELEASE);
     }
-    free(node->name);
-    free(node->st);
-    free(node);
+    pthread_mutex_unlock(&image_lock);
+    return &dir->children;
+}
 
-    long size_of_file = sizeof(Node) + sizeof(struct stat);
-    updated_size = updated_size - size_of_file;
-    if (updated_size < 0)
-        updated_size = 0;
-    parent_dir->st->st_size = updated_size;
+/*
+ * Find name in a directory. Returns NULL if it is missing or dir is not a
+ * directory. The caller holds dir's lock.
+ */
+Node *get_child(Node *dir, const char *name) {
+    if (dir->type != DERICTORY_NODE) {
+        return NULL;
+    }
+    return children_get(get_children(dir), name);
+}
 
-    return result;
+/*
+ * Finish a rebuild of dir's entry table that has stalled: lookups and
+ * listings never move slots, so a directory that stops changing midway
+ * would otherwise probe two tables on every miss from then on. The caller
+ * holds a reference on dir but none of its locks, and checked
+ * children_stalled under the read lock.
+ */
+void settle_children(Node *dir) {
+    pthread_rwlock_wrlock(&dir->lock);
+    children_settle(&dir->children);
+    pthread_rwlock_unlock(&dir->lock);
 }
 
-int ramdisk_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    char _path[MAX_PATH_LENGTH];
-    strcpy(_path, path);
-    char dir_path[MAX_PATH_LENGTH];
+DirHandle *open_dir(Node *dir) {
+    DirHandle *handle = (DirHandle *) calloc(1, sizeof(DirHandle));
+    if (handle == NULL) {
+        return NULL;
+    }
+    get_node(dir);
+    handle->dir = dir;
+    handle->count = -1;
+    return handle;
+}
 
-    char *last_slash = strrchr(_path, '/');
-    char *file_name = last_slash + 1;
-    *last_slash = 0;
+static void unload_dir(DirHandle *handle) {
+    int i;
+    for (i = 0; i < handle->count; i++) {
+        put_node(handle->nodes[i]);
+    }
+    free(handle->nodes);
+    free(handle->names);
+    free(handle->name_data);
+    handle->nodes = NULL;
+    handle->names = NULL;
+    handle->name_data = NULL;
+    handle->count = -1;
+}
 
-    if (strlen(_path) == 0) {
-        strcpy(dir_path, "/");
-    } else {
-        strcpy(dir_path, _path);
+/*
+ * Take a fresh listing of the directory. Locks the directory for reading,
+ * once for the whole pass, so the listing is a consistent picture of it.
+ * This costs a pass over every child, a copy of its name and a reference
+ * on it, dropping those of the last listing, each time a reader starts
+ * from offset 0: rewinding a large directory repeatedly pays that each
+ * time, even if the directory has not changed. A listing left probing a
+ * stalled rebuild of the entry table finishes it afterwards.
+ */
+int load_dir(DirHandle *handle) {
+    Node *dir = handle->dir;
+    unload_dir(handle);
+
+    pthread_rwlock_rdlock(&dir->lock);
+    Children *children = get_children(dir);
+    int count = children_count(children) + 2;
+    Node **nodes = (Node **) malloc(count * sizeof(Node *));
+    char **names = (char **) malloc(count * sizeof(char *));
+    if (nodes == NULL || names == NULL) {
+        pthread_rwlock_unlock(&dir->lock);
+        free(nodes);
+        free(names);
+        return -ENOMEM;
     }
+    nodes[0] = dir;
+    nodes[1] = dir->parent_dir != NULL ? dir->parent_dir : dir;
+    count = children_nodes(children, nodes + 2) + 2;
 
-    Node *node = get_node_by_path(dir_path);
-    if (node == NULL) {
-        return -ENOENT;
+    size_t bytes = sizeof(".") + sizeof("..");
+    int i;
+    for (i = 2; i < count; i++) {
+        bytes += strlen(nodes[i]->name) + 1;
+    }
+    char *name_data = (char *) malloc(bytes);
+    if (name_data == NULL) {
+        pthread_rwlock_unlock(&dir->lock);
+        free(nodes);
+        free(names);
+        return -ENOMEM;
+    }
+    char *next = name_data;
+    for (i = 0; i < count; i++) {
+        const char *name = i == 0 ? "." : i == 1 ? ".." : nodes[i]->name;
+        size_t len = strlen(name) + 1;
+        memcpy(next, name, len);
+        names[i] = next;
+        next += len;
+        get_node(nodes[i]);
+    }
+    int stalled = children_stalled(children);
+    pthread_rwlock_unlock(&dir->lock);
+    if (stalled) {
+        settle_children(dir);
     }
 
-    Node *tmp_node;
-    int msg = hashmap_get(node->_map, file_name, (void **) (&tmp_node));
-    if (msg == MAP_OK) {
-        return -EEXIST;
+    handle->nodes = nodes;
+    handle->names = names;
+    handle->name_data = name_data;
+    handle->count = count;
+    return SUCCESS;
+}
+
+void close_dir(DirHandle *handle) {
+    unload_dir(handle);
+    put_node(handle->dir);
+    free(handle);
+}
+
+/*
+ * rename_node changes the names and parent links above every node in the
+ * subtree it moves, without the locks of those nodes. Whoever builds a
+ * path takes names_lock for reading, innermost, to keep them still. A
+ * rename holds it for writing while it relinks and journals, so its
+ * record falls after those naming the old paths and before those naming
+ * the new.
+ */
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Write node's path into buf. Returns its length, or -1 if the node has
+ * been unlinked or the path does not fit. The caller holds names_lock.
+ */
+static int node_path(Node *node, char *buf, size_t size) {
+    size_t len = 0;
+    Node *n;
+    for (n = node; n != root; n = n->parent_dir) {
+        if (n == NULL) {
+            return -1;
+        }
+        len += strlen(n->name) + 1;
+    }
+    if (len == 0) {
+        buf[len++] = '/';
     }
+    if (len >= size) {
+        return -1;
+    }
+    buf[len] = '\0';
+    size_t pos = len;
+    for (n = node; n != root; n = n->parent_dir) {
+        size_t name_len = strlen(n->name);
+        pos -= name_len;
+        memcpy(buf + pos, n->name, name_len);
+        buf[--pos] = '/';
+    }
+    return len;
+}
 
-    Node *new_node = (Node *) malloc(sizeof(Node));
-    new_node->st = (struct stat *) malloc(sizeof(struct stat));
-    new_node->name = malloc(MAX_FILENAME_LENGTH * sizeof(char));
-    strcpy(new_node->name, file_name);
-    new_node->st->st_mode = S_IFREG | mode;
-    new_node->st->st_nlink = 1;
-    new_node->st->st_size = 0;
+/*
+ * Write the path of name in dir into buf, which has MAX_PATH_LENGTH
+ * bytes. Returns its length or -1, like node_path.
+ */
+static int entry_path(Node *dir, const char *name, char *buf) {
+    size_t name_len = strlen(name);
+    int len = node_path(dir, buf, MAX_PATH_LENGTH - name_len - 1);
+    if (len < 0) {
+        return -1;
+    }
+    if (len > 1) {
+        buf[len++] = '/';
+    }
+    memcpy(buf + len, name, name_len + 1);
+    return len + name_len;
+}
 
-    time_t current_time;
-    time(&current_time);
-    new_node->st->st_mtime = current_time;
-    new_node->st->st_ctime = current_time;
+/*
+ * Journal an entry made in or removed from parent. Called under parent's
+ * write lock.
+ */
+static void log_entry(int op, Node *parent, const char *name, mode_t mode) {
+    if (!journal_running()) {
+        return;
+    }
+    char path[MAX_PATH_LENGTH];
+    pthread_rwlock_rdlock(&names_lock);
+    if (entry_path(parent, name, path) >= 0) {
+        JournalRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.op = op;
+        rec.mode = mode;
+        journal_append(&rec, path, NULL, 0);
+    }
+    pthread_rwlock_unlock(&names_lock);
+}
+
+/*
+ * Journal a rename, the new path going in as the record's data. Called
+ * under both directories' write locks and names_lock, after the rename.
+ */
+static void log_rename(Node *from_dir, const char *from_name, Node *to_dir, const char *to_name,
+                       unsigned int flags) {
+    if (!journal_running()) {
+        return;
+    }
+    char from_path[MAX_PATH_LENGTH], to_path[MAX_PATH_LENGTH];
+    int to_len = entry_path(to_dir, to_name, to_path);
+    if (entry_path(from_dir, from_name, from_path) < 0 || to_len < 0) {
+        return;
+    }
+    struct iovec data = {to_path, to_len + 1};
 
-    new_node->parent_dir = node;
-    new_node->_map = hashmap_new();
-    new_node->content = NULL;
-    new_node->type = FILE_NODE;
+    JournalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = JOURNAL_RENAME;
+    rec.mode = flags;
+    journal_append(&rec, from_path, &data, 1);
+}
+
+/*
+ * Journal size bytes written to node at offset, taken from iov. Called
+ * under node's write lock. Writes to unlinked files are not logged.
+ */
+static void log_write(Node *node, off_t offset, const struct iovec *iov, int count, size_t size) {
+    if (!journal_running()) {
+        return;
+    }
+    char path[MAX_PATH_LENGTH];
+    struct iovec data[count > 0 ? count : 1];
+    int n = 0;
+    while (n < count && size > 0) {
+        data[n] = iov[n];
+        if (data[n].iov_len > size) {
+            data[n].iov_len = size;
+        }
+        size -= data[n].iov_len;
+        n++;
+    }
 
-    if (node->_map == NULL) {
-        node->_map = hashmap_new();
+    pthread_rwlock_rdlock(&names_lock);
+    if (node_path(node, path, sizeof(path)) >= 0) {
+        JournalRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.op = JOURNAL_WRITE;
+        rec.offset = offset;
+        journal_append(&rec, path, data, n);
     }
-    hashmap_put(node->_map, new_node->name, new_node);
+    pthread_rwlock_unlock(&names_lock);
+}
 
-    size_t old_size = node->st->st_size;
-    long size_of_file = sizeof(Node) + sizeof(struct stat);
-    long updated_size = old_size + size_of_file;
-    node->st->st_size = updated_size;
+/*
+ * Journal a truncate to offset, or a hole of length bytes punched at
+ * offset. Called under node's write lock.
+ */
+static void log_resize(Node *node, int op, off_t offset, off_t length) {
+    if (!journal_running()) {
+        return;
+    }
+    char path[MAX_PATH_LENGTH];
+    uint64_t hole = length;
+    struct iovec data = {&hole, sizeof(hole)};
 
-    return 0;
+    pthread_rwlock_rdlock(&names_lock);
+    if (node_path(node, path, sizeof(path)) >= 0) {
+        JournalRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.op = op;
+        rec.offset = offset;
+        journal_append(&rec, path, &data, op == JOURNAL_PUNCH ? 1 : 0);
+    }
+    pthread_rwlock_unlock(&names_lock);
 }
 
-int ramdisk_mkdir(const char *path, mode_t mode) {
-    char _path[MAX_PATH_LENGTH];
-    strcpy(_path, path);
-    char dir_path[MAX_PATH_LENGTH];
-    char *last_slash = strrchr(_path, '/');
-    char *dir_name = last_slash + 1;
-    *last_slash = 0;
+/*
+ * A directory that has been removed must not get new entries.
+ */
+static int is_unlinked(Node *node) {
+    return node != root && node->parent_dir == NULL;
+}
 
-    if (strlen(_path) == 0) {
-        strcpy(dir_path, "/");
-    } else {
-        strcpy(dir_path, _path);
+/*
+ * Create a file or directory called name under parent. The new node holds
+ * one reference for its directory entry and one that is handed to the
+ * caller in *out.
+ */
+int make_node(Node *parent, const char *name, mode_t mode, int type, Node **out) {
+    if (parent->type != DERICTORY_NODE) {
+        return -ENOTDIR;
     }
-    Node *node = get_node_by_path(dir_path);
-    if (node == NULL) {
+    if (strlen(name) >= MAX_FILENAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+
+    if (journal_failed()) {
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&parent->lock);
+    if (is_unlinked(parent)) {
+        pthread_rwlock_unlock(&parent->lock);
         return -ENOENT;
     }
-    Node *tmp_node;
-    int msg = hashmap_get(node->_map, dir_name, (void **) (&tmp_node));
-    if (msg == MAP_OK) {
+    if (get_child(parent, name) != NULL) {
+        pthread_rwlock_unlock(&parent->lock);
         return -EEXIST;
     }
 
-    Node *new_node = (Node *) malloc(sizeof(Node));
-    new_node->st = (struct stat *) malloc(sizeof(struct stat));
-    new_node->name = malloc(MAX_FILENAME_LENGTH * sizeof(char));
-    strcpy(new_node->name, dir_name);
-
-    long size_of_dir = sizeof(Node) + sizeof(struct stat);
+    Node *new_node = alloc_node(name);
+    if (new_node == NULL) {
+        pthread_rwlock_unlock(&parent->lock);
+        return -ENOMEM;
+    }
 
-    new_node->st->st_nlink = 2;
-    new_node->st->st_mode = S_IFDIR | mode;
-    new_node->st->st_size = size_of_dir;
+    long size_of_node = sizeof(Node) + sizeof(struct stat);
+    if (type == DERICTORY_NODE) {
+        new_node->st->st_mode = S_IFDIR | mode;
+        new_node->st->st_nlink = 2;
+        new_node->st->st_size = size_of_node;
+    } else {
+        new_node->st->st_mode = S_IFREG | mode;
+        new_node->st->st_nlink = 1;
+        new_node->st->st_size = 0;
+    }
 
     time_t current_time;
     time(&current_time);
     new_node->st->st_mtime = current_time;
     new_node->st->st_ctime = current_time;
 
-    new_node->parent_dir = node;
-    new_node->_map = hashmap_new();
-    new_node->type = DERICTORY_NODE;
-
+    new_node->parent_dir = parent;
+    children_init(&new_node->children);
+    content_init(&new_node->content);
+    new_node->type = type;
+    new_node->refcount = 2;
+    pthread_rwlock_init(&new_node->lock, NULL);
+    new_node->ino = inode_alloc(new_node);
+    if (new_node->ino == 0) {
+        pthread_rwlock_unlock(&parent->lock);
+        free_node(new_node);
+        return -ENOSPC;
+    }
+    new_node->st->st_ino = new_node->ino;
 
-    if (node->_map == NULL) {
-        node->_map = hashmap_new();
+    if (children_add(&parent->children, new_node) != 0) {
+        pthread_rwlock_unlock(&parent->lock);
+        inode_free(new_node->ino);
+        free_node(new_node);
+        return -ENOMEM;
+    }
+    if (type == DERICTORY_NODE) {
+        parent->st->st_nlink++;
     }
-    hashmap_put(node->_map, new_node->name, new_node);
 
-    size_t old_size = node->st->st_size;
-    long updated_size = old_size + size_of_dir;
-    node->st->st_size = updated_size;
+    size_t old_size = parent->st->st_size;
+    long updated_size = old_size + size_of_node;
+    parent->st->st_size = updated_size;
+    log_entry(type == DERICTORY_NODE ? JOURNAL_MKDIR : JOURNAL_CREATE, parent, name, mode);
+    pthread_rwlock_unlock(&parent->lock);
 
+    int result = journal_commit();
+    if (result != SUCCESS) {
+        put_node(new_node);
+        return result;
+    }
+    *out = new_node;
     return SUCCESS;
 }
 
-int ramdisk_rmdir(const char *path) {
-    Node *node = get_node_by_path(path);
+/*
+ * Unlink name from parent and drop the directory entry's reference.
+ * type is the kind of node the caller expects; directories must be empty.
+ * path, if given, is dropped from the dcache under the parent's lock.
+ *
+ * Locks parent, then the child.
+ */
+int remove_child(Node *parent, const char *name, int type, const char *path) {
+    if (journal_failed()) {
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&parent->lock);
+    Node *node = get_child(parent, name);
     if (node == NULL) {
+        pthread_rwlock_unlock(&parent->lock);
         return -ENOENT;
     }
-    if (node->_map != NULL && hashmap_length(node->_map) > 0) {
+    if (node->type != type) {
+        pthread_rwlock_unlock(&parent->lock);
+        return type == DERICTORY_NODE ? -ENOTDIR : -EISDIR;
+    }
+
+    pthread_rwlock_wrlock(&node->lock);
+    if (node->type == DERICTORY_NODE && children_count(get_children(node)) > 0) {
+        pthread_rwlock_unlock(&node->lock);
+        pthread_rwlock_unlock(&parent->lock);
         return -ENOTEMPTY;
     }
-    Node *parent_dir = node->parent_dir;
-    hashmap_remove(parent_dir->_map, node->name);
-    parent_dir->st->st_nlink--;
-    free(node->name);
-    free(node->st);
-    hashmap_free(node->_map);
-    free(node);
+    if (path != NULL) {
+        dcache_invalidate(path);
+    }
+    children_remove(&parent->children, node->name);
+    node->parent_dir = NULL;
 
-    long size_of_dir = sizeof(Node) + sizeof(struct stat);
-    size_t old_size = parent_dir->st->st_size;
-    long updated_size = old_size - size_of_dir;
+    size_t old_size = parent->st->st_size;
+    long updated_size = old_size;
+    if (node->type == DERICTORY_NODE) {
+        parent->st->st_nlink--;
+    } else if (node->st->st_size != 0) {
+        updated_size = updated_size - node->st->st_size;
+    }
+    pthread_rwlock_unlock(&node->lock);
 
+    long size_of_node = sizeof(Node) + sizeof(struct stat);
+    updated_size = updated_size - size_of_node;
     if (updated_size < 0)
         updated_size = 0;
-    parent_dir->st->st_size = updated_size;
-    return SUCCESS;
-}
+    parent->st->st_size = updated_size;
+    log_entry(type == DERICTORY_NODE ? JOURNAL_RMDIR : JOURNAL_UNLINK, parent, name, 0);
+    pthread_rwlock_unlock(&parent->lock);
 
-int ramdisk_opendir(const char *path, struct fuse_file_info *fi) {
-    int result = SUCCESS;
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
-        result = -ENOENT;
-    }
-    return result;
+    put_node(node);
+    return journal_commit();
 }
 
-int ramdisk_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    Node *node = get_node_by_path(path);
-
-    if (node == NULL) {
-        return -ENOENT;
+/*
+ * Whether node is dir or one of its ancestors. The caller holds
+ * rename_lock, so no link above dir moves meanwhile.
+ */
+static int is_ancestor(Node *node, Node *dir) {
+    Node *n;
+    for (n = dir; n != NULL; n = n->parent_dir) {
+        if (n == node) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    int map_size = hashmap_length(node->_map);
-    char *keys[map_size];
-    int numKeys = hashmap_keys(node->_map, keys);
-    int i = 0;
-    for (i = 0; i < numKeys; i++) {
-        filler(buf, keys[i], NULL, 0);
+/*
+ * Write-lock two nodes: an ancestor before its descendant, as everywhere
+ * else, and unrelated ones by address. Only renames hold two unrelated
+ * locks, and only under the locks of the directories linking them.
+ */
+static void lock_two(Node *a, Node *b) {
+    if (is_ancestor(b, a) || (!is_ancestor(a, b) && (uintptr_t) b < (uintptr_t) a)) {
+        Node *first = b;
+        b = a;
+        a = first;
     }
-
-    return SUCCESS;
+    pthread_rwlock_wrlock(&a->lock);
+    pthread_rwlock_wrlock(&b->lock);
 }
 
-int ramdisk_getattr(const char *path, struct stat *stbuf) {
-    Node *node = get_node_by_path(path);
-    if (node == NULL){
-        return -ENOENT;
+/*
+ * Rename from_name in from_dir to to_name in to_dir. The node is relinked
+ * and takes its subtree along, so the cost does not depend on what is
+ * below it. An existing to_name is replaced, and its directory entry's
+ * reference dropped, unless flags has RENAME_NOREPLACE; with
+ * RENAME_EXCHANGE the two nodes swap places. from_path and to_path, if
+ * given, are dropped from the dcache, and a directory moving makes all
+ * of it stale.
+ *
+ * Locks rename_lock, the directories, the nodes, then names_lock.
+ */
+int rename_node(Node *from_dir, const char *from_name, Node *to_dir, const char *to_name,
+                unsigned int flags, const char *from_path, const char *to_path) {
+    if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) != 0 ||
+        flags == (RENAME_NOREPLACE | RENAME_EXCHANGE)) {
+        return -EINVAL;
+    }
+    if (from_dir->type != DERICTORY_NODE || to_dir->type != DERICTORY_NODE) {
+        return -ENOTDIR;
+    }
+    if (strlen(to_name) >= MAX_FILENAME_LENGTH) {
+        return -ENAMETOOLONG;
     }
 
-    stbuf->st_nlink = node->st->st_nlink;
-    stbuf->st_mode = node->st->st_mode;
-    stbuf->st_size = node->st->st_size;
-    stbuf->st_mtime = node->st->st_mtime;
-    stbuf->st_ctime = node->st->st_ctime;
-    return SUCCESS;
-}
-
-int ramdisk_release(const char *path, struct fuse_file_info *fi) {
-    int result = 0;
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
-        result = -ENOENT;
+    if (journal_failed()) {
+        return -EIO;
     }
-    return result;
-}
 
-int ramdisk_utime(const char *path, struct utimbuf *ubuf) {
+    int one_dir = from_dir == to_dir;
+    int exchange = (flags & RENAME_EXCHANGE) != 0;
+    Node *node = NULL, *target = NULL;
+    char *new_name = NULL, *new_target_name = NULL;     /* freed unless used */
+    char *old_name = NULL, *old_target_name = NULL;     /* freed once replaced */
     int result = SUCCESS;
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
+    if (one_dir) {
+        pthread_rwlock_rdlock(&rename_lock);
+        pthread_rwlock_wrlock(&from_dir->lock);
+    } else {
+        pthread_rwlock_wrlock(&rename_lock);
+        lock_two(from_dir, to_dir);
+    }
+    if (is_unlinked(from_dir) || is_unlinked(to_dir) || (node = get_child(from_dir, from_name)) == NULL) {
         result = -ENOENT;
+        goto unlock_dirs;
     }
-    return result;
-}
-
-int ramdisk_truncate(const char *path, off_t offset) {
-    int result = SUCCESS;
-    Node *node = get_node_by_path(path);
-    if (node == NULL) {
+    target = get_child(to_dir, to_name);
+    if (target == NULL && exchange) {
         result = -ENOENT;
+        goto unlock_dirs;
+    }
+    if (target != NULL && (flags & RENAME_NOREPLACE)) {
+        result = -EEXIST;
+        goto unlock_dirs;
+    }
+    if (target == node) {
+        goto unlock_dirs;
+    }
+    /* Neither node may end up inside itself. This also leaves node and
+     * target unrelated, so that locking both is safe. */
+    if (!one_dir && node->type == DERICTORY_NODE && is_ancestor(node, to_dir)) {
+        result = -EINVAL;
+        goto unlock_dirs;
+    }
+    if (target != NULL && !exchange) {
+        if (node->type != target->type) {
+            result = node->type == DERICTORY_NODE ? -ENOTDIR : -EISDIR;
+            goto unlock_dirs;
+        }
+        if (!one_dir && target->type == DERICTORY_NODE && is_ancestor(target, from_dir)) {
+            result = -ENOTEMPTY;
+            goto unlock_dirs;
+        }
+    }
+    if (exchange && !one_dir && target->type == DERICTORY_NODE && is_ancestor(target, from_dir)) {
+        result = -EINVAL;
+        goto unlock_dirs;
     }
-    return result;
-}
-
-static struct fuse_operations ramdisk_operations = {
-        .open = ramdisk_open,
-        .release = ramdisk_release,
-        .read = ramdisk_read,
-        .write = ramdisk_write,
-        .create = ramdisk_create,
-        .mkdir = ramdisk_mkdir,
-        .unlink = ramdisk_unlink,
-        .rmdir = ramdisk_rmdir,
-        .opendir = ramdisk_opendir,
-        .readdir = ramdisk_readdir,
-        .getattr = ramdisk_getattr,
-        .truncate = ramdisk_truncate,
-        .utime = ramdisk_utime
-};
 
-void init_root() {
-    root = (Node *) malloc(sizeof(Node));
-    root->st = (struct stat *) malloc(sizeof(struct stat));
-    root->name = malloc(MAX_FILENAME_LENGTH * sizeof(char));
-    strcpy(root->name, "/");
+    if (target != NULL) {
+        lock_two(node, target);
+    } else {
+        pthread_rwlock_wrlock(&node->lock);
+    }
+    if (target != NULL && !exchange && target->type == DERICTORY_NODE &&
+        children_count(get_children(target)) > 0) {
+        result = -ENOTEMPTY;
+        goto unlock_nodes;
+    }
+    new_name = alloc_name(node, to_name);
+    new_target_name = exchange ? alloc_name(target, from_name) : NULL;
+    if (new_name == NULL || (exchange && new_target_name == NULL)) {
+        result = -ENOMEM;
+        goto unlock_nodes;
+    }
+    if (from_path != NULL) {
+        dcache_invalidate(from_path);
+    }
+    if (to_path != NULL) {
+        dcache_invalidate(to_path);
+    }
 
-    root->st->st_mode = S_IFDIR | 0755;
-    root->st->st_nlink = 2;
-    long size_of_dir = sizeof(Node) + sizeof(struct stat);
-    root->st->st_size = size_of_dir;
-    time_t current_time;
-    time(&current_time);
-    root->st->st_mtime = current_time;
-    root->st->st_ctime = current_time;
-    root->parent_dir = NULL;
-    root->_map = hashmap_new();
-    root->content = NULL;
-    root->type = DERICTORY_NODE;
+    pthread_rwlock_wrlock(&names_lock);
+    old_name = node->name;
+    node->name = new_name;
+    if (exchange) {
+        old_target_name = target->name;
+        target->name = new_target_name;
+        children_exchange(&from_dir->children, node, &to_dir->children, target);
+        target->parent_dir = from_dir;
+    } else if (target != NULL) {
+        children_replace(&from_dir->children, old_name, &to_dir->children, target, node);
+        target->parent_dir = NULL;
+    } else if (children_move(&from_dir->children, old_name, &to_dir->children, node) != 0) {
+        node->name = old_name;
+        old_name = NULL;
+        pthread_rwlock_unlock(&names_lock);
+        result = -ENOMEM;
+        goto unlock_nodes;
+    }
+    new_name = NULL;
+    new_target_name = NULL;
+    node->parent_dir = to_dir;
+    log_rename(from_dir, from_name, to_dir, to_name, flags);
+    pthread_rwlock_unlock(&names_lock);
 
-}
+    /* Each directory counts an entry's size, and a subdirectory's "..". */
+    long size_of_node = sizeof(Node) + sizeof(struct stat);
+    if (exchange) {
+        if (node->type != target->type) {
+            Node *gains = node->type == DERICTORY_NODE ? to_dir : from_dir;
+            Node *loses = gains == to_dir ? from_dir : to_dir;
+            gains->st->st_nlink++;
+            loses->st->st_nlink--;
+        }
+        time(&target->st->st_ctime);
+    } else {
+        if (node->type == DERICTORY_NODE) {
+            from_dir->st->st_nlink--;
+            to_dir->st->st_nlink++;
+        }
+        if (target != NULL && target->type == DERICTORY_NODE) {
+            to_dir->st->st_nlink--;
+        }
+        from_dir->st->st_size = from_dir->st->st_size > size_of_node ? from_dir->st->st_size - size_of_node : 0;
+        if (target == NULL) {
+            to_dir->st->st_size += size_of_node;
+        }
+    }
+    time(&node->st->st_ctime);
+    if (node->type == DERICTORY_NODE || (exchange && target->type == DERICTORY_NODE)) {
+        dcache_invalidate_all();
+    }
 
-int main(int argc, char *argv[]) {
-    if (argc == 2) {
-        printf("Starting new filesystem.\n");
+unlock_nodes:
+    if (target != NULL) {
+        pthread_rwlock_unlock(&target->lock);
     }
-    init_root();
-    return fuse_main(argc, argv, &ramdisk_operations, NULL);
-}
\ No newline at end of file
+    pthread_rwlock_unlock(&node->lock);
+unlock_dirs:
+    if (!one_dir) {
+        pthread_rwlock_unlock(&to_dir->lock);
+    }
+    pthread_rwlock_unlock(&from_dir->lock);
+    pthread_rwlock_unlock(&rename_lock);
+
+    if (new_name != NULL) {
+        free_name(node, new_name);
+    }
+    if (old_name != NULL) {
+        free_name(node, old_name);
+    }
+    if (new_target_name != NULL) {
+        free_name(target, new_target_name);
+    }
+    if (old_target_name != NULL) {
+        free_name(target, old_target_name);
+    }
+    if (result != SUCCESS) {
+        return result;
+    }
+    if (target != NULL && target != node && !exchange) {
+        put_node(target);
+    }
+    return journal_commit();
+}
+
+/*
+ * Record a read in st_atime, which the cold scanner goes by. Readers hold
+ * only the read lock, so the store is atomic, and it is skipped within
+ * the same second so concurrent readers do not bounce the line.
+ */
+static void touch_atime(Node *node) {
+    time_t now = time(NULL);
+    if (__atomic_load_n(&node->st->st_atime, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&node->st->st_atime, now, __ATOMIC_RELAXED);
+    }
+}
+
+int read_node(Node *node, char *buf, size_t size, off_t offset) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+
+    pthread_rwlock_rdlock(&node->lock);
+    touch_atime(node);
+    size_t content_size = node->st->st_size;
+    if (offset < content_size) {
+        if (offset + size > content_size) {
+            size = content_size - offset;
+        }
+        content_read(&node->content, buf, size, offset);
+    } else {
+        size = 0;
+    }
+    pthread_rwlock_unlock(&node->lock);
+
+    return size;
+}
+
+int write_node(Node *node, const char *buf, size_t size, off_t offset) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+
+    if (journal_failed()) {
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&node->lock);
+    int result = content_write(&node->content, buf, size, offset);
+    if (result != SUCCESS) {
+        pthread_rwlock_unlock(&node->lock);
+        return result;
+    }
+    if (offset + size > node->st->st_size) {
+        node->st->st_size = offset + size;
+    }
+    time_t current_time;
+    time(&current_time);
+    node->st->st_mtime = current_time;
+    struct iovec iov = {(void *) buf, size};
+    log_write(node, offset, &iov, 1, size);
+    pthread_rwlock_unlock(&node->lock);
+
+    result = journal_commit();
+    return result != SUCCESS ? result : (int) size;
+}
+
+/*
+ * Zero-copy read: hand back a bufvec whose buffers point straight at the
+ * file's chunks. The caller frees *bufp (but not the memory it points to).
+ *
+ * The reply is sent after the file lock is dropped. Full chunks never move
+ * while the file is open, but a short head chunk is realloc'd as it grows
+ * and a compressed chunk has no memory to point at, so reads from either
+ * are copied into the bufvec allocation instead.
+ */
+int read_node_buf(Node *node, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+
+    pthread_rwlock_rdlock(&node->lock);
+    touch_atime(node);
+    size_t content_size = node->st->st_size;
+    if (offset >= content_size) {
+        size = 0;
+    } else if (offset + size > content_size) {
+        size = content_size - offset;
+    }
+
+    struct fuse_bufvec *bufv;
+    int max = CONTENT_MAX_SEGMENTS(size, offset);
+    struct iovec iov[max];
+    int count = 0, i;
+    int copy = node->content.height == 0 && node->content.head_capacity < CHUNK_SIZE;
+    if (!copy) {
+        count = content_map_read(&node->content, size, offset, iov, max);
+        for (i = 0; i < count; i++) {
+            if (iov[i].iov_base == NULL) {
+                copy = 1;
+            }
+        }
+    }
+    if (copy) {
+        bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) + size);
+        if (bufv == NULL) {
+            pthread_rwlock_unlock(&node->lock);
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(size);
+        bufv->buf[0].mem = bufv + 1;
+        content_read(&node->content, bufv->buf[0].mem, size, offset);
+    } else {
+        bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+        if (bufv == NULL) {
+            pthread_rwlock_unlock(&node->lock);
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(size);
+        bufv->count = count > 0 ? count : 1;
+        for (i = 0; i < count; i++) {
+            bufv->buf[i] = bufv->buf[0];
+            bufv->buf[i].size = iov[i].iov_len;
+            bufv->buf[i].mem = iov[i].iov_base;
+        }
+    }
+    pthread_rwlock_unlock(&node->lock);
+
+    *bufp = bufv;
+    return SUCCESS;
+}
+
+/*
+ * Zero-copy write: allocate the chunks covering the range and let libfuse
+ * move the data (possibly straight out of a splice pipe) into them.
+ */
+int write_node_buf(Node *node, struct fuse_bufvec *buf, off_t offset) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+    if (journal_failed()) {
+        return -EIO;
+    }
+
+    size_t size = fuse_buf_size(buf);
+    int max = CONTENT_MAX_SEGMENTS(size, offset);
+    struct iovec iov[max];
+    struct fuse_bufvec *dst = (struct fuse_bufvec *) alloca(
+            sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+
+    pthread_rwlock_wrlock(&node->lock);
+    int count = content_map_write(&node->content, size, offset, iov, max);
+    if (count < 0) {
+        pthread_rwlock_unlock(&node->lock);
+        return count;
+    }
+
+    *dst = FUSE_BUFVEC_INIT(size);
+    dst->count = count > 0 ? count : 1;
+    int i;
+    for (i = 0; i < count; i++) {
+        dst->buf[i] = dst->buf[0];
+        dst->buf[i].size = iov[i].iov_len;
+        dst->buf[i].mem = iov[i].iov_base;
+    }
+
+    ssize_t copied = fuse_buf_copy(dst, buf, 0);
+    if (copied < 0) {
+        pthread_rwlock_unlock(&node->lock);
+        return copied;
+    }
+    if (offset + copied > node->st->st_size) {
+        node->st->st_size = offset + copied;
+    }
+    time_t current_time;
+    time(&current_time);
+    node->st->st_mtime = current_time;
+    log_write(node, offset, iov, count, copied);
+    pthread_rwlock_unlock(&node->lock);
+
+    int result = journal_commit();
+    return result != SUCCESS ? result : copied;
+}
+
+static int is_open(Node *node) {
+    return __atomic_load_n(&node->open_count, __ATOMIC_ACQUIRE) > 0;
+}
+
+/*
+ * Set the file's size. Shrinking frees the chunks past the new end; while
+ * the file is open they are kept until its last close, as read replies
+ * may still point into them.
+ */
+int truncate_node(Node *node, off_t size) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+    if (size < 0) {
+        return -EINVAL;
+    }
+
+    if (journal_failed()) {
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&node->lock);
+    int result = SUCCESS;
+    if (size < node->st->st_size) {
+        result = content_truncate(&node->content, size, is_open(node));
+    }
+    if (result == SUCCESS) {
+        node->st->st_size = size;
+        time_t current_time;
+        time(&current_time);
+        node->st->st_mtime = current_time;
+        node->st->st_ctime = current_time;
+        log_resize(node, JOURNAL_TRUNCATE, size, 0);
+    }
+    pthread_rwlock_unlock(&node->lock);
+
+    return result != SUCCESS ? result : journal_commit();
+}
+
+/*
+ * fallocate(2) modes 0 and FALLOC_FL_KEEP_SIZE allocate the chunks of the
+ * range up front, the first also growing the file to cover it.
+ * FALLOC_FL_PUNCH_HOLE (with FALLOC_FL_KEEP_SIZE) frees them instead.
+ */
+int fallocate_node(Node *node, int mode, off_t offset, off_t length) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) ||
+        ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        return -EOPNOTSUPP;
+    }
+    if (offset + length < offset) {
+        return -EFBIG;
+    }
+
+    if (journal_failed()) {
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&node->lock);
+    int result;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        result = content_punch(&node->content, offset, length, is_open(node));
+        if (result == SUCCESS) {
+            log_resize(node, JOURNAL_PUNCH, offset, length);
+        }
+    } else {
+        result = content_reserve(&node->content, offset, length);
+        if (result == SUCCESS && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > node->st->st_size) {
+            node->st->st_size = offset + length;
+            log_resize(node, JOURNAL_TRUNCATE, offset + length, 0);
+        }
+    }
+    if (result == SUCCESS) {
+        time_t current_time;
+        time(&current_time);
+        node->st->st_mtime = current_time;
+        node->st->st_ctime = current_time;
+    }
+    pthread_rwlock_unlock(&node->lock);
+
+    return result != SUCCESS ? result : journal_commit();
+}
+
+/*
+ * lseek(2) SEEK_DATA and SEEK_HOLE. The end of the file counts as a hole.
+ * The kernel only passes lseek on from libfuse 3.8, and neither engine is
+ * built against that, so this is reachable in-process only (fs_bench).
+ */
+off_t seek_node(Node *node, off_t offset, int whence) {
+    if (node->type != FILE_NODE) {
+        return -EISDIR;
+    }
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+
+    pthread_rwlock_rdlock(&node->lock);
+    off_t size = node->st->st_size;
+    off_t found = -ENXIO;
+    if (offset >= 0 && offset < size) {
+        found = content_seek(&node->content, offset, whence == SEEK_HOLE);
+        if (whence == SEEK_HOLE && (found < 0 || found > size)) {
+            found = size;
+        } else if (whence == SEEK_DATA && (found < 0 || found >= size)) {
+            found = -ENXIO;
+        }
+    }
+    pthread_rwlock_unlock(&node->lock);
+    return found;
+}
+
+void stat_node(Node *node, struct stat *stbuf) {
+    pthread_rwlock_rdlock(&node->lock);
+    stbuf->st_ino = node->ino;
+    stbuf->st_nlink = node->st->st_nlink;
+    stbuf->st_mode = node->st->st_mode;
+    stbuf->st_size = node->st->st_size;
+    stbuf->st_atime = __atomic_load_n(&node->st->st_atime, __ATOMIC_RELAXED);
+    stbuf->st_mtime = node->st->st_mtime;
+    stbuf->st_ctime = node->st->st_ctime;
+    pthread_rwlock_unlock(&node->lock);
+}
+
+/*
+ * Split path into its parent directory node and the last component.
+ */
+static Node *get_parent_by_path(const char *path, char *name) {
+    char _path[MAX_PATH_LENGTH];
+    strcpy(_path, path);
+    char dir_path[MAX_PATH_LENGTH];
+
+    char *last_slash = strrchr(_path, '/');
+    strcpy(name, last_slash + 1);
+    *last_slash = 0;
+
+    if (strlen(_path) == 0) {
+        strcpy(dir_path, "/");
+    } else {
+        strcpy(dir_path, _path);
+    }
+    return get_node_by_path(dir_path);
+}
+
+/*
+ * The stats file, /.xyfs-stats. It is not in the tree: its path is
+ * recognised before any lookup, and an open handle holds the text
+ * rendered at open, so one pass of reads sees one consistent set of
+ * figures. Like a /proc file it has size 0 and is read with direct_io.
+ */
+static int is_stats_path(const char *path) {
+    return path != NULL && strcmp(path, "/" STATS_FILE_NAME) == 0;
+}
+
+static StatsText *get_stats_by_fi(struct fuse_file_info *fi) {
+    if (fi == NULL || !(fi->fh & STATS_HANDLE)) {
+        return NULL;
+    }
+    return (StatsText *) (uintptr_t) (fi->fh & ~(uint64_t) STATS_HANDLE);
+}
+
+/*
+ * Render every counter: operations and hashmaps from stats.c, then the
+ * figures each subsystem keeps. Returns 0 or -ENOMEM.
+ */
+int render_stats(StatsText *text) {
+    DcacheStats dcache_stats;
+    JournalStats journal_stats;
+    DedupStats dedup_stats;
+    ColdStats cold_stats;
+    size_t reserved, in_use;
+
+    memset(text, 0, sizeof(*text));
+    stats_render(text);
+    dcache_get_stats(&dcache_stats);
+    stats_metric(text, "counter", "xyfs_dcache_hits_total", dcache_stats.hits);
+    stats_metric(text, "counter", "xyfs_dcache_misses_total", dcache_stats.misses);
+    stats_metric(text, "counter", "xyfs_dcache_flushes_total", dcache_stats.flushes);
+    stats_metric(text, "gauge", "xyfs_dcache_entries", dcache_stats.entries);
+    journal_get_stats(&journal_stats);
+    stats_metric(text, "counter", "xyfs_journal_records_total", journal_stats.records);
+    stats_metric(text, "counter", "xyfs_journal_bytes_total", journal_stats.bytes);
+    stats_metric(text, "counter", "xyfs_journal_commits_total", journal_stats.flushes);
+    dedup_get_stats(&dedup_stats);
+    stats_metric(text, "gauge", "xyfs_dedup_blocks", dedup_stats.blocks);
+    stats_metric(text, "gauge", "xyfs_dedup_stored_bytes", dedup_stats.stored_bytes);
+    stats_metric(text, "gauge", "xyfs_dedup_logical_bytes", dedup_stats.logical_bytes);
+    stats_metric(text, "counter", "xyfs_dedup_hits_total", dedup_stats.hits);
+    stats_metric(text, "counter", "xyfs_dedup_copies_total", dedup_stats.copies);
+    cold_get_stats(&cold_stats);
+    stats_metric(text, "gauge", "xyfs_cold_chunks", cold_stats.chunks);
+    stats_metric(text, "gauge", "xyfs_cold_compressed_bytes", cold_stats.compressed_bytes);
+    stats_metric(text, "gauge", "xyfs_cold_uncompressed_bytes", cold_stats.uncompressed_bytes);
+    stats_metric(text, "counter", "xyfs_cold_cache_hits_total", cold_stats.hits);
+    stats_metric(text, "counter", "xyfs_cold_cache_misses_total", cold_stats.misses);
+    stats_metric(text, "counter", "xyfs_cold_miss_ns_total", cold_stats.miss_ns);
+    stats_metric(text, "counter", "xyfs_cold_thaws_total", cold_stats.thaws);
+    slab_get_stats(&reserved, &in_use);
+    stats_metric(text, "gauge", "xyfs_slab_reserved_bytes", reserved);
+    stats_metric(text, "gauge", "xyfs_slab_in_use_bytes", in_use);
+    return text->data == NULL ? -ENOMEM : SUCCESS;
+}
+
+/*
+ * The stats file's attributes: read only, and owned and dated like root.
+ */
+void stat_stats(struct stat *stbuf) {
+    stat_node(root, stbuf);
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = 0;
+    stbuf->st_blocks = 0;
+}
+
+static int open_stats(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    StatsText *text = (StatsText *) malloc(sizeof(StatsText));
+    if (text == NULL) {
+        return -ENOMEM;
+    }
+    int result = render_stats(text);
+    if (result != SUCCESS) {
+        free(text);
+        return result;
+    }
+    fi->fh = (uintptr_t) text | STATS_HANDLE;
+    fi->direct_io = 1;
+    return SUCCESS;
+}
+
+static size_t stats_range(StatsText *text, size_t size, off_t offset) {
+    if (offset >= text->length) {
+        return 0;
+    }
+    return size < text->length - offset ? size : text->length - offset;
+}
+
+int ramdisk_open(const char *path, struct fuse_file_info *fi) {
+    if (is_stats_path(path)) {
+        return open_stats(fi);
+    }
+    Node *node = get_node_by_path(path);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    /* The lookup reference now belongs to the handle. */
+    open_node(node);
+    fi->fh = (uintptr_t) node;
+    fi->keep_cache = xyfs_config.keep_cache;
+    return SUCCESS;
+}
+
+int ramdisk_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    StatsText *text = get_stats_by_fi(fi);
+    if (text != NULL) {
+        size = stats_range(text, size, offset);
+        if (size == 0) {
+            /* offset may be past the end: do not point there. */
+            return 0;
+        }
+        memcpy(buf, text->data + offset, size);
+        return size;
+    }
+    Node *node = get_node_by_fi(path, fi);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = read_node(node, buf, size, offset);
+    put_node_by_fi(node, fi);
+    return result;
+}
+
+int ramdisk_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    Node *node = get_node_by_fi(path, fi);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = write_node(node, buf, size, offset);
+    put_node_by_fi(node, fi);
+    return result;
+}
+
+int ramdisk_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+    StatsText *text = get_stats_by_fi(fi);
+    if (text != NULL) {
+        /* The text outlives the reply: release cannot run before it. */
+        struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+        if (bufv == NULL) {
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(stats_range(text, size, offset));
+        bufv->buf[0].mem = text->data + (bufv->buf[0].size > 0 ? offset : 0);
+        *bufp = bufv;
+        return SUCCESS;
+    }
+    Node *node = get_node_by_fi(path, fi);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = read_node_buf(node, bufp, size, offset);
+    put_node_by_fi(node, fi);
+    return result;
+}
+
+int ramdisk_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    Node *node = get_node_by_fi(path, fi);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = write_node_buf(node, buf, offset);
+    put_node_by_fi(node, fi);
+    return result;
+}
+
+int ramdisk_unlink(const char *path) {
+    if (is_stats_path(path)) {
+        return -EPERM;
+    }
+    char file_name[MAX_PATH_LENGTH];
+    Node *node = get_parent_by_path(path, file_name);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = remove_child(node, file_name, FILE_NODE, path);
+    put_node(node);
+    return result;
+}
+
+int ramdisk_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
+    char file_name[MAX_PATH_LENGTH];
+    Node *node = get_parent_by_path(path, file_name);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+
+    Node *new_node;
+    int result = make_node(node, file_name, mode, FILE_NODE, &new_node);
+    put_node(node);
+    if (result != SUCCESS) {
+        return result;
+    }
+    open_node(new_node);
+    fi->fh = (uintptr_t) new_node;
+    fi->keep_cache = xyfs_config.keep_cache;
+    return SUCCESS;
+}
+
+int ramdisk_mkdir(const char *path, mode_t mode) {
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
+    char dir_name[MAX_PATH_LENGTH];
+    Node *node = get_parent_by_path(path, dir_name);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+
+    Node *new_node;
+    int result = make_node(node, dir_name, mode, DERICTORY_NODE, &new_node);
+    put_node(node);
+    if (result != SUCCESS) {
+        return result;
+    }
+    put_node(new_node);
+    return SUCCESS;
+}
+
+int ramdisk_rmdir(const char *path) {
+    if (is_stats_path(path)) {
+        return -ENOTDIR;
+    }
+    char dir_name[MAX_PATH_LENGTH];
+    Node *node = get_parent_by_path(path, dir_name);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = remove_child(node, dir_name, DERICTORY_NODE, path);
+    put_node(node);
+    return result;
+}
+
+/*
+ * flags are renameat2's. libfuse 2 never passes them on, so
+ * ramdisk_operations calls this with 0 and the flags can only be reached,
+ * and tested, by calling it directly (fs_bench).
+ */
+int ramdisk_rename(const char *from, const char *to, unsigned int flags) {
+    if (is_stats_path(from) || is_stats_path(to)) {
+        return -EPERM;
+    }
+    char from_name[MAX_PATH_LENGTH], to_name[MAX_PATH_LENGTH];
+    Node *from_dir = get_parent_by_path(from, from_name);
+    if (from_dir == NULL) {
+        return -ENOENT;
+    }
+    Node *to_dir = get_parent_by_path(to, to_name);
+    if (to_dir == NULL) {
+        put_node(from_dir);
+        return -ENOENT;
+    }
+    int result = rename_node(from_dir, from_name, to_dir, to_name, flags, from, to);
+    put_node(to_dir);
+    put_node(from_dir);
+    return result;
+}
+
+int ramdisk_opendir(const char *path, struct fuse_file_info *fi) {
+    if (is_stats_path(path)) {
+        return -ENOTDIR;
+    }
+    Node *node = get_node_by_path(path);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    DirHandle *handle = open_dir(node);
+    put_node(node);
+    if (handle == NULL) {
+        return -ENOMEM;
+    }
+    fi->fh = (uintptr_t) handle;
+    return SUCCESS;
+}
+
+/*
+ * Fill from offset on until the buffer is full, passing each entry's
+ * attributes and the offset of the one after it.
+ */
+int ramdisk_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    DirHandle *handle = (DirHandle *) (uintptr_t) fi->fh;
+    trace_node(handle->dir);
+    if (offset == 0 || handle->count < 0) {
+        int result = load_dir(handle);
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
+
+    int i;
+    for (i = offset; i < handle->count; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        stat_node(handle->nodes[i], &st);
+        if (filler(buf, handle->names[i], &st, i + 1) != 0) {
+            break;
+        }
+    }
+    return SUCCESS;
+}
+
+int ramdisk_releasedir(const char *path, struct fuse_file_info *fi) {
+    close_dir((DirHandle *) (uintptr_t) fi->fh);
+    fi->fh = 0;
+    return SUCCESS;
+}
+
+int ramdisk_getattr(const char *path, struct stat *stbuf) {
+    if (is_stats_path(path)) {
+        stat_stats(stbuf);
+        return SUCCESS;
+    }
+    Node *node = get_node_by_path(path);
+    if (node == NULL){
+        return -ENOENT;
+    }
+
+    stat_node(node, stbuf);
+    put_node(node);
+    return SUCCESS;
+}
+
+int ramdisk_release(const char *path, struct fuse_file_info *fi) {
+    StatsText *text = get_stats_by_fi(fi);
+    if (text != NULL) {
+        free(text->data);
+        free(text);
+        fi->fh = 0;
+    } else if (fi->fh != 0) {
+        trace_node((Node *) (uintptr_t) fi->fh);
+        release_node((Node *) (uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    return SUCCESS;
+}
+
+int ramdisk_utime(const char *path, struct utimbuf *ubuf) {
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+    Node *node = get_node_by_path(path);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    put_node(node);
+    return SUCCESS;
+}
+
+int ramdisk_truncate(const char *path, off_t offset) {
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+    Node *node = get_node_by_path(path);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = truncate_node(node, offset);
+    put_node(node);
+    return result;
+}
+
+int ramdisk_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+    Node *node = get_node_by_fi(path, fi);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = truncate_node(node, offset);
+    put_node_by_fi(node, fi);
+    return result;
+}
+
+int ramdisk_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    Node *node = get_node_by_fi(path, fi);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    int result = fallocate_node(node, mode, offset, length);
+    put_node_by_fi(node, fi);
+    return result;
+}
+
+/*
+ * Ask for splice on both directions so read replies are vmspliced out of
+ * chunk memory and write payloads are read from the pipe into chunks.
+ */
+void request_splice(struct fuse_conn_info *conn) {
+    if (xyfs_config.copy_io) {
+        return;
+    }
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+}
+
+/*
+ * Apply one journal record at mount. Only records after the image's mark
+ * get here, but the image was saved while changes went on, so it may
+ * already hold one of them, or a later one to the same path: every case
+ * but rename has to work whatever state the path is in. Renames are held
+ * off while an image is saved, so none after the mark is in it.
+ */
+static int replay_record(const JournalRecord *rec, const char *path, const char *data) {
+    char name[MAX_PATH_LENGTH];
+    Node *node;
+    int result;
+
+    if (rec->op == JOURNAL_WRITE || rec->op == JOURNAL_TRUNCATE || rec->op == JOURNAL_PUNCH) {
+        node = get_node_by_path(path);
+        if (node == NULL) {
+            return -ENOENT;
+        }
+        if (rec->op == JOURNAL_WRITE) {
+            result = write_node(node, data, rec->length, rec->offset);
+        } else if (rec->op == JOURNAL_TRUNCATE) {
+            result = truncate_node(node, rec->offset);
+        } else if (rec->length == sizeof(uint64_t)) {
+            uint64_t hole;
+            memcpy(&hole, data, sizeof(hole));
+            result = fallocate_node(node, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, rec->offset, hole);
+        } else {
+            result = -EINVAL;
+        }
+        put_node(node);
+        return result < 0 ? result : SUCCESS;
+    }
+
+    Node *parent = get_parent_by_path(path, name);
+    if (parent == NULL) {
+        return -ENOENT;
+    }
+    switch (rec->op) {
+        case JOURNAL_CREATE:
+            result = make_node(parent, name, rec->mode, FILE_NODE, &node);
+            if (result == -EEXIST) {
+                /* The name was free when the file was made: start it over. */
+                remove_child(parent, name, FILE_NODE, path);
+                result = make_node(parent, name, rec->mode, FILE_NODE, &node);
+            }
+            if (result == SUCCESS) {
+                put_node(node);
+            }
+            break;
+        case JOURNAL_MKDIR:
+            result = make_node(parent, name, rec->mode, DERICTORY_NODE, &node);
+            if (result == SUCCESS) {
+                put_node(node);
+            } else if (result == -EEXIST) {
+                result = SUCCESS;
+            }
+            break;
+        case JOURNAL_UNLINK:
+        case JOURNAL_RMDIR:
+            result = remove_child(parent, name, rec->op == JOURNAL_RMDIR ? DERICTORY_NODE : FILE_NODE, path);
+            if (result == -ENOENT) {
+                result = SUCCESS;
+            }
+            break;
+        case JOURNAL_RENAME:
+            if (rec->length == 0 || data[rec->length - 1] != '\0') {
+                result = -EINVAL;
+                break;
+            }
+            result = ramdisk_rename(path, data, rec->mode);
+            break;
+        default:
+            result = -EINVAL;
+    }
+    put_node(parent);
+    return result;
+}
+
+/*
+ * Save an image, then drop the journal records it covers. snapshot_save
+ * returns once the image's rename is on disk, so a crash cannot leave
+ * the compacted log next to the previous image.
+ */
+static int checkpoint() {
+    uint64_t mark;
+    int rc = snapshot_save(xyfs_config.snapshot_path, &mark);
+    if (rc == 0) {
+        rc = journal_compact(mark);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "journal: checkpoint failed: %s\n", strerror(-rc));
+    }
+    return rc;
+}
+
+/*
+ * Cold data scanner. Every cold_after / 2 seconds it walks the tree and
+ * compresses the files whose last read or write fell between the cutoff
+ * of the previous pass and now - cold_after, so each file is tried once
+ * per cooling and incompressible files are not retried every pass. Files
+ * still open are skipped: compressing frees the chunks a zero-copy read
+ * reply may point into. Directories still in the snapshot image are
+ * skipped too, their files read from the mapping.
+ */
+static pthread_t cold_thread;
+static int cold_thread_running;
+static int cold_thread_stop;
+static sem_t cold_wakeup;
+
+static time_t last_access(Node *node) {
+    time_t atime = __atomic_load_n(&node->st->st_atime, __ATOMIC_RELAXED);
+    return atime > node->st->st_mtime ? atime : node->st->st_mtime;
+}
+
+static int went_cold(Node *node, time_t since, time_t until) {
+    time_t last = last_access(node);
+    return last > since && last <= until && __atomic_load_n(&node->open_count, __ATOMIC_ACQUIRE) == 0;
+}
+
+static void compress_if_cold(Node *node, time_t since, time_t until) {
+    pthread_rwlock_rdlock(&node->lock);
+    int cold = went_cold(node, since, until);
+    pthread_rwlock_unlock(&node->lock);
+    if (cold) {
+        /* An open or a write may have come in between. */
+        pthread_rwlock_wrlock(&node->lock);
+        if (went_cold(node, since, until)) {
+            content_compress(&node->content);
+        }
+        pthread_rwlock_unlock(&node->lock);
+    }
+}
+
+static void scan_dir(Node *dir, time_t since, time_t until) {
+    pthread_rwlock_rdlock(&dir->lock);
+    if (__atomic_load_n(&dir->image, __ATOMIC_ACQUIRE) != NULL) {
+        pthread_rwlock_unlock(&dir->lock);
+        return;
+    }
+    int n = children_count(&dir->children);
+    char **names = (char **) malloc((n + 1) * sizeof(char *));
+    Node **nodes = (Node **) malloc((n + 1) * sizeof(Node *));
+    if (names == NULL || nodes == NULL) {
+        pthread_rwlock_unlock(&dir->lock);
+        free(names);
+        free(nodes);
+        return;
+    }
+    n = children_names(&dir->children, names);
+    int i;
+    for (i = 0; i < n; i++) {
+        nodes[i] = get_child(dir, names[i]);
+        get_node(nodes[i]);
+    }
+    pthread_rwlock_unlock(&dir->lock);
+    free(names);
+
+    for (i = 0; i < n; i++) {
+        if (nodes[i]->type == DERICTORY_NODE) {
+            scan_dir(nodes[i], since, until);
+        } else {
+            compress_if_cold(nodes[i], since, until);
+        }
+        put_node(nodes[i]);
+    }
+    free(nodes);
+}
+
+static void *cold_loop(void *arg) {
+    unsigned int period = xyfs_config.cold_after / 2 > 0 ? xyfs_config.cold_after / 2 : 1;
+    time_t since = 0;
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += period;
+        if (sem_timedwait(&cold_wakeup, &deadline) != 0 && errno == EINTR) {
+            continue;
+        }
+        if (__atomic_load_n(&cold_thread_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        time_t until = time(NULL) - xyfs_config.cold_after;
+        scan_dir(root, since, until);
+        since = until;
+    }
+    return NULL;
+}
+
+static void cold_start() {
+    cold_set_cache(xyfs_config.cold_cache);
+    sem_init(&cold_wakeup, 0, 0);
+    cold_thread_stop = 0;
+    if (pthread_create(&cold_thread, NULL, cold_loop, NULL) == 0) {
+        cold_thread_running = 1;
+    }
+}
+
+static void cold_stop() {
+    if (!cold_thread_running) {
+        return;
+    }
+    __atomic_store_n(&cold_thread_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&cold_wakeup);
+    pthread_join(cold_thread, NULL);
+    cold_thread_running = 0;
+    sem_destroy(&cold_wakeup);
+}
+
+/*
+ * Threads that run alongside the request loop. They are started from the
+ * engines' init callbacks, after FUSE has daemonized.
+ */
+#ifdef XYFS_TRACE
+/*
+ * Name a node for the trace dump. The dump runs alongside everything
+ * else, so the node is only looked at inside an epoch section and the
+ * walk up its parents races with unlinks, though not renames; a path
+ * that comes out stale, or not at all, is good enough there.
+ */
+static int trace_path_of(unsigned long ino, char *buf, size_t size) {
+    pthread_rwlock_rdlock(&names_lock);
+    epoch_enter();
+    Node *node = inode_get(ino);
+    int len = node != NULL ? node_path(node, buf, size) : -1;
+    epoch_exit();
+    pthread_rwlock_unlock(&names_lock);
+    return len;
+}
+
+/*
+ * The default dump file is named after the pid, taken here because the
+ * daemon runs under a different one than main.
+ */
+static void start_trace() {
+    char path[64];
+    if (xyfs_config.trace_path == NULL) {
+        snprintf(path, sizeof(path), "/tmp/xyfs-%d.trace", (int) getpid());
+    }
+    trace_start(xyfs_config.trace_path != NULL ? xyfs_config.trace_path : path, xyfs_config.trace,
+                trace_path_of);
+}
+#endif
+
+void start_background() {
+    if (xyfs_config.trace > 0) {
+#ifdef XYFS_TRACE
+        start_trace();
+#else
+        fprintf(stderr, "trace: not compiled in, build with XYFS_TRACE\n");
+#endif
+    }
+    if (xyfs_config.snapshot_path != NULL) {
+        snapshot_start(xyfs_config.snapshot_path, xyfs_config.snapshot_interval);
+    }
+    if (xyfs_config.journal_path != NULL) {
+        journal_start(xyfs_config.journal_interval, (uint64_t) xyfs_config.journal_checkpoint << 20, checkpoint);
+    }
+    if (xyfs_config.cold_after > 0) {
+        cold_start();
+    }
+}
+
+/*
+ * Stop the background threads and write the final snapshot, if any. With
+ * a journal that is a checkpoint, which leaves the log empty.
+ */
+void stop_background() {
+    if (xyfs_config.trace > 0) {
+        trace_stop();
+    }
+    cold_stop();
+    if (xyfs_config.snapshot_path != NULL) {
+        snapshot_stop();
+    }
+    if (xyfs_config.journal_path != NULL) {
+        journal_stop();
+        checkpoint();
+        journal_close();
+    } else if (xyfs_config.snapshot_path != NULL) {
+        int rc = snapshot_save(xyfs_config.snapshot_path, NULL);
+        if (rc != 0) {
+            fprintf(stderr, "snapshot: saving %s failed: %s\n", xyfs_config.snapshot_path, strerror(-rc));
+        }
+    }
+}
+
+void *ramdisk_init(struct fuse_conn_info *conn) {
+    request_splice(conn);
+    start_background();
+    return NULL;
+}
+
+void ramdisk_destroy(void *private_data) {
+    JournalStats journal_stats;
+    journal_get_stats(&journal_stats);
+    stop_background();
+
+    DcacheStats stats;
+    dcache_get_stats(&stats);
+    fprintf(stderr, "dcache: %lu hits, %lu misses, %lu flushes, %d entries\n",
+            stats.hits, stats.misses, stats.flushes, stats.entries);
+    if (xyfs_config.journal_path != NULL) {
+        fprintf(stderr, "journal: %lu records, %lu bytes, %lu group commits\n",
+                journal_stats.records, journal_stats.bytes, journal_stats.flushes);
+    }
+    if (xyfs_config.dedup) {
+        DedupStats dedup_stats;
+        dedup_get_stats(&dedup_stats);
+        fprintf(stderr, "dedup: %lu blocks, %lu bytes stored for %lu (ratio %.2f), %lu hits, %lu copies\n",
+                dedup_stats.blocks, (unsigned long) dedup_stats.stored_bytes,
+                (unsigned long) dedup_stats.logical_bytes,
+                dedup_stats.stored_bytes > 0 ? (double) dedup_stats.logical_bytes / dedup_stats.stored_bytes : 1.0,
+                dedup_stats.hits, dedup_stats.copies);
+    }
+    if (xyfs_config.cold_after > 0) {
+        ColdStats cold_stats;
+        cold_get_stats(&cold_stats);
+        fprintf(stderr, "cold: %lu chunks, %lu bytes compressed to %lu, %lu cache hits, %lu misses "
+                        "(%.1f us each), %lu thawed\n",
+                cold_stats.chunks, (unsigned long) cold_stats.uncompressed_bytes,
+                (unsigned long) cold_stats.compressed_bytes, cold_stats.hits, cold_stats.misses,
+                cold_stats.misses > 0 ? cold_stats.miss_ns / 1e3 / cold_stats.misses : 0.0,
+                cold_stats.thaws);
+    }
+}
+
+/*
+ * Every callback is timed into the stats and, with --trace, recorded with
+ * the offset and size it was given. The ramdisk_* functions themselves
+ * stay untimed, for callers such as the benchmarks.
+ */
+#define TIMED(op, name, params, args, offset, size) \
+    static int timed_##name params { \
+        uint64_t start = stats_start(); \
+        trace_begin(op, start, offset, size); \
+        int result = ramdisk_##name args; \
+        trace_end(stats_end(op, start, result), result); \
+        return result; \
+    }
+
+TIMED(STATS_OPEN, open, (const char *path, struct fuse_file_info *fi), (path, fi), 0, 0)
+TIMED(STATS_RELEASE, release, (const char *path, struct fuse_file_info *fi), (path, fi), 0, 0)
+TIMED(STATS_READ, read, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+      (path, buf, size, offset, fi), offset, size)
+TIMED(STATS_WRITE, write, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+      (path, buf, size, offset, fi), offset, size)
+TIMED(STATS_READ, read_buf, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                             struct fuse_file_info *fi), (path, bufp, size, offset, fi), offset, size)
+TIMED(STATS_WRITE, write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi),
+      (path, buf, offset, fi), offset, fuse_buf_size(buf))
+TIMED(STATS_CREATE, create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi), 0, 0)
+TIMED(STATS_MKDIR, mkdir, (const char *path, mode_t mode), (path, mode), 0, 0)
+TIMED(STATS_UNLINK, unlink, (const char *path), (path), 0, 0)
+TIMED(STATS_RMDIR, rmdir, (const char *path), (path), 0, 0)
+TIMED(STATS_RENAME, rename, (const char *from, const char *to), (from, to, 0), 0, 0)
+TIMED(STATS_OPENDIR, opendir, (const char *path, struct fuse_file_info *fi), (path, fi), 0, 0)
+TIMED(STATS_READDIR, readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                               struct fuse_file_info *fi), (path, buf, filler, offset, fi), offset, 0)
+TIMED(STATS_RELEASEDIR, releasedir, (const char *path, struct fuse_file_info *fi), (path, fi), 0, 0)
+TIMED(STATS_GETATTR, getattr, (const char *path, struct stat *stbuf), (path, stbuf), 0, 0)
+TIMED(STATS_TRUNCATE, truncate, (const char *path, off_t offset), (path, offset), offset, 0)
+TIMED(STATS_TRUNCATE, ftruncate, (const char *path, off_t offset, struct fuse_file_info *fi), (path, offset, fi),
+      offset, 0)
+TIMED(STATS_FALLOCATE, fallocate, (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi),
+      (path, mode, offset, length, fi), offset, length)
+TIMED(STATS_UTIME, utime, (const char *path, struct utimbuf *ubuf), (path, ubuf), 0, 0)
+
+struct fuse_operations ramdisk_operations = {
+        .open = timed_open,
+        .release = timed_release,
+        .read = timed_read,
+        .write = timed_write,
+        .read_buf = timed_read_buf,
+        .write_buf = timed_write_buf,
+        .create = timed_create,
+        .mkdir = timed_mkdir,
+        .unlink = timed_unlink,
+        .rmdir = timed_rmdir,
+        .rename = timed_rename,
+        .opendir = timed_opendir,
+        .readdir = timed_readdir,
+        .releasedir = timed_releasedir,
+        .getattr = timed_getattr,
+        .truncate = timed_truncate,
+        .ftruncate = timed_ftruncate,
+        .fallocate = timed_fallocate,
+        .utime = timed_utime,
+        .init = ramdisk_init,
+        .destroy = ramdisk_destroy,
+        .flag_nullpath_ok = 1,
+        .flag_nopath = 1
+};
+
+/*
+ * Create the root directory, restoring it from the snapshot image if one
+ * was configured and is readable. Returns 0 or -ENOMEM.
+ */
+int init_root() {
+    const SnapshotNode *image = NULL;
+    if (xyfs_config.snapshot_path != NULL) {
+        image = snapshot_load(xyfs_config.snapshot_path);
+    }
+    root = alloc_node("/");
+    if (root == NULL) {
+        return -ENOMEM;
+    }
+
+    if (image != NULL && image->type == DERICTORY_NODE) {
+        root->st->st_mode = image->mode;
+        root->st->st_nlink = image->nlink;
+        root->st->st_uid = image->uid;
+        root->st->st_gid = image->gid;
+        root->st->st_size = image->size;
+        root->st->st_atime = image->atime;
+        root->st->st_mtime = image->mtime;
+        root->st->st_ctime = image->ctime;
+        root->image = image->child_count > 0 ? image : NULL;
+    } else {
+        root->st->st_mode = S_IFDIR | 0755;
+        root->st->st_nlink = 2;
+        long size_of_dir = sizeof(Node) + sizeof(struct stat);
+        root->st->st_size = size_of_dir;
+        time_t current_time;
+        time(&current_time);
+        root->st->st_mtime = current_time;
+        root->st->st_ctime = current_time;
+    }
+    root->parent_dir = NULL;
+    children_init(&root->children);
+    content_init(&root->content);
+    root->type = DERICTORY_NODE;
+    root->refcount = 1;
+    pthread_rwlock_init(&root->lock, NULL);
+
+    inode_table_init();
+    root->ino = inode_alloc(root);
+    if (root->ino == 0) {
+        free_node(root);
+        root = NULL;
+        return -ENOMEM;
+    }
+    root->st->st_ino = root->ino;
+    dcache_init();
+    return SUCCESS;
+}
+
+XyfsConfig xyfs_config;
+
+/*
+ * Open the journal at path and replay what the image does not hold onto
+ * the tree. Call after init_root, before either engine starts.
+ */
+int open_journal(const char *path) {
+    return journal_open(path, snapshot_journal_mark(), replay_record);
+}
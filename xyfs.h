@@ -11,6 +11,39 @@
 #define SUCCESS 0
 #define MAX_PATH_LENGTH 4096
 
+/* lseek whence values, defined by <unistd.h> only with _GNU_SOURCE. */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+/* renameat2 flags, likewise defined by <stdio.h> only with _GNU_SOURCE. */
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+#include <pthread.h>
+#include "content.h"
+#include "children.h"
+
+/*
+ * Concurrency
+ *
+ * Every Node carries a reader/writer lock. On a directory it guards children
+ * and the directory's stat; on a file it guards content and the file's
+ * stat. Locks are always taken parent before child, and a thread never
+ * holds locks on two nodes that are not parent and child, except in
+ * rename_node, under rename_lock. The dcache and inode table locks are
+ * innermost: they may be taken with node locks held, never the other way
+ * round.
+ *
+ * refcount is updated atomically. Lookups return a referenced node, which
+ * the caller drops with put_node; a directory's lock keeps its children
+ * alive, which is what makes taking that reference safe. The dcache looks
+ * nodes up without any lock, so a node whose count reaches zero is freed
+ * through epoch_retire rather than immediately.
+ */
 
 typedef struct node
 {
@@ -18,8 +51,119 @@ typedef struct node
     int type;
     struct stat* st;
     struct node* parent_dir;
-    char* content;
-    map_t _map;
+    Content content;
+    Children children;
+    const struct snapshot_node *image;  /* children still only in the snapshot image */
+    int refcount;   /* directory entry + open handles + kernel lookups */
+    int open_count; /* open handles */
+    unsigned long ino;
+    pthread_rwlock_t lock;
 }Node;
 
+/*
+ * An open directory. Its listing is taken when it is first read and again
+ * on every read from offset 0; entry i is names[i], with offset i + 1,
+ * and "." and ".." come first. Offsets index the listing rather than the
+ * children table, whose layout changes as it grows, so a reader resumes
+ * where it left off however the directory changes in between. Each entry
+ * holds a reference on its node.
+ */
+typedef struct dir_handle
+{
+    Node *dir;
+    int count;      /* entries, -1 before the first load */
+    Node **nodes;
+    char **names;
+    char *name_data;
+} DirHandle;
+
+/*
+ * Startup switches, parsed from the command line in main.
+ */
+typedef struct xyfs_config
+{
+    int lowlevel;   /* --lowlevel: run the inode-based engine */
+    int copy_io;    /* --copy-io: memcpy data path instead of read_buf/write_buf */
+    char *snapshot_path;            /* --snapshot=PATH: restore from and save to an image */
+    unsigned int snapshot_interval; /* --snapshot-interval=SECONDS: also save on a timer */
+    char *journal_path;             /* --journal=PATH: log changes, replay them at mount */
+    unsigned int journal_interval;  /* --journal-interval=MS: wait this long to group commits */
+    unsigned int journal_checkpoint;/* --journal-checkpoint=MB: compact past this size */
+    int dedup;                      /* --dedup: store identical blocks once */
+    unsigned int cold_after;        /* --cold-after=SECONDS: compress files idle this long */
+    unsigned int cold_cache;        /* --cold-cache=BLOCKS: decompressed chunks kept for reads */
+    double entry_timeout;           /* --entry-timeout=SECONDS: kernel keeps names this long */
+    double attr_timeout;            /* --attr-timeout=SECONDS: and attributes */
+    double negative_timeout;        /* --negative-timeout=SECONDS: and missing names */
+    int keep_cache;                 /* --no-keep-cache: drop cached file data on every open */
+    unsigned int trace;             /* --trace=ENTRIES: keep this many recent ops per thread */
+    char *trace_path;               /* --trace-file=PATH: dump them here on SIGUSR2 */
+} XyfsConfig;
+
+extern XyfsConfig xyfs_config;
+extern Node *root;
+
+/*
+ * Taken before any node lock: for reading by a rename within one
+ * directory, for writing by one between two directories, and by
+ * snapshot_save while it walks the tree. A rename between directories
+ * thus sees no other rename change the tree's shape, and a walk sees
+ * every node exactly once.
+ */
+extern pthread_rwlock_t rename_lock;
+
+/*
+ * Filesystem core shared by the path-based and the inode-based engines.
+ * Functions returning int use 0 / -errno like the FUSE callbacks.
+ */
+extern Node *get_node_by_path(const char *path);
+extern Node *get_child(Node *dir, const char *name);
+extern Children *get_children(Node *dir);
+extern void settle_children(Node *dir);
+extern DirHandle *open_dir(Node *dir);
+extern int load_dir(DirHandle *handle);
+extern void close_dir(DirHandle *handle);
+extern int make_node(Node *parent, const char *name, mode_t mode, int type, Node **out);
+extern int remove_child(Node *parent, const char *name, int type, const char *path);
+extern int rename_node(Node *from_dir, const char *from_name, Node *to_dir, const char *to_name,
+                       unsigned int flags, const char *from_path, const char *to_path);
+extern int read_node(Node *node, char *buf, size_t size, off_t offset);
+extern int write_node(Node *node, const char *buf, size_t size, off_t offset);
+extern void stat_node(Node *node, struct stat *stbuf);
+extern int truncate_node(Node *node, off_t size);
+extern int fallocate_node(Node *node, int mode, off_t offset, off_t length);
+extern off_t seek_node(Node *node, off_t offset, int whence);
+extern void get_node(Node *node);
+extern int get_node_unless_zero(Node *node);
+extern void unref_node(Node *node, unsigned long count);
+extern void put_node(Node *node);
+extern void open_node(Node *node);
+extern void release_node(Node *node);
+extern int init_root();
+
+struct stats_text;
+
+/*
+ * The stats file: fill text with every counter, and stbuf with the
+ * file's attributes.
+ */
+extern int render_stats(struct stats_text *text);
+extern void stat_stats(struct stat *stbuf);
+extern int open_journal(const char *path);
+extern void start_background();
+extern void stop_background();
+
+struct fuse_args;
+struct fuse_bufvec;
+struct fuse_conn_info;
+
+extern int read_node_buf(Node *node, struct fuse_bufvec **bufp, size_t size, off_t offset);
+extern int write_node_buf(Node *node, struct fuse_bufvec *buf, off_t offset);
+extern void request_splice(struct fuse_conn_info *conn);
+
+/*
+ * Run the low-level (inode-based) engine, see xyfs_ll.c.
+ */
+extern int xyfs_ll_main(struct fuse_args *args);
+
 #endif //XYFS_XYFS_H
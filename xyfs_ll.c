@@ -0,0 +1,628 @@
+/*
+ * Inode-based engine on the FUSE low-level API.
+ *
+ * The kernel addresses everything by inode number, so no path strings are
+ * built by libfuse or parsed here; every call starts from an inode table
+ * load. Each successful lookup/mkdir/create reply hands the kernel one
+ * reference on the Node, which forget gives back. While the kernel holds
+ * such a reference it sends no forget for that inode, so the Node behind
+ * any inode number it passes in is alive for the whole call.
+ *
+ * The kernel caches names, attributes and file data for the timeouts and
+ * keep_cache setting in xyfs_config. Nothing is invalidated from here:
+ * every change while mounted arrives as a request, which the kernel has
+ * already applied to its caches, and journal replay and snapshot restore
+ * finish before the session opens. Compressing or deduplicating a file
+ * changes neither its data nor the attributes reported for it.
+ *
+ * The stats file has the reserved number STATS_INODE, which inode_get
+ * never finds, so no Node call ever sees it; the callbacks that can reach
+ * it check for it first. Its lookups take no reference.
+ */
+#define FUSE_USE_VERSION 30
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include "hashmap.h"
+
+#include <fuse_lowlevel.h>
+
+#include "xyfs.h"
+#include "inode.h"
+#include "stats.h"
+#include "trace.h"
+
+/* The error the running callback replied with, for its timer. */
+static __thread int reply_error;
+
+static int reply_err(fuse_req_t req, int err) {
+    reply_error = -err;
+    return fuse_reply_err(req, err);
+}
+
+static Node *get_node_by_ino(fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        return NULL;
+    }
+    if (fi != NULL && fi->fh != 0) {
+        return (Node *) (uintptr_t) fi->fh;
+    }
+    return inode_get(ino);
+}
+
+static void fill_entry(Node *node, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->ino = node->ino;
+    e->generation = inode_generation(node->ino);
+    e->attr_timeout = xyfs_config.attr_timeout;
+    e->entry_timeout = xyfs_config.entry_timeout;
+    stat_node(node, &e->attr);
+}
+
+/*
+ * Reply with node, handing the kernel the caller's reference on it.
+ */
+static void reply_entry(fuse_req_t req, Node *node) {
+    struct fuse_entry_param e;
+    fill_entry(node, &e);
+    if (fuse_reply_entry(req, &e) != 0) {
+        put_node(node);
+    }
+}
+
+static int is_stats_entry(fuse_ino_t parent, const char *name) {
+    return parent == ROOT_INODE && strcmp(name, STATS_FILE_NAME) == 0;
+}
+
+static void stat_stats_inode(struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    stat_stats(st);
+    st->st_ino = STATS_INODE;
+}
+
+static void ramdisk_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (is_stats_entry(parent, name)) {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = STATS_INODE;
+        e.attr_timeout = xyfs_config.attr_timeout;
+        e.entry_timeout = xyfs_config.entry_timeout;
+        stat_stats_inode(&e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    Node *dir = inode_get(parent);
+    if (dir == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (dir->type != DERICTORY_NODE) {
+        reply_err(req, ENOTDIR);
+        return;
+    }
+    pthread_rwlock_rdlock(&dir->lock);
+    Node *node = get_child(dir, name);
+    if (node != NULL) {
+        get_node(node);
+    }
+    int stalled = children_stalled(&dir->children);
+    pthread_rwlock_unlock(&dir->lock);
+    if (stalled) {
+        settle_children(dir);
+    }
+    if (node == NULL && xyfs_config.negative_timeout > 0) {
+        /* An entry without an inode tells the kernel to remember the miss. */
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = xyfs_config.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    reply_entry(req, node);
+}
+
+static void ramdisk_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    Node *node = inode_get(ino);
+    if (node != NULL) {
+        unref_node(node, nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void ramdisk_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        Node *node = inode_get(forgets[i].ino);
+        if (node != NULL) {
+            unref_node(node, forgets[i].nlookup);
+        }
+    }
+    fuse_reply_none(req);
+}
+
+static void ramdisk_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+    if (ino == STATS_INODE) {
+        stat_stats_inode(&st);
+        fuse_reply_attr(req, &st, xyfs_config.attr_timeout);
+        return;
+    }
+    Node *node = get_node_by_ino(ino, fi);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    memset(&st, 0, sizeof(st));
+    stat_node(node, &st);
+    fuse_reply_attr(req, &st, xyfs_config.attr_timeout);
+}
+
+static void ramdisk_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                               struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        reply_err(req, EACCES);
+        return;
+    }
+    Node *node = get_node_by_ino(ino, fi);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int result = truncate_node(node, attr->st_size);
+        if (result != SUCCESS) {
+            reply_err(req, -result);
+            return;
+        }
+    }
+    pthread_rwlock_wrlock(&node->lock);
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+        node->st->st_mtime = attr->st_mtime;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        time(&node->st->st_mtime);
+    }
+    pthread_rwlock_unlock(&node->lock);
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    stat_node(node, &st);
+    fuse_reply_attr(req, &st, xyfs_config.attr_timeout);
+}
+
+static void ramdisk_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    if (is_stats_entry(parent, name)) {
+        reply_err(req, EEXIST);
+        return;
+    }
+    Node *dir = inode_get(parent);
+    if (dir == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    Node *node;
+    int result = make_node(dir, name, mode, DERICTORY_NODE, &node);
+    if (result != SUCCESS) {
+        reply_err(req, -result);
+        return;
+    }
+    reply_entry(req, node);
+}
+
+static void ramdisk_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                              struct fuse_file_info *fi) {
+    if (is_stats_entry(parent, name)) {
+        reply_err(req, EEXIST);
+        return;
+    }
+    Node *dir = inode_get(parent);
+    if (dir == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    Node *node;
+    int result = make_node(dir, name, mode, FILE_NODE, &node);
+    if (result != SUCCESS) {
+        reply_err(req, -result);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    fill_entry(node, &e);
+
+    /* make_node's reference becomes the lookup; take one for the handle. */
+    get_node(node);
+    open_node(node);
+    fi->fh = (uintptr_t) node;
+    fi->keep_cache = xyfs_config.keep_cache;
+    if (fuse_reply_create(req, &e, fi) != 0) {
+        release_node(node);
+        put_node(node);
+    }
+}
+
+static void remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name, int type) {
+    if (is_stats_entry(parent, name)) {
+        reply_err(req, type == FILE_NODE ? EPERM : ENOTDIR);
+        return;
+    }
+    Node *dir = inode_get(parent);
+    if (dir == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (dir->type != DERICTORY_NODE) {
+        reply_err(req, ENOTDIR);
+        return;
+    }
+    int result = remove_child(dir, name, type, NULL);
+    reply_err(req, -result);
+}
+
+static void ramdisk_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    remove_entry(req, parent, name, FILE_NODE);
+}
+
+static void ramdisk_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    remove_entry(req, parent, name, DERICTORY_NODE);
+}
+
+/*
+ * libfuse 2 does not pass renameat2's flags on, so none are given here;
+ * rename_node takes them for in-process callers.
+ */
+static void ramdisk_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                              const char *newname) {
+    if (is_stats_entry(parent, name) || is_stats_entry(newparent, newname)) {
+        reply_err(req, EPERM);
+        return;
+    }
+    Node *from_dir = inode_get(parent);
+    Node *to_dir = inode_get(newparent);
+    if (from_dir == NULL || to_dir == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    int result = rename_node(from_dir, name, to_dir, newname, 0, NULL, NULL);
+    reply_err(req, -result);
+}
+
+/*
+ * A stats handle holds the text rendered at open, read with direct_io.
+ */
+static void open_stats(fuse_req_t req, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        reply_err(req, EACCES);
+        return;
+    }
+    StatsText *text = (StatsText *) malloc(sizeof(StatsText));
+    if (text == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+    int result = render_stats(text);
+    if (result != SUCCESS) {
+        free(text);
+        reply_err(req, -result);
+        return;
+    }
+    fi->fh = (uintptr_t) text;
+    fi->direct_io = 1;
+    if (fuse_reply_open(req, fi) != 0) {
+        free(text->data);
+        free(text);
+    }
+}
+
+static void ramdisk_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        open_stats(req, fi);
+        return;
+    }
+    Node *node = inode_get(ino);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (node->type != FILE_NODE) {
+        reply_err(req, EISDIR);
+        return;
+    }
+    get_node(node);
+    open_node(node);
+    fi->fh = (uintptr_t) node;
+    fi->keep_cache = xyfs_config.keep_cache;
+    if (fuse_reply_open(req, fi) != 0) {
+        release_node(node);
+    }
+}
+
+static void ramdisk_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                            struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        StatsText *text = (StatsText *) (uintptr_t) fi->fh;
+        if (off >= text->length) {
+            size = 0;
+        } else if (size > text->length - off) {
+            size = text->length - off;
+        }
+        fuse_reply_buf(req, text->data + (size > 0 ? off : 0), size);
+        return;
+    }
+    Node *node = get_node_by_ino(ino, fi);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+
+    if (!xyfs_config.copy_io) {
+        struct fuse_bufvec *bufv;
+        int result = read_node_buf(node, &bufv, size, off);
+        if (result < 0) {
+            reply_err(req, -result);
+            return;
+        }
+        fuse_reply_data(req, bufv, 0);
+        free(bufv);
+        return;
+    }
+
+    char *buf = (char *) malloc(size);
+    if (buf == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+    int result = read_node(node, buf, size, off);
+    if (result < 0) {
+        reply_err(req, -result);
+    } else {
+        fuse_reply_buf(req, buf, result);
+    }
+    free(buf);
+}
+
+static void ramdisk_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                             struct fuse_file_info *fi) {
+    Node *node = get_node_by_ino(ino, fi);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    int result = write_node(node, buf, size, off);
+    if (result < 0) {
+        reply_err(req, -result);
+    } else {
+        fuse_reply_write(req, result);
+    }
+}
+
+static void ramdisk_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+                                 struct fuse_file_info *fi) {
+    Node *node = get_node_by_ino(ino, fi);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    int result = write_node_buf(node, bufv, off);
+    if (result < 0) {
+        reply_err(req, -result);
+    } else {
+        fuse_reply_write(req, result);
+    }
+}
+
+static void ramdisk_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                                 struct fuse_file_info *fi) {
+    Node *node = get_node_by_ino(ino, fi);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    reply_err(req, -fallocate_node(node, mode, offset, length));
+}
+
+static void ramdisk_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        StatsText *text = (StatsText *) (uintptr_t) fi->fh;
+        free(text->data);
+        free(text);
+        fi->fh = 0;
+    } else if (fi->fh != 0) {
+        release_node((Node *) (uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    reply_err(req, 0);
+}
+
+static void ramdisk_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    Node *node = inode_get(ino);
+    if (node == NULL) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (node->type != DERICTORY_NODE) {
+        reply_err(req, ENOTDIR);
+        return;
+    }
+    DirHandle *handle = open_dir(node);
+    if (handle == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uintptr_t) handle;
+    if (fuse_reply_open(req, fi) != 0) {
+        close_dir(handle);
+    }
+}
+
+/*
+ * Entry i of the listing has offset i + 1; "." and ".." come first. Only
+ * plain readdir is served: readdirplus needs the libfuse 3 session API,
+ * which xyfs_ll_main does not use, so the kernel pages through with
+ * offsets and looks each name up on its own.
+ */
+static void ramdisk_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                               struct fuse_file_info *fi) {
+    DirHandle *handle = (DirHandle *) (uintptr_t) fi->fh;
+    if (off == 0 || handle->count < 0) {
+        int result = load_dir(handle);
+        if (result != SUCCESS) {
+            reply_err(req, -result);
+            return;
+        }
+    }
+    char *buf = (char *) malloc(size);
+    if (buf == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    size_t used = 0;
+    int i;
+    for (i = off; i < handle->count; i++) {
+        Node *child = handle->nodes[i];
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = child->ino;
+        st.st_mode = child->st->st_mode;
+        size_t len = fuse_add_direntry(req, buf + used, size - used, handle->names[i], &st, i + 1);
+        if (len > size - used) {
+            break;
+        }
+        used += len;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ramdisk_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    close_dir((DirHandle *) (uintptr_t) fi->fh);
+    fi->fh = 0;
+    reply_err(req, 0);
+}
+
+static void ramdisk_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    request_splice(conn);
+    start_background();
+}
+
+static void ramdisk_ll_destroy(void *userdata) {
+    stop_background();
+}
+
+/*
+ * Every request is timed into the stats, with the error it was answered
+ * with, if any, and with --trace recorded against the inode it names.
+ */
+#define TIMED(op, name, params, args, ino, offset, size) \
+    static void timed_##name params { \
+        uint64_t start = stats_start(); \
+        trace_begin(op, start, offset, size); \
+        trace_ino(ino); \
+        reply_error = 0; \
+        ramdisk_ll_##name args; \
+        trace_end(stats_end(op, start, reply_error), reply_error); \
+    }
+
+TIMED(STATS_LOOKUP, lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), parent, 0, 0)
+TIMED(STATS_FORGET, forget, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup), ino, 0, 0)
+TIMED(STATS_FORGET, forget_multi, (fuse_req_t req, size_t count, struct fuse_forget_data *forgets),
+      (req, count, forgets), 0, 0, 0)
+TIMED(STATS_GETATTR, getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, 0, 0)
+TIMED(STATS_SETATTR, setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                               struct fuse_file_info *fi), (req, ino, attr, to_set, fi),
+      ino, (to_set & FUSE_SET_ATTR_SIZE) ? attr->st_size : 0, 0)
+TIMED(STATS_MKDIR, mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+      (req, parent, name, mode), parent, 0, 0)
+TIMED(STATS_CREATE, create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                             struct fuse_file_info *fi), (req, parent, name, mode, fi), parent, 0, 0)
+TIMED(STATS_UNLINK, unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), parent, 0, 0)
+TIMED(STATS_RMDIR, rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), parent, 0, 0)
+TIMED(STATS_RENAME, rename, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                             const char *newname), (req, parent, name, newparent, newname), parent, 0, 0)
+TIMED(STATS_OPEN, open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, 0, 0)
+TIMED(STATS_READ, read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+      (req, ino, size, off, fi), ino, off, size)
+TIMED(STATS_WRITE, write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                           struct fuse_file_info *fi), (req, ino, buf, size, off, fi), ino, off, size)
+TIMED(STATS_WRITE, write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+                               struct fuse_file_info *fi), (req, ino, bufv, off, fi), ino, off, fuse_buf_size(bufv))
+TIMED(STATS_FALLOCATE, fallocate, (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                                   struct fuse_file_info *fi), (req, ino, mode, offset, length, fi),
+      ino, offset, length)
+TIMED(STATS_RELEASE, release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, 0, 0)
+TIMED(STATS_OPENDIR, opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, 0, 0)
+TIMED(STATS_READDIR, readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+      (req, ino, size, off, fi), ino, off, size)
+TIMED(STATS_RELEASEDIR, releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi),
+      ino, 0, 0)
+
+static struct fuse_lowlevel_ops ramdisk_ll_operations = {
+        .init = ramdisk_ll_init,
+        .destroy = ramdisk_ll_destroy,
+        .lookup = timed_lookup,
+        .forget = timed_forget,
+        .forget_multi = timed_forget_multi,
+        .getattr = timed_getattr,
+        .setattr = timed_setattr,
+        .mkdir = timed_mkdir,
+        .create = timed_create,
+        .unlink = timed_unlink,
+        .rmdir = timed_rmdir,
+        .rename = timed_rename,
+        .open = timed_open,
+        .read = timed_read,
+        .write = timed_write,
+        .write_buf = timed_write_buf,
+        .fallocate = timed_fallocate,
+        .release = timed_release,
+        .opendir = timed_opendir,
+        .readdir = timed_readdir,
+        .releasedir = timed_releasedir
+};
+
+int xyfs_ll_main(struct fuse_args *args) {
+    struct fuse_chan *ch;
+    char *mountpoint = NULL;
+    int multithreaded;
+    int foreground;
+    int err = -1;
+
+    if (xyfs_config.copy_io) {
+        ramdisk_ll_operations.write_buf = NULL;
+    }
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, args)) != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &ramdisk_ll_operations,
+                                                    sizeof(ramdisk_ll_operations), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                if (multithreaded) {
+                    err = fuse_session_loop_mt(se);
+                } else {
+                    err = fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    return err ? 1 : 0;
+}